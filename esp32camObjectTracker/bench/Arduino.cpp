@@ -0,0 +1,4 @@
+// Serial of the host Arduino stand-in, see Arduino.h
+#include "Arduino.h"
+
+HostSerial Serial;
@@ -0,0 +1,36 @@
+// Just enough of the Arduino API to build the detection code on a host
+// computer, see detect_bench.cpp and corpus_bench.cpp.
+#ifndef BENCH_ARDUINO_H
+#define BENCH_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#define F(x) x
+#define HEX 16
+
+struct HostSerial
+{
+    template <typename... Args>
+    int printf(const char *format, Args... args)
+    {
+        return ::printf(format, args...);
+    }
+    template <typename T>
+    void print(T) {}
+    template <typename T>
+    void print(T, int) {}
+    template <typename T>
+    void println(T) {}
+    template <typename T>
+    void println(T, int) {}
+    void println() {}
+};
+
+extern HostSerial Serial;
+
+#endif
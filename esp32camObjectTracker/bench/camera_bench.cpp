@@ -0,0 +1,198 @@
+// Capture loop of the vision task on the host camera (host/host_camera.h).
+// Takes frames with esp_camera_fb_get(), detects the red object in them
+// the way the vision task does for the pixel format, and reports the
+// frames per second, the time from the end of the exposure to the
+// detection result, and the frames the camera replaced or dropped.
+//
+// Build from the esp32camObjectTracker directory:
+//
+//   g++ -O2 -std=gnu++11 -pthread -Ihost -Ibench -Ilib/esp32cam
+//       -o camera_bench bench/camera_bench.cpp bench/Arduino.cpp
+//       host/esp_camera.cpp host/img_converters.cpp
+//       lib/esp32cam/detect.cpp lib/esp32cam/jpeg.cpp
+//       lib/esp32cam/blob.cpp lib/esp32cam/mask.cpp -ljpeg
+//   ./camera_bench --camera mjpeg:recording.mjpeg --fps 30 --format jpeg
+//
+// Options, besides those of the camera:
+//   --format <f>       jpeg, rgb565, yuv422 or gray (jpeg)
+//   --framesize <n>    framesize_t number, 1 is QQVGA (1)
+//   --fb-count <n>     Frame buffers (3)
+//   --grab <mode>      latest or empty (latest)
+//   --work-us <n>      Extra time per frame, like the handlers served (0)
+//   --seconds <n>      Length of the run (10)
+
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+#include "Arduino.h"
+#include "esp_camera.h"
+#include "esp_timer.h"
+#include "img_converters.h"
+#include "host_camera.h"
+#include "detect.h"
+
+#define RED_LEVEL 170
+#define GREEN_LEVEL 60
+#define BLUE_LEVEL 80
+
+static int64_t percentile(std::vector<int64_t> &values, int p)
+{
+    if (values.empty())
+    {
+        return 0;
+    }
+    size_t i = std::min(values.size() - 1, values.size() * p / 100);
+    std::nth_element(values.begin(), values.begin() + i, values.end());
+    return values[i];
+}
+
+static void usage()
+{
+    fprintf(stderr, "camera_bench [options]\n%s"
+                    "  --format <f>        jpeg, rgb565, yuv422 or gray (jpeg)\n"
+                    "  --framesize <n>     framesize_t number, 1 is QQVGA (1)\n"
+                    "  --fb-count <n>      Frame buffers (3)\n"
+                    "  --grab <mode>       latest or empty (latest)\n"
+                    "  --work-us <n>       Extra time per frame (0)\n"
+                    "  --seconds <n>       Length of the run (10)\n",
+            HOST_CAMERA_USAGE);
+}
+
+int main(int argc, char **argv)
+{
+    camera_config_t config = {};
+    config.pixel_format = PIXFORMAT_JPEG;
+    config.frame_size = FRAMESIZE_QQVGA;
+    config.jpeg_quality = 10;
+    config.fb_count = 3;
+    config.fb_location = CAMERA_FB_IN_PSRAM;
+    config.grab_mode = CAMERA_GRAB_LATEST;
+    config.xclk_freq_hz = 20000000;
+    int work_us = 0;
+    int seconds = 10;
+
+    for (int i = 1; i < argc; i += 2)
+    {
+        const char *name = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (value == NULL)
+        {
+            usage();
+            return 1;
+        }
+        if (hostCameraArg(name, value))
+        {
+            continue;
+        }
+        else if (!strcmp(name, "--format"))
+        {
+            config.pixel_format = !strcmp(value, "rgb565")   ? PIXFORMAT_RGB565
+                                  : !strcmp(value, "yuv422") ? PIXFORMAT_YUV422
+                                  : !strcmp(value, "gray")   ? PIXFORMAT_GRAYSCALE
+                                                             : PIXFORMAT_JPEG;
+        }
+        else if (!strcmp(name, "--framesize"))
+        {
+            config.frame_size = (framesize_t)atoi(value);
+        }
+        else if (!strcmp(name, "--fb-count"))
+        {
+            config.fb_count = std::max(1, atoi(value));
+        }
+        else if (!strcmp(name, "--grab"))
+        {
+            config.grab_mode = !strcmp(value, "empty") ? CAMERA_GRAB_WHEN_EMPTY : CAMERA_GRAB_LATEST;
+        }
+        else if (!strcmp(name, "--work-us"))
+        {
+            work_us = std::max(0, atoi(value));
+        }
+        else if (!strcmp(name, "--seconds"))
+        {
+            seconds = std::max(1, atoi(value));
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if (esp_camera_init(&config) != ESP_OK)
+    {
+        return 1;
+    }
+    static ColorLut lut;
+    colorLutBuildLevels(lut, RED_LEVEL, GREEN_LEVEL, BLUE_LEVEL);
+    FrameFormat raw = config.pixel_format == PIXFORMAT_RGB565   ? FRAME_RGB565
+                      : config.pixel_format == PIXFORMAT_YUV422 ? FRAME_YUV422
+                                                                : FRAME_GRAY8;
+
+    printf("%-8s %7s %9s %9s %9s %9s %6s %8s %7s %5s\n", "second", "fps", "wait p50", "lat p50", "lat p99",
+           "lat max", "found", "replaced", "dropped", "late");
+    int64_t end = esp_timer_get_time() + (int64_t)seconds * 1000000;
+    int64_t next = esp_timer_get_time() + 1000000;
+    std::vector<int64_t> waits, latencies;
+    int found = 0;
+    HostCameraStats last = hostCameraStats();
+    for (int second = 1; esp_timer_get_time() < end;)
+    {
+        int64_t asked = esp_timer_get_time();
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (fb == NULL)
+        {
+            break;
+        }
+        int64_t got = esp_timer_get_time();
+
+        int left, top, right, bottom;
+        bool hit;
+        if (fb->format == PIXFORMAT_JPEG)
+        {
+            uint8_t *bmp = NULL;
+            size_t bmp_len = 0;
+            hit = frame2bmp(fb, &bmp, &bmp_len) &&
+                  detect(bmp, bmp_len, RED_LEVEL, GREEN_LEVEL, BLUE_LEVEL, left, top, right, bottom);
+            free(bmp);
+        }
+        else
+        {
+            hit = detectRaw(fb->buf, fb->len, fb->width, fb->height, raw, lut, left, top, right, bottom);
+        }
+        if (work_us > 0)
+        {
+            usleep(work_us);
+        }
+        int64_t exposed = (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+        esp_camera_fb_return(fb);
+
+        int64_t now = esp_timer_get_time();
+        waits.push_back(got - asked);
+        latencies.push_back(now - exposed);
+        found += hit ? 1 : 0;
+        if (now >= next)
+        {
+            HostCameraStats stats = hostCameraStats();
+            size_t frames = latencies.size();
+            int64_t wait50 = percentile(waits, 50);
+            int64_t lat50 = percentile(latencies, 50);
+            int64_t lat99 = percentile(latencies, 99);
+            int64_t latMax = *std::max_element(latencies.begin(), latencies.end());
+            printf("%-8d %7zu %7.1fms %7.1fms %7.1fms %7.1fms %6d %8u %7u %5u\n", second, frames,
+                   wait50 / 1000.0, lat50 / 1000.0, lat99 / 1000.0, latMax / 1000.0, found,
+                   stats.replaced - last.replaced, stats.dropped - last.dropped, stats.late - last.late);
+            last = stats;
+            waits.clear();
+            latencies.clear();
+            found = 0;
+            next += 1000000;
+            second++;
+        }
+    }
+
+    HostCameraStats stats = hostCameraStats();
+    printf("Sensor %u frames, delivered %u, replaced %u, dropped %u, late %u\n",
+           stats.produced, stats.delivered, stats.replaced, stats.dropped, stats.late);
+    esp_camera_deinit();
+    return 0;
+}
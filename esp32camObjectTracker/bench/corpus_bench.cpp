@@ -0,0 +1,436 @@
+// Host benchmark of the detection library over a corpus of frames. Runs
+// detect(), getCalibration() and drawRect() on the BMP of every frame and
+// detectRaw() and getCalibrationRaw() on its RGB565 form, and reports the
+// cost of each kernel in ns per pixel and frames per second with the heap
+// allocations it makes per frame.
+//
+// Build and run with PlatformIO (env:native in platformio.ini):
+//
+//   pio run -e native -t exec
+//
+// or from the esp32camObjectTracker directory:
+//
+//   g++ -O2 -std=gnu++11 -Ibench -Ilib/esp32cam -o corpus_bench
+//       bench/corpus_bench.cpp bench/Arduino.cpp lib/esp32cam/detect.cpp
+//       lib/esp32cam/jpeg.cpp lib/esp32cam/blob.cpp lib/esp32cam/mask.cpp
+//       lib/esp32cam/draw.cpp
+//   ./corpus_bench [options] [file or directory ...]
+//
+// The corpus is made of 24-bit .bmp files and raw .rgb565 frames
+// (big-endian, as the sensor delivers them, of the size set with --size).
+// Directories are searched for both. Without files a synthetic corpus of a
+// red square moving over a noisy background is used.
+//
+// Options:
+//   --runs <n>         Passes over the corpus, 20 by default
+//   --size <w>x<h>     Size of the .rgb565 frames, 320x240 by default
+//   --levels <r>,<g>,<b>  Levels for detect(), 170,60,80 by default
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "Arduino.h"
+#include "detect.h"
+
+// Heap allocations counted while a kernel is timed. glibc lets a program
+// replace malloc(), operator new ends up here as well.
+static bool counting = false;
+static unsigned long alloc_count = 0;
+static unsigned long alloc_bytes = 0;
+
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+extern "C" void *malloc(size_t size)
+{
+    if (counting)
+    {
+        alloc_count++;
+        alloc_bytes += size;
+    }
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+    if (counting)
+    {
+        alloc_count++;
+        alloc_bytes += count * size;
+    }
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    if (counting)
+    {
+        alloc_count++;
+        alloc_bytes += size;
+    }
+    return __libc_realloc(ptr, size);
+}
+#define ALLOC_COUNTS 1
+#else
+#define ALLOC_COUNTS 0 // Counts need the glibc malloc replacement
+#endif
+
+// One frame of the corpus in the layouts the kernels take
+struct Frame
+{
+    std::string name;
+    int width, height;
+    std::vector<uint8_t> bmp;    // Top-down 24-bit BMP, as frame2bmp() makes
+    std::vector<uint8_t> draw;   // Copy of bmp for drawRect() to paint on
+    std::vector<uint8_t> rgb565; // Big-endian RGB565
+};
+
+// Fill in the BMP and RGB565 forms of a frame from its RGB pixels
+static void frameFromRgb(Frame &frame, int width, int height, const uint8_t *rgb)
+{
+    frame.width = width;
+    frame.height = height;
+    int stride = ((width * 3 + 3) / 4) * 4;
+    frame.bmp.assign(54 + stride * height, 0);
+    uint8_t *header = frame.bmp.data();
+    uint32_t fileSize = frame.bmp.size(), offset = 54, infoSize = 40;
+    int32_t w = width, h = -height; // Negative height, rows top-down
+    uint16_t planes = 1, bits = 24;
+    header[0] = 'B';
+    header[1] = 'M';
+    memcpy(&header[2], &fileSize, 4);
+    memcpy(&header[10], &offset, 4);
+    memcpy(&header[14], &infoSize, 4);
+    memcpy(&header[18], &w, 4);
+    memcpy(&header[22], &h, 4);
+    memcpy(&header[26], &planes, 2);
+    memcpy(&header[28], &bits, 2);
+
+    frame.rgb565.resize(width * height * 2);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            const uint8_t *p = rgb + (y * width + x) * 3;
+            uint8_t *q = &frame.bmp[54 + y * stride + x * 3];
+            q[0] = p[2];
+            q[1] = p[1];
+            q[2] = p[0];
+            uint16_t v = ((p[0] >> 3) << 11) | ((p[1] >> 2) << 5) | (p[2] >> 3);
+            frame.rgb565[(y * width + x) * 2] = v >> 8;
+            frame.rgb565[(y * width + x) * 2 + 1] = v & 0xFF;
+        }
+    }
+    frame.draw = frame.bmp;
+}
+
+static bool readFile(const std::string &path, std::vector<uint8_t> &data)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == NULL)
+    {
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data.resize(size > 0 ? size : 0);
+    bool ok = size > 0 && fread(data.data(), 1, size, f) == (size_t)size;
+    fclose(f);
+    return ok;
+}
+
+static bool hasSuffix(const std::string &s, const char *suffix)
+{
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+// Any uncompressed 24-bit BMP, whatever its header size and row order
+static bool loadBmp(const std::string &path, Frame &frame)
+{
+    std::vector<uint8_t> data;
+    if (!readFile(path, data) || data.size() < 54 || data[0] != 'B' || data[1] != 'M')
+    {
+        return false;
+    }
+    uint32_t offset, compression;
+    int32_t width, height;
+    uint16_t bits;
+    memcpy(&offset, &data[10], 4);
+    memcpy(&width, &data[18], 4);
+    memcpy(&height, &data[22], 4);
+    memcpy(&bits, &data[28], 2);
+    memcpy(&compression, &data[30], 4);
+    bool bottomUp = height > 0;
+    height = bottomUp ? height : -height;
+    int stride = ((width * 3 + 3) / 4) * 4;
+    if (bits != 24 || compression != 0 || width <= 0 || height <= 0 ||
+        data.size() < offset + (size_t)stride * height)
+    {
+        return false;
+    }
+
+    std::vector<uint8_t> rgb(width * height * 3);
+    for (int y = 0; y < height; y++)
+    {
+        const uint8_t *row = &data[offset + (bottomUp ? height - 1 - y : y) * stride];
+        for (int x = 0; x < width; x++)
+        {
+            uint8_t *p = &rgb[(y * width + x) * 3];
+            p[0] = row[x * 3 + 2];
+            p[1] = row[x * 3 + 1];
+            p[2] = row[x * 3];
+        }
+    }
+    frameFromRgb(frame, width, height, rgb.data());
+    return true;
+}
+
+static bool loadRgb565(const std::string &path, int width, int height, Frame &frame)
+{
+    std::vector<uint8_t> data;
+    if (!readFile(path, data) || data.size() != (size_t)width * height * 2)
+    {
+        return false;
+    }
+    std::vector<uint8_t> rgb(width * height * 3);
+    for (int i = 0; i < width * height; i++)
+    {
+        uint16_t v = (data[i * 2] << 8) | data[i * 2 + 1];
+        rgb[i * 3] = ((v >> 11) & 0x1F) << 3;
+        rgb[i * 3 + 1] = ((v >> 5) & 0x3F) << 2;
+        rgb[i * 3 + 2] = (v & 0x1F) << 3;
+    }
+    frameFromRgb(frame, width, height, rgb.data());
+    return true;
+}
+
+static void loadPath(const std::string &path, int width, int height, std::vector<Frame> &corpus)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+    {
+        fprintf(stderr, "Cannot read %s\n", path.c_str());
+        return;
+    }
+    if (S_ISDIR(st.st_mode))
+    {
+        std::vector<std::string> names;
+        DIR *dir = opendir(path.c_str());
+        for (struct dirent *e = dir ? readdir(dir) : NULL; e != NULL; e = readdir(dir))
+        {
+            std::string name = e->d_name;
+            if (hasSuffix(name, ".bmp") || hasSuffix(name, ".rgb565"))
+            {
+                names.push_back(path + "/" + name);
+            }
+        }
+        if (dir != NULL)
+        {
+            closedir(dir);
+        }
+        std::sort(names.begin(), names.end());
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            loadPath(names[i], width, height, corpus);
+        }
+        return;
+    }
+
+    Frame frame;
+    frame.name = path;
+    bool ok = hasSuffix(path, ".rgb565") ? loadRgb565(path, width, height, frame) : loadBmp(path, frame);
+    if (ok)
+    {
+        corpus.push_back(frame);
+    }
+    else
+    {
+        fprintf(stderr, "Skipped %s, not a 24-bit BMP or a %dx%d RGB565 frame\n", path.c_str(), width, height);
+    }
+}
+
+// Red square moving over a noisy QVGA background
+static void makeSynthetic(std::vector<Frame> &corpus)
+{
+    const int width = 320, height = 240, count = 16;
+    std::vector<uint8_t> rgb(width * height * 3);
+    srand(1);
+    for (int i = 0; i < count; i++)
+    {
+        int x0 = 20 + i * 16, y0 = 40 + i * 8;
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                bool red = x >= x0 && x < x0 + 30 && y >= y0 && y < y0 + 30;
+                uint8_t *p = &rgb[(y * width + x) * 3];
+                p[0] = red ? 230 : rand() % 150;
+                p[1] = red ? 30 : 60 + rand() % 196;
+                p[2] = red ? 40 : rand() % 256;
+            }
+        }
+        Frame frame;
+        frame.name = "synthetic";
+        frameFromRgb(frame, width, height, rgb.data());
+        corpus.push_back(frame);
+    }
+}
+
+// Cost of one kernel over all passes
+struct Result
+{
+    const char *name;
+    double ns;                   // Total time
+    unsigned long allocs, bytes; // Counted after the warm-up pass
+    int hits;                    // Frames of the last pass the kernel succeeded on
+};
+
+// Run a kernel over the corpus: one warm-up pass that is not counted, so
+// buffers kept between calls do not show up, then the timed passes
+template <typename Fn>
+static Result runKernel(const char *name, std::vector<Frame> &corpus, int runs, Fn fn)
+{
+    Result result = {name, 0, 0, 0, 0};
+    for (size_t i = 0; i < corpus.size(); i++)
+    {
+        fn(corpus[i]);
+    }
+
+    alloc_count = 0;
+    alloc_bytes = 0;
+    counting = true;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int run = 0; run < runs; run++)
+    {
+        result.hits = 0;
+        for (size_t i = 0; i < corpus.size(); i++)
+        {
+            result.hits += fn(corpus[i]) ? 1 : 0;
+        }
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    counting = false;
+    result.ns = elapsed.count();
+    result.allocs = alloc_count;
+    result.bytes = alloc_bytes;
+    return result;
+}
+
+static void report(const Result &r, int runs, size_t frames, double pixels)
+{
+    double calls = (double)runs * frames;
+    printf("%-18s %9.3f %10.1f", r.name, r.ns / (runs * pixels), calls * 1e9 / r.ns);
+    if (ALLOC_COUNTS)
+    {
+        printf(" %9.2f %11.0f", r.allocs / calls, r.bytes / calls);
+    }
+    else
+    {
+        printf(" %9s %11s", "-", "-");
+    }
+    printf(" %5d/%zu\n", r.hits, frames);
+}
+
+int main(int argc, char **argv)
+{
+    int runs = 20;
+    int width = 320, height = 240;
+    int red_level = 170, green_level = 60, blue_level = 80;
+    std::vector<Frame> corpus;
+    bool paths = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--runs") && i + 1 < argc)
+        {
+            runs = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--size") && i + 1 < argc)
+        {
+            if (sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+            {
+                fprintf(stderr, "Bad size %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--levels") && i + 1 < argc)
+        {
+            if (sscanf(argv[++i], "%d,%d,%d", &red_level, &green_level, &blue_level) != 3)
+            {
+                fprintf(stderr, "Bad levels %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else
+        {
+            loadPath(argv[i], width, height, corpus);
+            paths = true;
+        }
+    }
+    if (!paths)
+    {
+        makeSynthetic(corpus);
+    }
+    if (corpus.empty())
+    {
+        fprintf(stderr, "No frames\n");
+        return 1;
+    }
+
+    double pixels = 0; // Per pass
+    for (size_t i = 0; i < corpus.size(); i++)
+    {
+        pixels += (double)corpus[i].width * corpus[i].height;
+    }
+    printf("%zu frames, %.0f pixels per pass, %d runs, levels %d,%d,%d\n",
+           corpus.size(), pixels, runs, red_level, green_level, blue_level);
+
+    static ColorLut lut;
+    colorLutBuildLevels(lut, red_level, green_level, blue_level);
+    int l, t, r, b;
+    int levels[3];
+    std::vector<Result> results;
+
+    results.push_back(runKernel("detect", corpus, runs, [&](Frame &f)
+                                { return detect(f.bmp.data(), f.bmp.size(), red_level, green_level, blue_level, l, t, r, b); }));
+    results.push_back(runKernel("detectRaw RGB565", corpus, runs, [&](Frame &f)
+                                { return detectRaw(f.rgb565.data(), f.rgb565.size(), f.width, f.height, FRAME_RGB565, lut, l, t, r, b); }));
+    results.push_back(runKernel("getCalibration", corpus, runs, [&](Frame &f)
+                                { return getCalibration(f.bmp.data(), f.bmp.size(), levels[0], levels[1], levels[2]); }));
+    results.push_back(runKernel("getCalibrationRaw", corpus, runs, [&](Frame &f)
+                                { return getCalibrationRaw(f.rgb565.data(), f.rgb565.size(), f.width, f.height, FRAME_RGB565, levels[0], levels[1], levels[2]); }));
+
+    // The box of every frame, drawn on its copy
+    std::vector<int> boxes(corpus.size() * 4, -1);
+    for (size_t i = 0; i < corpus.size(); i++)
+    {
+        int *box = &boxes[i * 4];
+        if (!detect(corpus[i].bmp.data(), corpus[i].bmp.size(), red_level, green_level, blue_level, box[0], box[1], box[2], box[3]))
+        {
+            box[0] = -1;
+        }
+    }
+    Frame *first = &corpus[0];
+    results.push_back(runKernel("drawRect", corpus, runs, [&](Frame &f)
+                                {
+                                    const int *box = &boxes[(&f - first) * 4];
+                                    return box[0] >= 0 && drawRect(f.draw.data(), f.draw.size(), box[0], box[1], box[2], box[3]) == 0;
+                                }));
+
+    printf("%-18s %9s %10s %9s %11s %7s\n", "kernel", "ns/pixel", "frames/s", "allocs/f", "bytes/f", "ok");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        report(results[i], runs, corpus.size(), pixels);
+    }
+    if (!ALLOC_COUNTS)
+    {
+        printf("Allocation counts need glibc\n");
+    }
+    return 0;
+}
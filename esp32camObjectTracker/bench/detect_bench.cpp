@@ -0,0 +1,279 @@
+// Host benchmark of the detection kernels. Compares the per pixel cost of
+// the templated ImageView kernels with the kernels they replaced: detectLut()
+// as it parsed the BMP and branched on the row order for every pixel, and
+// the raw frame scan that switched on the pixel format for every pixel.
+//
+// Build and run from the esp32camObjectTracker directory:
+//
+//   g++ -O2 -std=gnu++11 -Ibench -Ilib/esp32cam -o detect_bench
+//       bench/detect_bench.cpp bench/Arduino.cpp lib/esp32cam/detect.cpp
+//       lib/esp32cam/jpeg.cpp lib/esp32cam/blob.cpp lib/esp32cam/mask.cpp
+//   ./detect_bench
+
+#include <chrono>
+#include <vector>
+#include "Arduino.h"
+#include "detect.h"
+
+#define WIDTH 320
+#define HEIGHT 240
+#define RUNS 200
+#define BATCHES 9 // The fastest batch counts, the others were interrupted
+
+#define RED_LEVEL 170
+#define GREEN_LEVEL 60
+#define BLUE_LEVEL 80
+
+// detectLut() before the image view: header parsing and a row order branch
+// for every pixel
+static bool legacyDetect(
+    uint8_t *buf, int buf_len, const ColorLut &lut,
+    int &left, int &top, int &right, int &bottom)
+{
+    const int HEADER_SIZE = 54;
+    if (buf_len <= HEADER_SIZE)
+    {
+        return false;
+    }
+
+    int width = *reinterpret_cast<int *>(&buf[18]);
+    int height = *reinterpret_cast<int *>(&buf[22]);
+    int bitsPerPixel = *reinterpret_cast<short *>(&buf[28]);
+    if (bitsPerPixel != 24)
+    {
+        return false;
+    }
+
+    int paddedRowSize = ((width * 3 + 3) / 4) * 4;
+    bool isTopDown = height < 0;
+    if (isTopDown)
+    {
+        height = -height;
+    }
+    if (buf_len < HEADER_SIZE + paddedRowSize * height)
+    {
+        return false;
+    }
+
+    uint8_t *pixelData = buf + HEADER_SIZE;
+    left = width;
+    top = height;
+    right = -1;
+    bottom = -1;
+    bool found = false;
+
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int actualY = isTopDown ? y : (height - 1 - y);
+            int pos = actualY * paddedRowSize + x * 3;
+            if (colorLutBGR(lut, &pixelData[pos]))
+            {
+                left = std::min(left, x);
+                top = std::min(top, y);
+                right = std::max(right, x);
+                bottom = std::max(bottom, y);
+                found = true;
+            }
+        }
+    }
+    if (!found)
+    {
+        return false;
+    }
+
+    top = height - top - 1;
+    bottom = height - bottom - 1;
+    return true;
+}
+
+// Raw frame scan before the image view: a format switch for every pixel
+static inline bool legacyMatchPixel(
+    const uint8_t *row, int x, FrameFormat format, const ColorLut &lut)
+{
+    switch (format)
+    {
+    case FRAME_RGB565:
+        return colorLutRGB565(lut, row + x * 2);
+    case FRAME_YUV422:
+    {
+        const uint8_t *p = row + (x & ~1) * 2;
+        return colorLutYUV(lut, p[(x & 1) * 2], p[1], p[3]);
+    }
+    default:
+        return colorLutBGR(lut, row + x * 3);
+    }
+}
+
+static bool legacyDetectRaw(
+    const uint8_t *buf, int width, int height, FrameFormat format, const ColorLut &lut,
+    int &left, int &top, int &right, int &bottom)
+{
+    int stride = width * (format == FRAME_BGR888 ? 3 : 2);
+    left = width;
+    top = height;
+    right = -1;
+    bottom = -1;
+    for (int y = 0; y < height; y++)
+    {
+        const uint8_t *row = buf + y * stride;
+        for (int x = 0; x < width; x++)
+        {
+            if (legacyMatchPixel(row, x, format, lut))
+            {
+                left = std::min(left, x);
+                top = std::min(top, y);
+                right = std::max(right, x);
+                bottom = std::max(bottom, y);
+            }
+        }
+    }
+    if (right < 0)
+    {
+        return false;
+    }
+    top = height - top - 1;
+    bottom = height - bottom - 1;
+    return true;
+}
+
+// Test scene: a noisy background with a red square
+struct Frames
+{
+    std::vector<uint8_t> bmpTopDown, bmpBottomUp, rgb565, yuv422, gray;
+};
+
+static void makeFrames(Frames &f)
+{
+    int stride = ((WIDTH * 3 + 3) / 4) * 4;
+    f.bmpTopDown.assign(54 + stride * HEIGHT, 0);
+    f.bmpBottomUp.assign(54 + stride * HEIGHT, 0);
+    f.rgb565.resize(WIDTH * HEIGHT * 2);
+    f.yuv422.resize(WIDTH * HEIGHT * 2);
+    f.gray.resize(WIDTH * HEIGHT);
+
+    for (int i = 0; i < 2; i++)
+    {
+        uint8_t *bmp = i ? f.bmpBottomUp.data() : f.bmpTopDown.data();
+        int32_t width = WIDTH, height = i ? HEIGHT : -HEIGHT;
+        int16_t bits = 24;
+        bmp[0] = 'B';
+        bmp[1] = 'M';
+        memcpy(&bmp[18], &width, 4);
+        memcpy(&bmp[22], &height, 4);
+        memcpy(&bmp[28], &bits, 2);
+    }
+
+    srand(1);
+    for (int y = 0; y < HEIGHT; y++)
+    {
+        for (int x = 0; x < WIDTH; x++)
+        {
+            bool red = x >= 150 && x < 180 && y >= 100 && y < 130;
+            int r = red ? 230 : rand() % 150;
+            int g = red ? 30 : 60 + rand() % 196;
+            int b = red ? 40 : rand() % 256;
+
+            uint8_t *p = &f.bmpTopDown[54 + y * stride + x * 3];
+            p[0] = b;
+            p[1] = g;
+            p[2] = r;
+            p = &f.bmpBottomUp[54 + (HEIGHT - 1 - y) * stride + x * 3];
+            p[0] = b;
+            p[1] = g;
+            p[2] = r;
+
+            uint16_t v = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+            f.rgb565[(y * WIDTH + x) * 2] = v >> 8;
+            f.rgb565[(y * WIDTH + x) * 2 + 1] = v & 0xFF;
+
+            int luma = (77 * r + 150 * g + 29 * b) >> 8;
+            uint8_t *q = &f.yuv422[(y * WIDTH + (x & ~1)) * 2];
+            q[(x & 1) * 2] = luma;
+            q[1] = std::min(255, std::max(0, ((-43 * r - 85 * g + 128 * b) >> 8) + 128));
+            q[3] = std::min(255, std::max(0, ((128 * r - 107 * g - 21 * b) >> 8) + 128));
+            f.gray[y * WIDTH + x] = luma;
+        }
+    }
+}
+
+// Nanoseconds per pixel of a detection call, best of BATCHES batches
+template <typename Fn>
+static double timePerPixel(Fn fn)
+{
+    double best = 0;
+    for (int batch = 0; batch < BATCHES; batch++)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int i = 0; i < RUNS; i++)
+        {
+            fn();
+        }
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        double perPixel = elapsed.count() / RUNS / (WIDTH * HEIGHT);
+        best = batch == 0 ? perPixel : std::min(best, perPixel);
+    }
+    return best;
+}
+
+static int box[4];
+
+static void report(const char *name, double before, double after)
+{
+    if (before > 0)
+    {
+        printf("%-16s %8.2f %8.2f %7.2fx  box %d %d %d %d\n", name, before, after, before / after, box[0], box[1], box[2], box[3]);
+    }
+    else
+    {
+        printf("%-16s %8s %8.2f %8s  box %d %d %d %d\n", name, "-", after, "", box[0], box[1], box[2], box[3]);
+    }
+}
+
+int main()
+{
+    static Frames f;
+    static ColorLut lut;
+    makeFrames(f);
+    colorLutBuildLevels(lut, RED_LEVEL, GREEN_LEVEL, BLUE_LEVEL);
+
+    int &l = box[0], &t = box[1], &r = box[2], &b = box[3];
+    printf("%dx%d, best of %d x %d runs, ns per pixel\n", WIDTH, HEIGHT, BATCHES, RUNS);
+    printf("%-16s %8s %8s %8s\n", "kernel", "before", "after", "speedup");
+
+    for (int i = 0; i < 2; i++)
+    {
+        std::vector<uint8_t> &bmp = i ? f.bmpBottomUp : f.bmpTopDown;
+        double before = timePerPixel([&]()
+                                     { legacyDetect(bmp.data(), bmp.size(), lut, l, t, r, b); });
+        double after = timePerPixel([&]()
+                                    { detectLut(bmp.data(), bmp.size(), lut, l, t, r, b); });
+        report(i ? "BMP bottom-up" : "BMP top-down", before, after);
+    }
+
+    struct
+    {
+        const char *name;
+        std::vector<uint8_t> &buf;
+        FrameFormat format;
+    } raw[] = {
+        {"RGB565", f.rgb565, FRAME_RGB565},
+        {"YUV422", f.yuv422, FRAME_YUV422},
+    };
+    for (auto &frame : raw)
+    {
+        double before = timePerPixel([&]()
+                                     { legacyDetectRaw(frame.buf.data(), WIDTH, HEIGHT, frame.format, lut, l, t, r, b); });
+        double after = timePerPixel([&]()
+                                    { detectRaw(frame.buf.data(), frame.buf.size(), WIDTH, HEIGHT, frame.format, lut, l, t, r, b); });
+        report(frame.name, before, after);
+    }
+
+    // Gray frames only exist with the image view, nothing to compare with
+    l = t = r = b = -1;
+    double gray = timePerPixel([&]()
+                               { detectRaw(f.gray.data(), f.gray.size(), WIDTH, HEIGHT, FRAME_GRAY8, lut, l, t, r, b); });
+    report("GRAY8", 0, gray);
+    return 0;
+}
@@ -0,0 +1,60 @@
+// Arduino API of the firmware for the host build: Serial of the detection
+// benchmarks (bench/Arduino.h), timing, logging and FreeRTOS. The LED
+// functions do nothing, the host has no flash LED.
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <unistd.h>
+#include "../bench/Arduino.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "esp32-hal-ledc.h"
+#include "esp32-hal-log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+static inline void delay(uint32_t ms)
+{
+    usleep((useconds_t)ms * 1000);
+}
+
+static inline unsigned long millis()
+{
+    return (unsigned long)(esp_timer_get_time() / 1000);
+}
+
+static inline unsigned long micros()
+{
+    return (unsigned long)esp_timer_get_time();
+}
+
+// Integer to text in a base from 2 to 36, as in the Arduino core
+static inline char *itoa(int value, char *str, int base)
+{
+    char digits[34];
+    unsigned int v = value < 0 && base == 10 ? -(unsigned int)value : (unsigned int)value;
+    int n = 0;
+    do
+    {
+        int d = v % base;
+        digits[n++] = d < 10 ? '0' + d : 'a' + d - 10;
+        v /= base;
+    } while (v != 0);
+    char *p = str;
+    if (value < 0 && base == 10)
+    {
+        *p++ = '-';
+    }
+    while (n > 0)
+    {
+        *p++ = digits[--n];
+    }
+    *p = 0;
+    return str;
+}
+
+#endif
@@ -0,0 +1,16 @@
+// LED PWM of the Arduino core for the host build, without an LED
+#ifndef HOST_ESP32_HAL_LEDC_H
+#define HOST_ESP32_HAL_LEDC_H
+
+#include <stdint.h>
+
+static inline uint32_t ledcSetup(uint8_t /* channel */, uint32_t freq, uint8_t /* resolution_bits */)
+{
+    return freq;
+}
+
+static inline void ledcAttachPin(uint8_t /* pin */, uint8_t /* channel */) {}
+
+static inline void ledcWrite(uint8_t /* channel */, uint32_t /* duty */) {}
+
+#endif
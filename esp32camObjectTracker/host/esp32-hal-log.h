@@ -0,0 +1,25 @@
+// Logging of the Arduino core for the host build, to stderr. As on the
+// board CORE_DEBUG_LEVEL selects the messages: 1 errors (the default of
+// the host build), 2 warnings, 3 info, 4 debug.
+#ifndef HOST_ESP32_HAL_LOG_H
+#define HOST_ESP32_HAL_LOG_H
+
+#include <stdio.h>
+
+#ifndef CORE_DEBUG_LEVEL
+#define CORE_DEBUG_LEVEL 1
+#endif
+
+#define HOST_LOG(level, letter, format, ...)                                                               \
+    do                                                                                                     \
+    {                                                                                                      \
+        if (CORE_DEBUG_LEVEL >= level)                                                                     \
+            fprintf(stderr, "[" letter "][%s:%d] %s(): " format "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__); \
+    } while (0)
+
+#define log_e(format, ...) HOST_LOG(1, "E", format, ##__VA_ARGS__)
+#define log_w(format, ...) HOST_LOG(2, "W", format, ##__VA_ARGS__)
+#define log_i(format, ...) HOST_LOG(3, "I", format, ##__VA_ARGS__)
+#define log_d(format, ...) HOST_LOG(4, "D", format, ##__VA_ARGS__)
+
+#endif
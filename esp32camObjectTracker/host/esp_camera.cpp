@@ -0,0 +1,693 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "esp_camera.h"
+#include "esp_timer.h"
+#include "host_camera.h"
+
+// Host camera, see host_camera.h. The sensor thread stands in for the
+// sensor and its DMA, the frame buffers and their queue follow the
+// esp32-camera driver.
+
+#define FB_GET_TIMEOUT_US 4000000 // As the driver
+
+const resolution_info_t resolution[FRAMESIZE_INVALID] = {
+    {96, 96},
+    {160, 120},
+    {176, 144},
+    {240, 176},
+    {240, 240},
+    {320, 240},
+    {400, 296},
+    {480, 320},
+    {640, 480},
+    {800, 600},
+    {1024, 768},
+    {1280, 720},
+    {1280, 1024},
+    {1600, 1200},
+};
+
+static HostCameraConfig host_config = {"synthetic", 25, 10000, 2000, 0};
+
+const char *HOST_CAMERA_USAGE =
+    "  --camera <source>   synthetic, dir:<jpeg directory> or mjpeg:<file>\n"
+    "  --fps <n>           Frames the sensor produces per second (25)\n"
+    "  --exposure-us <n>   Exposure of a frame (10000)\n"
+    "  --dma-us <n>        Transfer of a frame into its buffer (2000)\n"
+    "  --jitter-us <n>     Random extra delay of a frame, up to this (0)\n";
+
+// Frame buffer with the storage behind fb.buf
+struct HostFrame
+{
+    camera_fb_t fb;
+    std::vector<uint8_t> data;
+};
+
+static std::mutex camera_mutex;
+static std::condition_variable frame_ready;
+static std::vector<HostFrame> frames;      // Under camera_mutex
+static std::vector<HostFrame *> free_list; // Under camera_mutex
+static std::deque<HostFrame *> ready;      // Under camera_mutex, oldest first
+static camera_grab_mode_t grab_mode;
+static HostCameraStats stats;           // Under camera_mutex
+static std::map<int, int> registers;    // Under camera_mutex
+static std::vector<std::vector<uint8_t>> source_jpegs;
+static std::thread sensor_thread;
+static std::atomic<bool> running(false);
+static sensor_t sensor;                 // Settings under camera_mutex
+
+HostCameraConfig &hostCamera()
+{
+    return host_config;
+}
+
+bool hostCameraArg(const char *name, const char *value)
+{
+    if (!strcmp(name, "--camera"))
+    {
+        host_config.source = value;
+    }
+    else if (!strcmp(name, "--fps"))
+    {
+        host_config.fps = atof(value) > 0 ? atof(value) : 25;
+    }
+    else if (!strcmp(name, "--exposure-us"))
+    {
+        host_config.exposure_us = std::max(0, atoi(value));
+    }
+    else if (!strcmp(name, "--dma-us"))
+    {
+        host_config.dma_us = std::max(0, atoi(value));
+    }
+    else if (!strcmp(name, "--jitter-us"))
+    {
+        host_config.jitter_us = std::max(0, atoi(value));
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+HostCameraStats hostCameraStats()
+{
+    std::lock_guard<std::mutex> lock(camera_mutex);
+    return stats;
+}
+
+static bool readFile(const std::string &path, std::vector<uint8_t> &data)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == NULL)
+    {
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data.resize(size > 0 ? size : 0);
+    bool ok = size > 0 && fread(data.data(), 1, size, f) == (size_t)size;
+    fclose(f);
+    return ok;
+}
+
+// The .jpg and .jpeg files of a directory in name order
+static bool loadDirectory(const char *path)
+{
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+    {
+        return false;
+    }
+    std::vector<std::string> names;
+    for (struct dirent *e = readdir(dir); e != NULL; e = readdir(dir))
+    {
+        const char *dot = strrchr(e->d_name, '.');
+        if (dot != NULL && (!strcasecmp(dot, ".jpg") || !strcasecmp(dot, ".jpeg")))
+        {
+            names.push_back(std::string(path) + "/" + e->d_name);
+        }
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        std::vector<uint8_t> jpg;
+        if (readFile(names[i], jpg))
+        {
+            source_jpegs.push_back(jpg);
+        }
+    }
+    return !source_jpegs.empty();
+}
+
+// Every image from an SOI to the next EOI marker, so multipart headers
+// between the images of a saved stream are skipped
+static bool loadMjpeg(const char *path)
+{
+    std::vector<uint8_t> data;
+    if (!readFile(path, data))
+    {
+        return false;
+    }
+    size_t pos = 0;
+    while (pos + 3 < data.size())
+    {
+        if (data[pos] != 0xFF || data[pos + 1] != 0xD8 || data[pos + 2] != 0xFF)
+        {
+            pos++;
+            continue;
+        }
+        size_t end = pos + 2;
+        while (end + 1 < data.size() && !(data[end] == 0xFF && data[end + 1] == 0xD9))
+        {
+            end++;
+        }
+        if (end + 1 >= data.size())
+        {
+            break; // Truncated last image
+        }
+        source_jpegs.push_back(std::vector<uint8_t>(data.begin() + pos, data.begin() + end + 2));
+        pos = end + 2;
+    }
+    return !source_jpegs.empty();
+}
+
+// Sensor settings a frame is made with
+struct FrameSettings
+{
+    pixformat_t format;
+    framesize_t framesize;
+    int quality;
+    bool hmirror, vflip, colorbar;
+};
+
+// Synthetic scene at the frame size: a red square moving over a noisy
+// background, or the color bars of set_colorbar
+static void renderSynthetic(uint32_t n, const FrameSettings &set, int width, int height, std::vector<uint8_t> &rgb)
+{
+    static const uint8_t bars[8][3] = {
+        {255, 255, 255}, {255, 255, 0}, {0, 255, 255}, {0, 255, 0},
+        {255, 0, 255}, {255, 0, 0}, {0, 0, 255}, {0, 0, 0}};
+    rgb.resize((size_t)width * height * 3);
+    int size = std::max(4, width / 8);
+    int span = std::max(1, width - size);
+    int x0 = (n * 4) % (2 * span);
+    x0 = x0 < span ? x0 : 2 * span - x0; // Back and forth
+    int y0 = (height - size) / 2;
+    uint32_t seed = n * 2654435761u + 1;
+    uint8_t *p = rgb.data();
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++, p += 3)
+        {
+            if (set.colorbar)
+            {
+                memcpy(p, bars[x * 8 / width], 3);
+                continue;
+            }
+            seed = seed * 1664525 + 1013904223;
+            if (x >= x0 && x < x0 + size && y >= y0 && y < y0 + size)
+            {
+                p[0] = 230;
+                p[1] = 30;
+                p[2] = 40;
+            }
+            else
+            {
+                p[0] = (seed >> 8) % 150;
+                p[1] = 60 + (seed >> 16) % 196;
+                p[2] = seed >> 24;
+            }
+        }
+    }
+}
+
+// Nearest neighbour scaling with the mirror and flip of the sensor
+static void scaleRgb(const std::vector<uint8_t> &in, int inWidth, int inHeight,
+                     const FrameSettings &set, int width, int height, std::vector<uint8_t> &out)
+{
+    out.resize((size_t)width * height * 3);
+    for (int y = 0; y < height; y++)
+    {
+        int sy = (set.vflip ? height - 1 - y : y) * inHeight / height;
+        for (int x = 0; x < width; x++)
+        {
+            int sx = (set.hmirror ? width - 1 - x : x) * inWidth / width;
+            memcpy(&out[((size_t)y * width + x) * 3], &in[((size_t)sy * inWidth + sx) * 3], 3);
+        }
+    }
+}
+
+static inline uint8_t clamp8(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// R, G, B pixels into the pixel format of the sensor
+static bool encodeFrame(const std::vector<uint8_t> &rgb, int width, int height, const FrameSettings &set, std::vector<uint8_t> &out)
+{
+    size_t pixels = (size_t)width * height;
+    const uint8_t *p = rgb.data();
+    switch (set.format)
+    {
+    case PIXFORMAT_JPEG:
+        // Sensor quality 0 (best) to 63 onto the libjpeg scale
+        return hostJpegEncode(p, width, height, 100 - set.quality * 95 / 63, out);
+    case PIXFORMAT_RGB565:
+        out.resize(pixels * 2);
+        for (size_t i = 0; i < pixels; i++, p += 3)
+        {
+            uint16_t v = ((p[0] >> 3) << 11) | ((p[1] >> 2) << 5) | (p[2] >> 3);
+            out[i * 2] = v >> 8; // Big-endian as the sensor sends it
+            out[i * 2 + 1] = v & 0xFF;
+        }
+        return true;
+    case PIXFORMAT_YUV422:
+        out.resize(pixels * 2);
+        for (size_t i = 0; i < pixels; i++, p += 3)
+        {
+            out[i * 2] = clamp8((77 * p[0] + 150 * p[1] + 29 * p[2]) >> 8);
+            if ((i & 1) == 0)
+            {
+                out[i * 2 + 1] = clamp8(((-43 * p[0] - 85 * p[1] + 128 * p[2]) >> 8) + 128);
+            }
+            else
+            {
+                out[i * 2 + 1] = clamp8(((128 * p[0] - 107 * p[1] - 21 * p[2]) >> 8) + 128);
+            }
+        }
+        return true;
+    case PIXFORMAT_GRAYSCALE:
+        out.resize(pixels);
+        for (size_t i = 0; i < pixels; i++, p += 3)
+        {
+            out[i] = (77 * p[0] + 150 * p[1] + 29 * p[2]) >> 8;
+        }
+        return true;
+    case PIXFORMAT_RGB888:
+        out.resize(pixels * 3);
+        for (size_t i = 0; i < pixels; i++, p += 3)
+        {
+            out[i * 3] = p[2];
+            out[i * 3 + 1] = p[1];
+            out[i * 3 + 2] = p[0];
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Frame n of the source as the sensor would deliver it
+static bool renderFrame(uint32_t n, const FrameSettings &set, std::vector<uint8_t> &out)
+{
+    int width = resolution[set.framesize].width;
+    int height = resolution[set.framesize].height;
+    std::vector<uint8_t> rgb, scaled;
+    if (source_jpegs.empty() || set.colorbar)
+    {
+        renderSynthetic(n, set, width, height, rgb);
+        return encodeFrame(rgb, width, height, set, out);
+    }
+
+    const std::vector<uint8_t> &jpg = source_jpegs[n % source_jpegs.size()];
+    int inWidth, inHeight;
+    if (!hostJpegDecode(jpg.data(), jpg.size(), rgb, inWidth, inHeight))
+    {
+        return false;
+    }
+    if (set.format == PIXFORMAT_JPEG && inWidth == width && inHeight == height && !set.hmirror && !set.vflip)
+    {
+        out = jpg; // Already what the sensor would send
+        return true;
+    }
+    scaleRgb(rgb, inWidth, inHeight, set, width, height, scaled);
+    return encodeFrame(scaled, width, height, set, out);
+}
+
+static void sleepUntil(int64_t us)
+{
+    int64_t wait = us - esp_timer_get_time();
+    if (wait > 0)
+    {
+        usleep(wait);
+    }
+}
+
+// Sensor and DMA: expose a frame every period, transfer it into a free
+// buffer and queue it for esp_camera_fb_get()
+static void sensorThread()
+{
+    int64_t period = 1000000 / host_config.fps;
+    int64_t start = esp_timer_get_time();
+    uint32_t n = 0;
+    uint32_t seed = 1;
+    std::vector<uint8_t> pixels;
+    while (running)
+    {
+        int64_t exposure = start + (int64_t)n * period;
+        if (host_config.jitter_us > 0)
+        {
+            seed = seed * 1664525 + 1013904223;
+            exposure += (seed >> 8) % (host_config.jitter_us + 1);
+        }
+        sleepUntil(exposure);
+
+        FrameSettings set;
+        {
+            std::lock_guard<std::mutex> lock(camera_mutex);
+            set.format = sensor.pixformat;
+            set.framesize = sensor.status.framesize;
+            set.quality = sensor.status.quality;
+            set.hmirror = sensor.status.hmirror;
+            set.vflip = sensor.status.vflip;
+            set.colorbar = sensor.status.colorbar;
+        }
+        bool ok = renderFrame(n, set, pixels);
+
+        int64_t exposed = exposure + host_config.exposure_us;
+        sleepUntil(exposed + host_config.dma_us);
+        {
+            std::lock_guard<std::mutex> lock(camera_mutex);
+            stats.produced++;
+            HostFrame *frame = NULL;
+            if (!free_list.empty())
+            {
+                frame = free_list.back();
+                free_list.pop_back();
+            }
+            else if (grab_mode == CAMERA_GRAB_LATEST && !ready.empty())
+            {
+                frame = ready.front(); // Nobody took it in time
+                ready.pop_front();
+                stats.replaced++;
+            }
+
+            if (frame == NULL || !ok)
+            {
+                stats.dropped++;
+                if (frame != NULL)
+                {
+                    free_list.push_back(frame);
+                }
+            }
+            else
+            {
+                frame->data = pixels;
+                frame->fb.buf = frame->data.data();
+                frame->fb.len = frame->data.size();
+                frame->fb.width = resolution[set.framesize].width;
+                frame->fb.height = resolution[set.framesize].height;
+                frame->fb.format = set.format;
+                frame->fb.timestamp.tv_sec = exposed / 1000000;
+                frame->fb.timestamp.tv_usec = exposed % 1000000;
+                ready.push_back(frame);
+                if (grab_mode == CAMERA_GRAB_LATEST)
+                {
+                    // Only the newest frame waits
+                    while (ready.size() > 1)
+                    {
+                        free_list.push_back(ready.front());
+                        ready.pop_front();
+                        stats.replaced++;
+                    }
+                }
+            }
+        }
+        frame_ready.notify_all();
+
+        // A frame that took longer than its period to prepare delays the
+        // next ones, skip those instead of catching up
+        n++;
+        int64_t now = esp_timer_get_time();
+        if (now > start + (int64_t)(n + 1) * period)
+        {
+            uint32_t behind = (now - start) / period;
+            std::lock_guard<std::mutex> lock(camera_mutex);
+            stats.late += behind - n;
+            n = behind;
+        }
+    }
+}
+
+static int setPixformat(sensor_t *s, pixformat_t pixformat)
+{
+    std::lock_guard<std::mutex> lock(camera_mutex);
+    s->pixformat = pixformat;
+    return 0;
+}
+
+static int setFramesize(sensor_t *s, framesize_t framesize)
+{
+    if (framesize < 0 || framesize >= FRAMESIZE_INVALID)
+    {
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(camera_mutex);
+    s->status.framesize = framesize;
+    return 0;
+}
+
+static int setGainceiling(sensor_t *s, gainceiling_t gainceiling)
+{
+    std::lock_guard<std::mutex> lock(camera_mutex);
+    s->status.gainceiling = gainceiling;
+    return 0;
+}
+
+// Setters that store a value in the status
+#define STATUS_SETTER(name, field)                       \
+    static int name(sensor_t *s, int value)              \
+    {                                                    \
+        std::lock_guard<std::mutex> lock(camera_mutex); \
+        s->status.field = value;                         \
+        return 0;                                        \
+    }
+
+STATUS_SETTER(setContrast, contrast)
+STATUS_SETTER(setBrightness, brightness)
+STATUS_SETTER(setSaturation, saturation)
+STATUS_SETTER(setSharpness, sharpness)
+STATUS_SETTER(setDenoise, denoise)
+STATUS_SETTER(setQuality, quality)
+STATUS_SETTER(setColorbar, colorbar)
+STATUS_SETTER(setWhitebal, awb)
+STATUS_SETTER(setGainCtrl, agc)
+STATUS_SETTER(setExposureCtrl, aec)
+STATUS_SETTER(setHmirror, hmirror)
+STATUS_SETTER(setVflip, vflip)
+STATUS_SETTER(setAec2, aec2)
+STATUS_SETTER(setAwbGain, awb_gain)
+STATUS_SETTER(setAgcGain, agc_gain)
+STATUS_SETTER(setAecValue, aec_value)
+STATUS_SETTER(setSpecialEffect, special_effect)
+STATUS_SETTER(setWbMode, wb_mode)
+STATUS_SETTER(setAeLevel, ae_level)
+STATUS_SETTER(setDcw, dcw)
+STATUS_SETTER(setBpc, bpc)
+STATUS_SETTER(setWpc, wpc)
+STATUS_SETTER(setRawGma, raw_gma)
+STATUS_SETTER(setLenc, lenc)
+
+static int getReg(sensor_t * /* s */, int reg, int mask)
+{
+    std::lock_guard<std::mutex> lock(camera_mutex);
+    return registers[reg] & mask;
+}
+
+static int setReg(sensor_t * /* s */, int reg, int mask, int value)
+{
+    std::lock_guard<std::mutex> lock(camera_mutex);
+    registers[reg] = (registers[reg] & ~mask) | (value & mask);
+    return 0;
+}
+
+// Windowing and PLL are not modelled, the frames keep their size
+static int setResRaw(sensor_t *, int, int, int, int, int, int, int, int, int, int, bool, bool)
+{
+    return 0;
+}
+
+static int setPll(sensor_t *, int, int, int, int, int, int, int, int)
+{
+    return 0;
+}
+
+static int setXclk(sensor_t *s, int /* timer */, int xclk)
+{
+    std::lock_guard<std::mutex> lock(camera_mutex);
+    s->xclk_freq_hz = xclk * 1000000;
+    return 0;
+}
+
+// Power-on settings of an OV2640
+static void sensorInit(const camera_config_t *config)
+{
+    memset(&sensor, 0, sizeof(sensor));
+    sensor.id.PID = OV2640_PID;
+    sensor.slv_addr = 0x30;
+    sensor.pixformat = config->pixel_format;
+    sensor.xclk_freq_hz = config->xclk_freq_hz;
+
+    camera_status_t &status = sensor.status;
+    status.framesize = config->frame_size;
+    status.quality = config->jpeg_quality;
+    status.awb = 1;
+    status.awb_gain = 1;
+    status.aec = 1;
+    status.aec_value = 168;
+    status.agc = 1;
+    status.wpc = 1;
+    status.raw_gma = 1;
+    status.lenc = 1;
+    status.dcw = 1;
+
+    sensor.set_pixformat = setPixformat;
+    sensor.set_framesize = setFramesize;
+    sensor.set_contrast = setContrast;
+    sensor.set_brightness = setBrightness;
+    sensor.set_saturation = setSaturation;
+    sensor.set_sharpness = setSharpness;
+    sensor.set_denoise = setDenoise;
+    sensor.set_gainceiling = setGainceiling;
+    sensor.set_quality = setQuality;
+    sensor.set_colorbar = setColorbar;
+    sensor.set_whitebal = setWhitebal;
+    sensor.set_gain_ctrl = setGainCtrl;
+    sensor.set_exposure_ctrl = setExposureCtrl;
+    sensor.set_hmirror = setHmirror;
+    sensor.set_vflip = setVflip;
+    sensor.set_aec2 = setAec2;
+    sensor.set_awb_gain = setAwbGain;
+    sensor.set_agc_gain = setAgcGain;
+    sensor.set_aec_value = setAecValue;
+    sensor.set_special_effect = setSpecialEffect;
+    sensor.set_wb_mode = setWbMode;
+    sensor.set_ae_level = setAeLevel;
+    sensor.set_dcw = setDcw;
+    sensor.set_bpc = setBpc;
+    sensor.set_wpc = setWpc;
+    sensor.set_raw_gma = setRawGma;
+    sensor.set_lenc = setLenc;
+    sensor.get_reg = getReg;
+    sensor.set_reg = setReg;
+    sensor.set_res_raw = setResRaw;
+    sensor.set_pll = setPll;
+    sensor.set_xclk = setXclk;
+}
+
+esp_err_t esp_camera_init(const camera_config_t *config)
+{
+    if (running)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (config->frame_size < 0 || config->frame_size >= FRAMESIZE_INVALID)
+    {
+        return ESP_ERR_CAMERA_FAILED_TO_SET_FRAME_SIZE;
+    }
+
+    source_jpegs.clear();
+    const char *source = host_config.source;
+    bool loaded = true;
+    if (!strncmp(source, "dir:", 4))
+    {
+        loaded = loadDirectory(source + 4);
+    }
+    else if (!strncmp(source, "mjpeg:", 6))
+    {
+        loaded = loadMjpeg(source + 6);
+    }
+    else if (strcmp(source, "synthetic"))
+    {
+        loaded = false;
+    }
+    if (!loaded)
+    {
+        fprintf(stderr, "Camera source %s has no frames\n", source);
+        return ESP_ERR_CAMERA_NOT_DETECTED;
+    }
+
+    sensorInit(config);
+    grab_mode = config->grab_mode;
+    stats = HostCameraStats();
+    frames.assign(std::max<size_t>(1, config->fb_count), HostFrame());
+    free_list.clear();
+    ready.clear();
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        free_list.push_back(&frames[i]);
+    }
+    running = true;
+    sensor_thread = std::thread(sensorThread);
+    return ESP_OK;
+}
+
+esp_err_t esp_camera_deinit()
+{
+    if (!running)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    running = false;
+    sensor_thread.join();
+    std::lock_guard<std::mutex> lock(camera_mutex);
+    ready.clear();
+    free_list.clear();
+    frames.clear();
+    return ESP_OK;
+}
+
+camera_fb_t *esp_camera_fb_get()
+{
+    std::unique_lock<std::mutex> lock(camera_mutex);
+    if (!running)
+    {
+        return NULL;
+    }
+    if (!frame_ready.wait_for(lock, std::chrono::microseconds(FB_GET_TIMEOUT_US), []()
+                              { return !ready.empty(); }))
+    {
+        fprintf(stderr, "Failed to get the frame on time!\n");
+        return NULL;
+    }
+    HostFrame *frame = ready.front();
+    ready.pop_front();
+    stats.delivered++;
+    return &frame->fb;
+}
+
+void esp_camera_fb_return(camera_fb_t *fb)
+{
+    if (fb == NULL)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(camera_mutex);
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        if (&frames[i].fb == fb)
+        {
+            free_list.push_back(&frames[i]);
+        }
+    }
+}
+
+sensor_t *esp_camera_sensor_get()
+{
+    return running ? &sensor : NULL;
+}
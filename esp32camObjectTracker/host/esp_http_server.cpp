@@ -0,0 +1,1285 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/select.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "lwip/sockets.h"
+#include "esp_http_server.h"
+#include "esp_timer.h"
+#include "esp32-hal-log.h"
+
+// esp_http_server for the host build, see esp_http_server.h. Only the
+// server thread touches a session, except for its fd and WebSocket state,
+// which other tasks look up under the mutex of the server.
+
+int httpdHostPortOffset = 0;
+
+// Sockets of lwIP in use by all servers
+static std::atomic<int> lwip_sockets(0);
+
+struct HostSession
+{
+    int fd;                 // -1 if the slot is free
+    std::string in;         // Received and not parsed yet
+    int64_t lru;            // esp_timer time of the last request
+    void *ctx;              // Session context of the handlers
+    httpd_free_ctx_fn_t free_ctx;
+    bool ws;                // WebSocket handshake done
+    esp_err_t (*ws_handler)(httpd_req_t *r);
+    bool ws_control_frames; // Control frames go to the handler
+    void *ws_user_ctx;
+    uint8_t ws_first;       // First byte of the frame being read
+};
+
+struct HostWork
+{
+    httpd_work_fn_t fn;
+    void *arg;
+    int close_fd; // Work of httpd_sess_trigger_close() if >= 0
+};
+
+struct HostServer
+{
+    httpd_config_t config;
+    int listen_fd;
+    int ctrl_fd; // UDP socket on the loopback, bound to ctrl_port
+    struct sockaddr_in ctrl_addr;
+    pthread_t thread;
+    std::vector<httpd_uri_t> uris;     // Under mutex
+    std::deque<std::string> uri_names; // Under mutex, uri of uris
+    std::vector<HostSession> sessions; // max_open_sockets slots
+    std::mutex mutex;                  // Session fd and ws, handlers, work and stop
+    std::deque<HostWork> work;
+    bool stop;
+};
+
+struct HostRequest
+{
+    HostRequest() {}
+    union
+    {
+        httpd_req_t req; // Filled in by initRequest(), uri is const
+    };
+    HostServer *server;
+    HostSession *session;
+    std::string status;
+    std::string type;
+    std::vector<std::pair<std::string, std::string>> headers;
+    bool chunked;       // Headers of a chunked response sent
+    size_t remaining;   // Bytes of the body or frame not read yet
+    uint8_t ws_mask[4]; // Of the frame being read
+};
+
+static const int MAX_CONTENT_PURGE = 16 * 1024 * 1024;
+
+static int sendSome(int fd, const char *buf, size_t len, int flags)
+{
+    ssize_t sent = send(fd, buf, len, flags | MSG_NOSIGNAL);
+    if (sent < 0)
+    {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? HTTPD_SOCK_ERR_TIMEOUT : HTTPD_SOCK_ERR_FAIL;
+    }
+    return (int)sent;
+}
+
+static bool sendAll(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        int sent = sendSome(fd, buf, len, 0);
+        if (sent <= 0)
+        {
+            return false;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+// Reads len bytes of the session, first those received already. Blocks for
+// up to recv_wait_timeout per recv() as the sockets are set up.
+static bool recvExact(HostSession &s, void *buf, size_t len)
+{
+    uint8_t *p = (uint8_t *)buf;
+    size_t have = std::min(len, s.in.size());
+    memcpy(p, s.in.data(), have);
+    s.in.erase(0, have);
+    while (have < len)
+    {
+        ssize_t n = recv(s.fd, p + have, len - have, 0);
+        if (n <= 0)
+        {
+            return false;
+        }
+        have += n;
+    }
+    return true;
+}
+
+// Appends what the socket has to s.in. Returns the result of recv(), 0 at
+// the end of the connection.
+static ssize_t recvMore(HostSession &s)
+{
+    char buf[1024];
+    ssize_t n = recv(s.fd, buf, sizeof(buf), 0);
+    if (n > 0)
+    {
+        s.in.append(buf, n);
+    }
+    return n;
+}
+
+static HostSession *findSession(HostServer *server, int fd)
+{
+    for (size_t i = 0; i < server->sessions.size(); i++)
+    {
+        if (server->sessions[i].fd == fd && fd >= 0)
+        {
+            return &server->sessions[i];
+        }
+    }
+    return NULL;
+}
+
+static int openSessions(HostServer *server)
+{
+    int open = 0;
+    for (size_t i = 0; i < server->sessions.size(); i++)
+    {
+        open += server->sessions[i].fd >= 0 ? 1 : 0;
+    }
+    return open;
+}
+
+static void closeSession(HostServer *server, HostSession &s)
+{
+    int fd;
+    {
+        std::lock_guard<std::mutex> lock(server->mutex);
+        fd = s.fd;
+        s.fd = -1;
+        s.ws = false;
+    }
+    if (fd < 0)
+    {
+        return;
+    }
+    log_d("Closing socket %d", fd);
+    if (server->config.close_fn != NULL)
+    {
+        server->config.close_fn(server, fd);
+    }
+    else
+    {
+        close(fd);
+    }
+    lwip_sockets--;
+
+    // As esp_http_server, the context is freed after the socket is closed
+    if (s.ctx != NULL)
+    {
+        if (s.free_ctx != NULL)
+        {
+            s.free_ctx(s.ctx);
+        }
+        else
+        {
+            free(s.ctx);
+        }
+    }
+    s.ctx = NULL;
+    s.free_ctx = NULL;
+    s.in.clear();
+}
+
+static void wake(HostServer *server)
+{
+    char byte = 0;
+    sendto(server->ctrl_fd, &byte, 1, MSG_DONTWAIT, (struct sockaddr *)&server->ctrl_addr, sizeof(server->ctrl_addr));
+}
+
+static void initRequest(HostRequest &r, HostServer *server, HostSession &s)
+{
+    memset((void *)&r.req, 0, sizeof(r.req));
+    r.req.handle = server;
+    r.req.aux = &r;
+    r.req.sess_ctx = s.ctx;
+    r.req.free_ctx = s.free_ctx;
+    r.server = server;
+    r.session = &s;
+    r.status = HTTPD_200;
+    r.type = HTTPD_TYPE_TEXT;
+    r.chunked = false;
+    r.remaining = 0;
+}
+
+// Takes over the session context the handler left in the request
+static void keepSessionContext(HostRequest &r)
+{
+    HostSession &s = *r.session;
+    if (r.req.ignore_sess_ctx_changes)
+    {
+        return;
+    }
+    if (s.ctx != r.req.sess_ctx && s.ctx != NULL)
+    {
+        if (s.free_ctx != NULL)
+        {
+            s.free_ctx(s.ctx);
+        }
+        else
+        {
+            free(s.ctx);
+        }
+    }
+    s.ctx = r.req.sess_ctx;
+    s.free_ctx = r.req.free_ctx;
+}
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+
+// SHA-1 (RFC 3174) of the WebSocket handshake
+static void sha1(const uint8_t *data, size_t len, uint8_t digest[20])
+{
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    std::vector<uint8_t> msg(data, data + len);
+    msg.push_back(0x80);
+    while (msg.size() % 64 != 56)
+    {
+        msg.push_back(0);
+    }
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 7; i >= 0; i--)
+    {
+        msg.push_back(bits >> (i * 8));
+    }
+    for (size_t block = 0; block < msg.size(); block += 64)
+    {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++)
+        {
+            const uint8_t *p = &msg[block + i * 4];
+            w[i] = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        }
+        for (int i = 16; i < 80; i++)
+        {
+            uint32_t v = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = (v << 1) | (v >> 31);
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++)
+        {
+            uint32_t f, k;
+            if (i < 20)
+            {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            }
+            else if (i < 40)
+            {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            }
+            else if (i < 60)
+            {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            }
+            else
+            {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t t = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = (b << 30) | (b >> 2);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    for (int i = 0; i < 20; i++)
+    {
+        digest[i] = h[i / 4] >> (24 - (i % 4) * 8);
+    }
+}
+
+static std::string base64(const uint8_t *data, size_t len)
+{
+    static const char *digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < len; i += 3)
+    {
+        uint32_t v = data[i] << 16;
+        v |= i + 1 < len ? data[i + 1] << 8 : 0;
+        v |= i + 2 < len ? data[i + 2] : 0;
+        out += digits[(v >> 18) & 63];
+        out += digits[(v >> 12) & 63];
+        out += i + 1 < len ? digits[(v >> 6) & 63] : '=';
+        out += i + 2 < len ? digits[v & 63] : '=';
+    }
+    return out;
+}
+
+static bool wsHandshake(HostRequest &r, const std::string &key, const char *subprotocol)
+{
+    std::string accept = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    uint8_t digest[20];
+    sha1((const uint8_t *)accept.data(), accept.size(), digest);
+    std::string response = "HTTP/1.1 101 Switching Protocols\r\n"
+                           "Upgrade: websocket\r\n"
+                           "Connection: Upgrade\r\n"
+                           "Sec-WebSocket-Accept: " +
+                           base64(digest, sizeof(digest)) + "\r\n";
+    if (subprotocol != NULL)
+    {
+        response += std::string("Sec-WebSocket-Protocol: ") + subprotocol + "\r\n";
+    }
+    response += "\r\n";
+    return sendAll(r.session->fd, response.data(), response.size());
+}
+
+static esp_err_t wsSendFrame(int fd, httpd_ws_frame_t *frame)
+{
+    uint8_t header[10];
+    size_t hlen = 2;
+    header[0] = (frame->final ? 0x80 : 0) | (frame->type & 0x0F);
+    if (frame->len < 126)
+    {
+        header[1] = frame->len;
+    }
+    else if (frame->len < 65536)
+    {
+        header[1] = 126;
+        header[2] = frame->len >> 8;
+        header[3] = frame->len;
+        hlen = 4;
+    }
+    else
+    {
+        header[1] = 127;
+        for (int i = 0; i < 8; i++)
+        {
+            header[2 + i] = (uint64_t)frame->len >> ((7 - i) * 8);
+        }
+        hlen = 10;
+    }
+    if (!sendAll(fd, (const char *)header, hlen) ||
+        (frame->len > 0 && !sendAll(fd, (const char *)frame->payload, frame->len)))
+    {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+// Answers a control frame the handler does not want to see. Returns false
+// to close the session.
+static bool wsControlFrame(HostRequest &r)
+{
+    httpd_ws_frame_t frame;
+    uint8_t payload[125];
+    memset(&frame, 0, sizeof(frame));
+    if (httpd_ws_recv_frame(&r.req, &frame, 0) != ESP_OK || frame.len > sizeof(payload))
+    {
+        return false;
+    }
+    frame.payload = payload;
+    if (frame.len > 0 && httpd_ws_recv_frame(&r.req, &frame, frame.len) != ESP_OK)
+    {
+        return false;
+    }
+    if (frame.type == HTTPD_WS_TYPE_PING)
+    {
+        frame.type = HTTPD_WS_TYPE_PONG;
+        frame.final = true;
+        return wsSendFrame(r.session->fd, &frame) == ESP_OK;
+    }
+    if (frame.type == HTTPD_WS_TYPE_CLOSE)
+    {
+        frame.len = 0;
+        frame.final = true;
+        wsSendFrame(r.session->fd, &frame);
+        return false;
+    }
+    return true; // Pong
+}
+
+// A frame arrived on a WebSocket session
+static void processFrame(HostServer *server, HostSession &s)
+{
+    if (!recvExact(s, &s.ws_first, 1))
+    {
+        closeSession(server, s);
+        return;
+    }
+    HostRequest r;
+    initRequest(r, server, s);
+    r.req.method = 0;
+    r.req.user_ctx = s.ws_user_ctx;
+
+    int type = s.ws_first & 0x0F;
+    bool ok;
+    if (type >= HTTPD_WS_TYPE_CLOSE && !s.ws_control_frames)
+    {
+        ok = wsControlFrame(r);
+    }
+    else
+    {
+        ok = s.ws_handler(&r.req) == ESP_OK;
+        keepSessionContext(r);
+    }
+    if (!ok)
+    {
+        closeSession(server, s);
+    }
+}
+
+esp_err_t httpd_ws_recv_frame(httpd_req_t *req, httpd_ws_frame_t *frame, size_t max_len)
+{
+    HostRequest *r = (HostRequest *)req->aux;
+    HostSession &s = *r->session;
+    if (!s.ws)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // As in esp_http_server, a frame without a length has its header read
+    if (frame->len == 0)
+    {
+        uint8_t b;
+        if (!recvExact(s, &b, 1))
+        {
+            return ESP_FAIL;
+        }
+        uint64_t len = b & 0x7F;
+        if (len >= 126)
+        {
+            uint8_t ext[8];
+            int n = len == 126 ? 2 : 8;
+            if (!recvExact(s, ext, n))
+            {
+                return ESP_FAIL;
+            }
+            len = 0;
+            for (int i = 0; i < n; i++)
+            {
+                len = (len << 8) | ext[i];
+            }
+        }
+        frame->type = (httpd_ws_type_t)(s.ws_first & 0x0F);
+        frame->final = (s.ws_first & 0x80) != 0;
+        frame->fragmented = !frame->final;
+        frame->len = len;
+        r->remaining = len;
+        memset(r->ws_mask, 0, sizeof(r->ws_mask));
+        if ((b & 0x80) && !recvExact(s, r->ws_mask, 4))
+        {
+            return ESP_FAIL;
+        }
+        if (max_len == 0)
+        {
+            return ESP_OK;
+        }
+    }
+
+    if (frame->len > max_len || frame->payload == NULL)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (!recvExact(s, frame->payload, frame->len))
+    {
+        return ESP_FAIL;
+    }
+    for (size_t i = 0; i < frame->len; i++)
+    {
+        frame->payload[i] ^= r->ws_mask[i % 4];
+    }
+    r->remaining = 0;
+    return ESP_OK;
+}
+
+esp_err_t httpd_ws_send_frame(httpd_req_t *req, httpd_ws_frame_t *frame)
+{
+    return httpd_ws_send_frame_async(req->handle, httpd_req_to_sockfd(req), frame);
+}
+
+esp_err_t httpd_ws_send_frame_async(httpd_handle_t hd, int fd, httpd_ws_frame_t *frame)
+{
+    HostServer *server = (HostServer *)hd;
+    {
+        std::lock_guard<std::mutex> lock(server->mutex);
+        if (findSession(server, fd) == NULL)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    return wsSendFrame(fd, frame);
+}
+
+httpd_ws_client_info_t httpd_ws_get_fd_info(httpd_handle_t hd, int fd)
+{
+    HostServer *server = (HostServer *)hd;
+    std::lock_guard<std::mutex> lock(server->mutex);
+    HostSession *s = findSession(server, fd);
+    return s == NULL ? HTTPD_WS_CLIENT_INVALID : s->ws ? HTTPD_WS_CLIENT_WEBSOCKET : HTTPD_WS_CLIENT_HTTP;
+}
+
+#endif
+
+static const char *errorStatus(httpd_err_code_t error, const char **msg)
+{
+    switch (error)
+    {
+    case HTTPD_501_METHOD_NOT_IMPLEMENTED:
+        *msg = "Request method is not supported by server";
+        return "501 Method Not Implemented";
+    case HTTPD_505_VERSION_NOT_SUPPORTED:
+        *msg = "HTTP version not supported by server";
+        return "505 Version Not Supported";
+    case HTTPD_400_BAD_REQUEST:
+        *msg = "Server unable to understand request due to invalid syntax";
+        return "400 Bad Request";
+    case HTTPD_401_UNAUTHORIZED:
+        *msg = "Server known the client's identify and it must authenticate itself to get he requested resource";
+        return "401 Unauthorized";
+    case HTTPD_403_FORBIDDEN:
+        *msg = "Server is refusing to give the requested resource to the client";
+        return "403 Forbidden";
+    case HTTPD_404_NOT_FOUND:
+        *msg = "This URI does not exist";
+        return "404 Not Found";
+    case HTTPD_405_METHOD_NOT_ALLOWED:
+        *msg = "Request method for this URI is not handled by server";
+        return "405 Method Not Allowed";
+    case HTTPD_408_REQ_TIMEOUT:
+        *msg = "Server closed this connection";
+        return "408 Request Timeout";
+    case HTTPD_411_LENGTH_REQUIRED:
+        *msg = "Chunked encoding not supported by server";
+        return "411 Length Required";
+    case HTTPD_414_URI_TOO_LONG:
+        *msg = "URI is too long";
+        return "414 URI Too Long";
+    case HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE:
+        *msg = "Header fields are too long";
+        return "431 Request Header Fields Too Large";
+    default:
+        *msg = "Server has encountered an unexpected error";
+        return "500 Internal Server Error";
+    }
+}
+
+// Answers a request the server cannot hand to a handler and closes the
+// session, as esp_http_server does without custom error handlers
+static void failRequest(HostServer *server, HostSession &s, httpd_err_code_t error)
+{
+    HostRequest r;
+    initRequest(r, server, s);
+    httpd_resp_send_err(&r.req, error, NULL);
+    closeSession(server, s);
+}
+
+static int methodNumber(const std::string &name)
+{
+    static const char *names[] = {"DELETE", "GET", "HEAD", "POST", "PUT"};
+    for (int i = 0; i < 5; i++)
+    {
+        if (name == names[i])
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static bool uriMatches(HostServer *server, const httpd_uri_t &uri, const char *path, size_t len)
+{
+    if (server->config.uri_match_fn != NULL)
+    {
+        return server->config.uri_match_fn(uri.uri, path, len);
+    }
+    return strlen(uri.uri) == len && strncmp(uri.uri, path, len) == 0;
+}
+
+// A request arrived on an HTTP session. Reads it completely, blocking the
+// server for up to recv_wait_timeout per read like esp_http_server.
+static void processRequest(HostServer *server, HostSession &s)
+{
+    size_t end;
+    while ((end = s.in.find("\r\n\r\n")) == std::string::npos)
+    {
+        if (s.in.size() > HTTPD_MAX_REQ_HDR_LEN)
+        {
+            failRequest(server, s, HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE);
+            return;
+        }
+        ssize_t n = recvMore(s);
+        if (n <= 0)
+        {
+            if (n < 0 && !s.in.empty() && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                failRequest(server, s, HTTPD_408_REQ_TIMEOUT);
+            }
+            else
+            {
+                closeSession(server, s);
+            }
+            return;
+        }
+    }
+    if (end > HTTPD_MAX_REQ_HDR_LEN)
+    {
+        failRequest(server, s, HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE);
+        return;
+    }
+    std::string head = s.in.substr(0, end + 2);
+    s.in.erase(0, end + 4);
+    s.lru = esp_timer_get_time();
+
+    // Request line
+    size_t eol = head.find("\r\n");
+    std::string line = head.substr(0, eol);
+    size_t sp1 = line.find(' ');
+    size_t sp2 = line.find(' ', sp1 == std::string::npos ? 0 : sp1 + 1);
+    if (sp1 == std::string::npos || sp2 == std::string::npos)
+    {
+        failRequest(server, s, HTTPD_400_BAD_REQUEST);
+        return;
+    }
+    int method = methodNumber(line.substr(0, sp1));
+    std::string uri = line.substr(sp1 + 1, sp2 - sp1 - 1);
+    if (line.compare(sp2 + 1, 7, "HTTP/1.") != 0)
+    {
+        failRequest(server, s, HTTPD_505_VERSION_NOT_SUPPORTED);
+        return;
+    }
+    if (method < 0)
+    {
+        failRequest(server, s, HTTPD_501_METHOD_NOT_IMPLEMENTED);
+        return;
+    }
+    if (uri.size() > HTTPD_MAX_URI_LEN)
+    {
+        failRequest(server, s, HTTPD_414_URI_TOO_LONG);
+        return;
+    }
+
+    // Header fields the server acts on
+    size_t content_len = 0;
+    bool upgrade = false;
+    std::string ws_key;
+    for (size_t pos = eol + 2; pos < head.size();)
+    {
+        size_t next = head.find("\r\n", pos);
+        std::string field = head.substr(pos, next - pos);
+        pos = next + 2;
+        size_t colon = field.find(':');
+        if (colon == std::string::npos)
+        {
+            continue;
+        }
+        std::string name = field.substr(0, colon);
+        size_t start = field.find_first_not_of(" \t", colon + 1);
+        std::string value = start == std::string::npos ? "" : field.substr(start);
+        if (!strcasecmp(name.c_str(), "Content-Length"))
+        {
+            content_len = strtoul(value.c_str(), NULL, 10);
+        }
+        else if (!strcasecmp(name.c_str(), "Transfer-Encoding") && !strcasecmp(value.c_str(), "chunked"))
+        {
+            failRequest(server, s, HTTPD_411_LENGTH_REQUIRED);
+            return;
+        }
+        else if (!strcasecmp(name.c_str(), "Upgrade") && !strcasecmp(value.c_str(), "websocket"))
+        {
+            upgrade = true;
+        }
+        else if (!strcasecmp(name.c_str(), "Sec-WebSocket-Key"))
+        {
+            ws_key = value;
+        }
+    }
+
+    // Handler of the path
+    size_t path_len = uri.find('?');
+    path_len = path_len == std::string::npos ? uri.size() : path_len;
+    httpd_uri_t handler_copy;
+    const httpd_uri_t *handler = NULL;
+    bool path_found = false;
+    {
+        std::lock_guard<std::mutex> lock(server->mutex);
+        for (size_t i = 0; i < server->uris.size() && handler == NULL; i++)
+        {
+            if (uriMatches(server, server->uris[i], uri.c_str(), path_len))
+            {
+                path_found = true;
+                handler_copy = server->uris[i];
+                handler = server->uris[i].method == method ? &handler_copy : NULL;
+            }
+        }
+    }
+    if (handler == NULL)
+    {
+        failRequest(server, s, path_found ? HTTPD_405_METHOD_NOT_ALLOWED : HTTPD_404_NOT_FOUND);
+        return;
+    }
+
+    HostRequest r;
+    initRequest(r, server, s);
+    r.req.method = method;
+    memcpy((char *)r.req.uri, uri.c_str(), uri.size() + 1);
+    r.req.content_len = content_len;
+    r.req.user_ctx = handler->user_ctx;
+    r.remaining = content_len;
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    if (handler->is_websocket && upgrade && !ws_key.empty() && method == HTTP_GET)
+    {
+        if (!wsHandshake(r, ws_key, handler->supported_subprotocol))
+        {
+            closeSession(server, s);
+            return;
+        }
+        std::lock_guard<std::mutex> lock(server->mutex);
+        s.ws = true;
+        s.ws_handler = handler->handler;
+        s.ws_control_frames = handler->handle_ws_control_frames;
+        s.ws_user_ctx = handler->user_ctx;
+    }
+#endif
+
+    esp_err_t res = handler->handler(&r.req);
+    keepSessionContext(r);
+    if (res != ESP_OK)
+    {
+        log_w("URI handler of %s failed", handler->uri);
+        closeSession(server, s);
+        return;
+    }
+
+    // Body the handler did not read
+    if (r.remaining > MAX_CONTENT_PURGE)
+    {
+        closeSession(server, s);
+        return;
+    }
+    std::vector<uint8_t> purge(r.remaining);
+    if (r.remaining > 0 && !recvExact(s, purge.data(), r.remaining))
+    {
+        closeSession(server, s);
+    }
+}
+
+static void acceptConnection(HostServer *server)
+{
+    HostSession *slot = NULL;
+    for (size_t i = 0; i < server->sessions.size() && slot == NULL; i++)
+    {
+        slot = server->sessions[i].fd < 0 ? &server->sessions[i] : NULL;
+    }
+    if (slot == NULL)
+    {
+        // Only with lru_purge_enable, the connection is accepted next time
+        HostSession *lru = &server->sessions[0];
+        for (size_t i = 1; i < server->sessions.size(); i++)
+        {
+            lru = server->sessions[i].lru < lru->lru ? &server->sessions[i] : lru;
+        }
+        log_d("Closing least recently used socket %d", lru->fd);
+        closeSession(server, *lru);
+        return;
+    }
+
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd = accept(server->listen_fd, (struct sockaddr *)&addr, &addr_len);
+    if (fd < 0)
+    {
+        log_e("accept failed: %s", strerror(errno));
+        return;
+    }
+    if (lwip_sockets.fetch_add(1) >= CONFIG_LWIP_MAX_SOCKETS)
+    {
+        // lwIP has no socket for the connection and aborts it
+        log_e("No free socket for a new connection");
+        lwip_sockets--;
+        close(fd);
+        return;
+    }
+
+    struct timeval recv_timeout = {server->config.recv_wait_timeout, 0};
+    struct timeval send_timeout = {server->config.send_wait_timeout, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &recv_timeout, sizeof(recv_timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+    if (server->config.open_fn != NULL && server->config.open_fn(server, fd) != ESP_OK)
+    {
+        lwip_sockets--;
+        close(fd);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(server->mutex);
+    slot->fd = fd;
+    slot->in.clear();
+    slot->lru = esp_timer_get_time();
+    slot->ctx = NULL;
+    slot->free_ctx = NULL;
+    slot->ws = false;
+}
+
+static void runWork(HostServer *server)
+{
+    char buf[64];
+    while (recv(server->ctrl_fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+    {
+    }
+    for (;;)
+    {
+        HostWork work;
+        {
+            std::lock_guard<std::mutex> lock(server->mutex);
+            if (server->work.empty())
+            {
+                return;
+            }
+            work = server->work.front();
+            server->work.pop_front();
+        }
+        if (work.close_fd >= 0)
+        {
+            HostSession *s = findSession(server, work.close_fd);
+            if (s != NULL)
+            {
+                closeSession(server, *s);
+            }
+        }
+        else
+        {
+            work.fn(work.arg);
+        }
+    }
+}
+
+static void *serverMain(void *arg)
+{
+    HostServer *server = (HostServer *)arg;
+    for (;;)
+    {
+        fd_set read_set;
+        FD_ZERO(&read_set);
+        FD_SET(server->ctrl_fd, &read_set);
+        int max_fd = server->ctrl_fd;
+        // Only listen for new connections with a free session, or when the
+        // least recently used one may be closed for it
+        if (server->config.lru_purge_enable || openSessions(server) < server->config.max_open_sockets)
+        {
+            FD_SET(server->listen_fd, &read_set);
+            max_fd = std::max(max_fd, server->listen_fd);
+        }
+        for (size_t i = 0; i < server->sessions.size(); i++)
+        {
+            if (server->sessions[i].fd >= 0)
+            {
+                FD_SET(server->sessions[i].fd, &read_set);
+                max_fd = std::max(max_fd, server->sessions[i].fd);
+            }
+        }
+
+        if (select(max_fd + 1, &read_set, NULL, NULL, NULL) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            log_e("select failed: %s", strerror(errno));
+            break;
+        }
+        {
+            std::lock_guard<std::mutex> lock(server->mutex);
+            if (server->stop)
+            {
+                break;
+            }
+        }
+        if (FD_ISSET(server->ctrl_fd, &read_set))
+        {
+            runWork(server);
+        }
+        for (size_t i = 0; i < server->sessions.size(); i++)
+        {
+            HostSession &s = server->sessions[i];
+            if (s.fd < 0 || !FD_ISSET(s.fd, &read_set))
+            {
+                continue;
+            }
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+            if (s.ws)
+            {
+                processFrame(server, s);
+                continue;
+            }
+#endif
+            // Requests that arrived together are served one after the other
+            do
+            {
+                processRequest(server, s);
+            } while (s.fd >= 0 && !s.ws && s.in.find("\r\n\r\n") != std::string::npos);
+        }
+        if (FD_ISSET(server->listen_fd, &read_set))
+        {
+            acceptConnection(server);
+        }
+    }
+
+    for (size_t i = 0; i < server->sessions.size(); i++)
+    {
+        closeSession(server, server->sessions[i]);
+    }
+    return NULL;
+}
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config)
+{
+    if (handle == NULL || config == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // The listening and control sockets and one more for the control
+    // messages of httpd_queue_work() are needed besides the sessions
+    if (config->max_open_sockets > CONFIG_LWIP_MAX_SOCKETS - 3)
+    {
+        log_e("max_open_sockets is too large (max allowed %d)", CONFIG_LWIP_MAX_SOCKETS - 3);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (lwip_sockets + 2 > CONFIG_LWIP_MAX_SOCKETS)
+    {
+        log_e("No free sockets for the server");
+        return ESP_FAIL;
+    }
+
+    HostServer *server = new HostServer;
+    server->config = *config;
+    server->sessions.resize(config->max_open_sockets);
+    for (size_t i = 0; i < server->sessions.size(); i++)
+    {
+        server->sessions[i].fd = -1;
+        server->sessions[i].ctx = NULL;
+        server->sessions[i].free_ctx = NULL;
+        server->sessions[i].ws = false;
+    }
+    server->stop = false;
+
+    server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    server->ctrl_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int on = 1;
+    setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(config->server_port + httpdHostPortOffset);
+    memset(&server->ctrl_addr, 0, sizeof(server->ctrl_addr));
+    server->ctrl_addr.sin_family = AF_INET;
+    server->ctrl_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server->ctrl_addr.sin_port = htons(config->ctrl_port + httpdHostPortOffset);
+    if (server->listen_fd < 0 || server->ctrl_fd < 0 ||
+        bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(server->listen_fd, config->backlog_conn) < 0 ||
+        bind(server->ctrl_fd, (struct sockaddr *)&server->ctrl_addr, sizeof(server->ctrl_addr)) < 0)
+    {
+        log_e("Server on port %d not started: %s", config->server_port + httpdHostPortOffset, strerror(errno));
+        close(server->listen_fd);
+        close(server->ctrl_fd);
+        delete server;
+        return ESP_FAIL;
+    }
+    lwip_sockets += 2;
+
+    if (pthread_create(&server->thread, NULL, serverMain, server) != 0)
+    {
+        close(server->listen_fd);
+        close(server->ctrl_fd);
+        lwip_sockets -= 2;
+        delete server;
+        return ESP_ERR_HTTPD_TASK;
+    }
+    pthread_setname_np(server->thread, "httpd");
+    *handle = server;
+    return ESP_OK;
+}
+
+esp_err_t httpd_stop(httpd_handle_t handle)
+{
+    HostServer *server = (HostServer *)handle;
+    if (server == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    {
+        std::lock_guard<std::mutex> lock(server->mutex);
+        server->stop = true;
+    }
+    wake(server);
+    pthread_join(server->thread, NULL);
+    close(server->listen_fd);
+    close(server->ctrl_fd);
+    lwip_sockets -= 2;
+    if (server->config.global_user_ctx != NULL)
+    {
+        if (server->config.global_user_ctx_free_fn != NULL)
+        {
+            server->config.global_user_ctx_free_fn(server->config.global_user_ctx);
+        }
+        else
+        {
+            free(server->config.global_user_ctx);
+        }
+    }
+    delete server;
+    return ESP_OK;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler)
+{
+    HostServer *server = (HostServer *)handle;
+    if (server == NULL || uri_handler == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    std::lock_guard<std::mutex> lock(server->mutex);
+    for (size_t i = 0; i < server->uris.size(); i++)
+    {
+        if (server->uri_names[i] == uri_handler->uri && server->uris[i].method == uri_handler->method)
+        {
+            log_w("Handler %s already registered", uri_handler->uri);
+            return ESP_ERR_HTTPD_HANDLER_EXISTS;
+        }
+    }
+    if (server->uris.size() >= server->config.max_uri_handlers)
+    {
+        log_w("No slot left for handler %s, max_uri_handlers is %d", uri_handler->uri,
+              server->config.max_uri_handlers);
+        return ESP_ERR_HTTPD_HANDLERS_FULL;
+    }
+    server->uri_names.push_back(uri_handler->uri);
+    server->uris.push_back(*uri_handler);
+    server->uris.back().uri = server->uri_names.back().c_str();
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status)
+{
+    ((HostRequest *)r->aux)->status = status;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type)
+{
+    ((HostRequest *)r->aux)->type = type;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field, const char *value)
+{
+    HostRequest *ra = (HostRequest *)r->aux;
+    if (ra->headers.size() >= ra->server->config.max_resp_headers)
+    {
+        return ESP_ERR_HTTPD_RESP_HDR;
+    }
+    ra->headers.push_back(std::make_pair(std::string(field), std::string(value)));
+    return ESP_OK;
+}
+
+// Status line and header fields, ending with the empty line
+static std::string responseHead(HostRequest *ra, const char *length_field)
+{
+    std::string head = "HTTP/1.1 " + ra->status + "\r\nContent-Type: " + ra->type + "\r\n" + length_field;
+    for (size_t i = 0; i < ra->headers.size(); i++)
+    {
+        head += ra->headers[i].first + ": " + ra->headers[i].second + "\r\n";
+    }
+    return head + "\r\n";
+}
+
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len)
+{
+    HostRequest *ra = (HostRequest *)r->aux;
+    if (buf_len == HTTPD_RESP_USE_STRLEN)
+    {
+        buf_len = buf != NULL ? strlen(buf) : 0;
+    }
+    char length_field[40];
+    snprintf(length_field, sizeof(length_field), "Content-Length: %d\r\n", (int)buf_len);
+    std::string head = responseHead(ra, length_field);
+    if (!sendAll(ra->session->fd, head.data(), head.size()) ||
+        (buf_len > 0 && !sendAll(ra->session->fd, buf, buf_len)))
+    {
+        return ESP_ERR_HTTPD_RESP_SEND;
+    }
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *r, const char *buf, ssize_t buf_len)
+{
+    HostRequest *ra = (HostRequest *)r->aux;
+    if (buf_len == HTTPD_RESP_USE_STRLEN)
+    {
+        buf_len = buf != NULL ? strlen(buf) : 0;
+    }
+    if (!ra->chunked)
+    {
+        std::string head = responseHead(ra, "Transfer-Encoding: chunked\r\n");
+        if (!sendAll(ra->session->fd, head.data(), head.size()))
+        {
+            return ESP_ERR_HTTPD_RESP_SEND;
+        }
+        ra->chunked = true;
+    }
+    // A chunk of length 0 ends the response
+    char size[12];
+    int n = snprintf(size, sizeof(size), "%x\r\n", (unsigned)buf_len);
+    if (!sendAll(ra->session->fd, size, n) ||
+        (buf != NULL && buf_len > 0 && !sendAll(ra->session->fd, buf, buf_len)) ||
+        !sendAll(ra->session->fd, "\r\n", 2))
+    {
+        return ESP_ERR_HTTPD_RESP_SEND;
+    }
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t *req, httpd_err_code_t error, const char *usr_msg)
+{
+    const char *msg;
+    const char *status = errorStatus(error, &msg);
+    httpd_resp_set_status(req, status);
+    httpd_resp_set_type(req, HTTPD_TYPE_TEXT);
+    return httpd_resp_send(req, usr_msg != NULL ? usr_msg : msg, HTTPD_RESP_USE_STRLEN);
+}
+
+static const char *queryOf(httpd_req_t *r)
+{
+    const char *q = strchr(r->uri, '?');
+    return q != NULL ? q + 1 : NULL;
+}
+
+size_t httpd_req_get_url_query_len(httpd_req_t *r)
+{
+    const char *q = queryOf(r);
+    return q != NULL ? strlen(q) : 0;
+}
+
+esp_err_t httpd_req_get_url_query_str(httpd_req_t *r, char *buf, size_t buf_len)
+{
+    const char *q = queryOf(r);
+    if (q == NULL)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (buf == NULL || buf_len == 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    snprintf(buf, buf_len, "%s", q);
+    return strlen(q) >= buf_len ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+}
+
+esp_err_t httpd_query_key_value(const char *qry, const char *key, char *val, size_t val_size)
+{
+    if (qry == NULL || key == NULL || val == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t key_len = strlen(key);
+    for (const char *p = qry; *p;)
+    {
+        const char *end = strchr(p, '&');
+        end = end != NULL ? end : p + strlen(p);
+        const char *eq = (const char *)memchr(p, '=', end - p);
+        if (eq != NULL && (size_t)(eq - p) == key_len && strncmp(p, key, key_len) == 0)
+        {
+            size_t len = end - eq - 1;
+            if (val_size == 0)
+            {
+                return ESP_ERR_HTTPD_RESULT_TRUNC;
+            }
+            size_t copy = std::min(len, val_size - 1);
+            memcpy(val, eq + 1, copy);
+            val[copy] = 0;
+            return len > copy ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+        }
+        p = *end ? end + 1 : end;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+int httpd_req_to_sockfd(httpd_req_t *r)
+{
+    return r != NULL ? ((HostRequest *)r->aux)->session->fd : -1;
+}
+
+int httpd_send(httpd_req_t *r, const char *buf, size_t buf_len)
+{
+    if (r == NULL || buf == NULL)
+    {
+        return HTTPD_SOCK_ERR_INVALID;
+    }
+    return sendSome(httpd_req_to_sockfd(r), buf, buf_len, 0);
+}
+
+int httpd_socket_send(httpd_handle_t hd, int sockfd, const char *buf, size_t buf_len, int flags)
+{
+    HostServer *server = (HostServer *)hd;
+    {
+        std::lock_guard<std::mutex> lock(server->mutex);
+        if (findSession(server, sockfd) == NULL)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    return sendSome(sockfd, buf, buf_len, flags);
+}
+
+esp_err_t httpd_queue_work(httpd_handle_t handle, httpd_work_fn_t work, void *arg)
+{
+    HostServer *server = (HostServer *)handle;
+    if (server == NULL || work == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    {
+        std::lock_guard<std::mutex> lock(server->mutex);
+        HostWork w = {work, arg, -1};
+        server->work.push_back(w);
+    }
+    wake(server);
+    return ESP_OK;
+}
+
+esp_err_t httpd_sess_trigger_close(httpd_handle_t handle, int sockfd)
+{
+    HostServer *server = (HostServer *)handle;
+    {
+        std::lock_guard<std::mutex> lock(server->mutex);
+        if (findSession(server, sockfd) == NULL)
+        {
+            return ESP_ERR_NOT_FOUND;
+        }
+        HostWork w = {NULL, NULL, sockfd};
+        server->work.push_back(w);
+    }
+    wake(server);
+    return ESP_OK;
+}
@@ -0,0 +1,8 @@
+// Text and rectangle drawing of esp32-camera, which the firmware includes
+// without calling. The host build has none.
+#ifndef HOST_FB_GFX_H
+#define HOST_FB_GFX_H
+
+#include "esp_camera.h"
+
+#endif
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_timer.h"
+
+// FreeRTOS on POSIX threads for the host build, see freertos/FreeRTOS.h
+
+struct HostTask
+{
+    TaskFunction_t code;
+    void *arg;
+    BaseType_t core;
+    std::mutex mutex;
+    std::condition_variable notified;
+    uint32_t notifications; // Under mutex
+};
+
+struct HostQueue
+{
+    std::mutex mutex;
+    std::condition_variable changed;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    std::vector<uint8_t> items; // Ring of length items, under mutex
+    UBaseType_t head;           // Oldest item, under mutex
+    UBaseType_t count;          // Under mutex
+};
+
+static thread_local HostTask *current_task = NULL;
+
+// Waits on cond until ready() or until ticks pass, portMAX_DELAY waits forever
+template <typename Ready>
+static bool waitTicks(std::condition_variable &cond, std::unique_lock<std::mutex> &lock, TickType_t ticks, Ready ready)
+{
+    if (ticks == portMAX_DELAY)
+    {
+        cond.wait(lock, ready);
+        return true;
+    }
+    return cond.wait_for(lock, std::chrono::milliseconds(ticks * portTICK_PERIOD_MS), ready);
+}
+
+static void *taskMain(void *arg)
+{
+    current_task = (HostTask *)arg;
+    current_task->code(current_task->arg);
+    return NULL; // A task returning is an error in FreeRTOS, here it ends the thread
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char *name, uint32_t /* stack_depth */, void *arg,
+                                   UBaseType_t /* priority */, TaskHandle_t *created, BaseType_t core_id)
+{
+    // The task is never freed, the handle stays valid after vTaskDelete()
+    // as other tasks may still notify it
+    HostTask *task = new HostTask;
+    task->code = code;
+    task->arg = arg;
+    task->core = core_id == tskNO_AFFINITY ? 0 : core_id;
+    task->notifications = 0;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    int err = pthread_create(&thread, &attr, taskMain, task);
+    pthread_attr_destroy(&attr);
+    if (err != 0)
+    {
+        fprintf(stderr, "Task %s not created: %s\n", name, strerror(err));
+        delete task;
+        return pdFAIL;
+    }
+    pthread_setname_np(thread, name);
+    if (created != NULL)
+    {
+        *created = task;
+    }
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task != NULL && task != current_task)
+    {
+        fprintf(stderr, "vTaskDelete of another task is not supported\n");
+        return;
+    }
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    usleep((useconds_t)ticks * portTICK_PERIOD_MS * 1000);
+}
+
+TickType_t xTaskGetTickCount()
+{
+    static const int64_t start = esp_timer_get_time();
+    return (TickType_t)((esp_timer_get_time() - start) / (1000 * portTICK_PERIOD_MS));
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+    if (current_task == NULL)
+    {
+        current_task = new HostTask;
+        current_task->code = NULL;
+        current_task->arg = NULL;
+        current_task->core = 0;
+        current_task->notifications = 0;
+    }
+    return current_task;
+}
+
+BaseType_t xPortGetCoreID()
+{
+    return current_task != NULL ? current_task->core : 0;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    std::lock_guard<std::mutex> lock(task->mutex);
+    task->notifications++;
+    task->notified.notify_one();
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks)
+{
+    HostTask *task = xTaskGetCurrentTaskHandle();
+    std::unique_lock<std::mutex> lock(task->mutex);
+    waitTicks(task->notified, lock, ticks, [task] { return task->notifications > 0; });
+    uint32_t count = task->notifications;
+    if (count > 0)
+    {
+        task->notifications = clear_on_exit ? 0 : count - 1;
+    }
+    return count;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    if (length == 0)
+    {
+        return NULL;
+    }
+    HostQueue *queue = new HostQueue;
+    queue->length = length;
+    queue->item_size = item_size;
+    queue->items.resize((size_t)length * item_size);
+    queue->head = 0;
+    queue->count = 0;
+    return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    delete queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    if (!waitTicks(queue->changed, lock, ticks, [queue] { return queue->count < queue->length; }))
+    {
+        return pdFALSE;
+    }
+    UBaseType_t tail = (queue->head + queue->count) % queue->length;
+    if (queue->item_size > 0)
+    {
+        memcpy(&queue->items[(size_t)tail * queue->item_size], item, queue->item_size);
+    }
+    queue->count++;
+    queue->changed.notify_all();
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    if (!waitTicks(queue->changed, lock, ticks, [queue] { return queue->count > 0; }))
+    {
+        return pdFALSE;
+    }
+    if (queue->item_size > 0)
+    {
+        memcpy(item, &queue->items[(size_t)queue->head * queue->item_size], queue->item_size);
+    }
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    queue->changed.notify_all();
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    return queue->count;
+}
@@ -0,0 +1,60 @@
+// Camera of the host build. esp_camera_init() starts a sensor thread that
+// produces frames at a fixed rate from a directory of JPEG files, an MJPEG
+// file (any file of concatenated JPEG images, such as a saved /stream) or
+// a synthetic scene of a red square moving over a noisy background.
+//
+// Every frame is exposed for exposure_us, then transferred into a free
+// frame buffer for dma_us before esp_camera_fb_get() can return it. The
+// frame buffers and the grab mode of camera_config_t behave as in the
+// driver: with CAMERA_GRAB_LATEST a new frame replaces the oldest frame
+// that nobody took yet, with CAMERA_GRAB_WHEN_EMPTY a frame is dropped
+// while all buffers are full.
+//
+// Frames are scaled to the frame size of the sensor and delivered in its
+// pixel format. set_framesize, set_pixformat, set_quality, set_hmirror,
+// set_vflip and set_colorbar act on the next frame, the other sensor
+// settings and registers are only stored.
+#ifndef HOST_CAMERA_H
+#define HOST_CAMERA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+struct HostCameraConfig
+{
+    const char *source; // "synthetic", "dir:<path>" or "mjpeg:<path>"
+    float fps;          // Frames the sensor produces per second
+    int exposure_us;    // Exposure of a frame
+    int dma_us;         // Transfer of a frame into its buffer
+    int jitter_us;      // Random extra delay of a frame, up to this
+};
+
+// Counters since esp_camera_init()
+struct HostCameraStats
+{
+    uint32_t produced;  // Frames the sensor exposed
+    uint32_t delivered; // Frames returned by esp_camera_fb_get()
+    uint32_t replaced;  // Frames overwritten unseen (CAMERA_GRAB_LATEST)
+    uint32_t dropped;   // Frames without a free buffer
+    uint32_t late;      // Frames the sensor thread could not prepare in time
+};
+
+// Defaults: synthetic frames at 25 frames/s, 10 ms exposure, 2 ms DMA
+HostCameraConfig &hostCamera();
+
+// Apply a command line option (--camera <source>, --fps <n>,
+// --exposure-us <n>, --dma-us <n> or --jitter-us <n>). Returns false if
+// name is not one of them. Takes effect at the next esp_camera_init().
+bool hostCameraArg(const char *name, const char *value);
+
+// Usage lines of the options above
+extern const char *HOST_CAMERA_USAGE;
+
+HostCameraStats hostCameraStats();
+
+// JPEG codec of the host camera and img_converters.cpp, pixels are R, G, B
+bool hostJpegDecode(const uint8_t *jpg, size_t len, std::vector<uint8_t> &rgb, int &width, int &height);
+bool hostJpegEncode(const uint8_t *rgb, int width, int height, int quality, std::vector<uint8_t> &jpg);
+
+#endif
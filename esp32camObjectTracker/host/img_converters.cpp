@@ -0,0 +1,266 @@
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+#include "img_converters.h"
+#include "host_camera.h"
+
+// Frame conversions of the host build. Everything goes through R, G, B
+// pixels, the speed of these is not what the host build measures.
+
+// libjpeg reports errors with a longjmp back into the codec function
+struct JpegError
+{
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+};
+
+static void jpegErrorExit(j_common_ptr cinfo)
+{
+    longjmp(((JpegError *)cinfo->err)->jump, 1);
+}
+
+bool hostJpegDecode(const uint8_t *jpg, size_t len, std::vector<uint8_t> &rgb, int &width, int &height)
+{
+    struct jpeg_decompress_struct cinfo;
+    JpegError err;
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpegErrorExit;
+    if (setjmp(err.jump))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char *)jpg, len);
+    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK)
+    {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    width = cinfo.output_width;
+    height = cinfo.output_height;
+    rgb.resize((size_t)width * height * 3);
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+        JSAMPROW row = &rgb[(size_t)cinfo.output_scanline * width * 3];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+bool hostJpegEncode(const uint8_t *rgb, int width, int height, int quality, std::vector<uint8_t> &jpg)
+{
+    struct jpeg_compress_struct cinfo;
+    JpegError err;
+    unsigned char *out = NULL;
+    unsigned long out_len = 0;
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpegErrorExit;
+    if (setjmp(err.jump))
+    {
+        jpeg_destroy_compress(&cinfo);
+        free(out);
+        return false;
+    }
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &out, &out_len);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality < 1 ? 1 : quality > 100 ? 100 : quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height)
+    {
+        JSAMPROW row = (JSAMPROW)&rgb[(size_t)cinfo.next_scanline * width * 3];
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    jpg.assign(out, out + out_len);
+    free(out);
+    return true;
+}
+
+static inline uint8_t clamp8(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/**
+ * R, G, B pixels of a frame in one of the sensor formats.
+ *
+ * @param src Frame data
+ * @param len Bytes of frame data
+ * @param width Pixels per row, or 0 to convert all pixels of src as one
+ * row (a JPEG of any size)
+ * @param height Rows
+ * @param format Layout of src
+ * @param rgb Output pixels
+ * @return false for an unsupported format, a bad JPEG or too little data
+ */
+static bool toRgb(const uint8_t *src, size_t len, int width, int height, pixformat_t format, std::vector<uint8_t> &rgb)
+{
+    if (format == PIXFORMAT_JPEG)
+    {
+        int w, h;
+        return hostJpegDecode(src, len, rgb, w, h) && (width == 0 || (w == width && h == height));
+    }
+
+    size_t bytes = format == PIXFORMAT_RGB888 ? 3 : format == PIXFORMAT_GRAYSCALE ? 1 : 2;
+    size_t pixels = width > 0 ? (size_t)width * height : len / bytes;
+    if (len < pixels * bytes)
+    {
+        return false;
+    }
+    rgb.resize(pixels * 3);
+    uint8_t *p = rgb.data();
+    for (size_t i = 0; i < pixels; i++, p += 3)
+    {
+        switch (format)
+        {
+        case PIXFORMAT_RGB565:
+        {
+            uint16_t v = (src[i * 2] << 8) | src[i * 2 + 1]; // Big-endian
+            p[0] = ((v >> 11) & 0x1F) << 3;
+            p[1] = ((v >> 5) & 0x3F) << 2;
+            p[2] = (v & 0x1F) << 3;
+            break;
+        }
+        case PIXFORMAT_YUV422:
+        {
+            const uint8_t *q = src + (i & ~1) * 2; // Y0 U Y1 V
+            int y = q[(i & 1) * 2], u = q[1] - 128, v = q[3] - 128;
+            p[0] = clamp8(y + ((359 * v) >> 8));
+            p[1] = clamp8(y - ((88 * u + 183 * v) >> 8));
+            p[2] = clamp8(y + ((454 * u) >> 8));
+            break;
+        }
+        case PIXFORMAT_GRAYSCALE:
+            p[0] = p[1] = p[2] = src[i];
+            break;
+        case PIXFORMAT_RGB888:
+            p[0] = src[i * 3 + 2];
+            p[1] = src[i * 3 + 1];
+            p[2] = src[i * 3];
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+bool fmt2rgb888(const uint8_t *src_buf, size_t src_len, pixformat_t format, uint8_t *rgb_buf)
+{
+    std::vector<uint8_t> rgb;
+    if (!toRgb(src_buf, src_len, 0, 0, format, rgb))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < rgb.size(); i += 3)
+    {
+        rgb_buf[i] = rgb[i + 2];
+        rgb_buf[i + 1] = rgb[i + 1];
+        rgb_buf[i + 2] = rgb[i];
+    }
+    return true;
+}
+
+bool fmt2jpg_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpg_out_cb cb, void *arg)
+{
+    std::vector<uint8_t> rgb, jpg;
+    if (!toRgb(src, src_len, width, height, format, rgb) || !hostJpegEncode(rgb.data(), width, height, quality, jpg))
+    {
+        return false;
+    }
+    // In pieces as the driver writes them
+    const size_t CHUNK = 1024;
+    for (size_t index = 0; index < jpg.size(); index += CHUNK)
+    {
+        size_t len = jpg.size() - index < CHUNK ? jpg.size() - index : CHUNK;
+        if (cb(arg, index, &jpg[index], len) != len)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool frame2jpg_cb(camera_fb_t *fb, uint8_t quality, jpg_out_cb cb, void *arg)
+{
+    return fmt2jpg_cb(fb->buf, fb->len, fb->width, fb->height, fb->format, quality, cb, arg);
+}
+
+bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, uint8_t **out, size_t *out_len)
+{
+    std::vector<uint8_t> rgb, jpg;
+    if (!toRgb(src, src_len, width, height, format, rgb) || !hostJpegEncode(rgb.data(), width, height, quality, jpg))
+    {
+        return false;
+    }
+    *out = (uint8_t *)malloc(jpg.size());
+    if (*out == NULL)
+    {
+        return false;
+    }
+    memcpy(*out, jpg.data(), jpg.size());
+    *out_len = jpg.size();
+    return true;
+}
+
+bool frame2jpg(camera_fb_t *fb, uint8_t quality, uint8_t **out, size_t *out_len)
+{
+    return fmt2jpg(fb->buf, fb->len, fb->width, fb->height, fb->format, quality, out, out_len);
+}
+
+bool fmt2bmp(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t **out, size_t *out_len)
+{
+    std::vector<uint8_t> rgb;
+    if (!toRgb(src, src_len, width, height, format, rgb) || rgb.size() != (size_t)width * height * 3)
+    {
+        return false;
+    }
+
+    // 24-bit, rows top-down
+    const size_t HEADER_SIZE = 54;
+    size_t stride = ((width * 3 + 3) / 4) * 4;
+    size_t len = HEADER_SIZE + stride * height;
+    uint8_t *bmp = (uint8_t *)calloc(1, len);
+    if (bmp == NULL)
+    {
+        return false;
+    }
+    int32_t header[13] = {
+        (int32_t)len, 0, (int32_t)HEADER_SIZE, 40, width, -(int32_t)height,
+        1 | (24 << 16), 0, (int32_t)(stride * height), 0x0B13, 0x0B13, 0, 0};
+    bmp[0] = 'B';
+    bmp[1] = 'M';
+    memcpy(bmp + 2, header, sizeof(header));
+    for (int y = 0; y < height; y++)
+    {
+        uint8_t *row = bmp + HEADER_SIZE + y * stride;
+        const uint8_t *p = &rgb[(size_t)y * width * 3];
+        for (int x = 0; x < width; x++, p += 3)
+        {
+            row[x * 3] = p[2];
+            row[x * 3 + 1] = p[1];
+            row[x * 3 + 2] = p[0];
+        }
+    }
+    *out = bmp;
+    *out_len = len;
+    return true;
+}
+
+bool frame2bmp(camera_fb_t *fb, uint8_t **out, size_t *out_len)
+{
+    return fmt2bmp(fb->buf, fb->len, fb->width, fb->height, fb->format, out, out_len);
+}
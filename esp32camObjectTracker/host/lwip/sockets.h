@@ -0,0 +1,17 @@
+// lwIP sockets for the host build are those of the host. lwIP's limit on
+// open sockets is kept by the HTTP server, see esp_http_server.h.
+#ifndef HOST_LWIP_SOCKETS_H
+#define HOST_LWIP_SOCKETS_H
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+static inline char *inet_ntoa_r(struct in_addr addr, char *buf, int buflen)
+{
+    return (char *)inet_ntop(AF_INET, &addr, buf, buflen);
+}
+
+#endif
@@ -0,0 +1,91 @@
+// The firmware on the host: esp32cam_setup() with the host camera
+// (host_camera.h) and the HTTP server on sockets (esp_http_server.h), in
+// place of src/main.cpp and its WiFi. tools/load_gen.cpp drives it.
+//
+// Build from the esp32camObjectTracker directory:
+//
+//   g++ -O2 -std=gnu++11 -Wall -Wextra -pthread -Ihost -Ibench -Ilib/esp32cam
+//       -o tracker_host host/*.cpp bench/Arduino.cpp lib/esp32cam/*.cpp -ljpeg
+//   ./tracker_host --camera mjpeg:recording.mjpeg --port-offset 8000
+//
+// The web server is then on port 8080 and the stream on 8081.
+//
+// Options, besides those of the camera:
+//   --port-offset <n>  Added to the ports of the firmware (8000)
+//   --seconds <n>      Stop after this time, 0 runs until killed (0)
+
+#include <signal.h>
+#include "Arduino.h"
+#include "esp_http_server.h"
+#include "host_camera.h"
+#include "vision.h"
+
+extern void esp32cam_setup();
+
+static void usage()
+{
+    fprintf(stderr, "tracker_host [options]\n%s"
+                    "  --port-offset <n>   Added to the ports of the firmware (8000)\n"
+                    "  --seconds <n>       Stop after this time, 0 runs until killed (0)\n",
+            HOST_CAMERA_USAGE);
+}
+
+int main(int argc, char **argv)
+{
+    int seconds = 0;
+    httpdHostPortOffset = 8000;
+    for (int i = 1; i < argc; i += 2)
+    {
+        const char *name = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (value == NULL)
+        {
+            usage();
+            return 1;
+        }
+        if (hostCameraArg(name, value))
+        {
+            continue;
+        }
+        else if (!strcmp(name, "--port-offset"))
+        {
+            httpdHostPortOffset = atoi(value);
+        }
+        else if (!strcmp(name, "--seconds"))
+        {
+            seconds = std::max(0, atoi(value));
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    // Writes to a closed connection fail with EPIPE, as on lwIP
+    signal(SIGPIPE, SIG_IGN);
+    esp32cam_setup();
+    printf("\nWeb server on port %d, stream on port %d\n", 80 + httpdHostPortOffset, 81 + httpdHostPortOffset);
+
+    // As the loop() of src/main.cpp, with the counters of the camera
+    for (int second = 1; seconds == 0 || second <= seconds; second++)
+    {
+        delay(1000);
+        VisionResult result;
+        HostCameraStats stats = hostCameraStats();
+        if (visionLatest(result) && result.found)
+        {
+            printf("Frame %u object: (%d,%d)-(%d,%d), camera %u frames, %u replaced\n", result.frame,
+                   result.left, result.top, result.right, result.bottom, stats.produced, stats.replaced);
+        }
+        else
+        {
+            printf("Frame %u no object, camera %u frames, %u replaced\n", result.frame, stats.produced,
+                   stats.replaced);
+        }
+    }
+
+    // The tasks never end, leave without the destructors of their objects
+    fflush(stdout);
+    _exit(0);
+}
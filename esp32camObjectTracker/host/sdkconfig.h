@@ -0,0 +1,11 @@
+// Options of the ESP-IDF build that the firmware and the host build of the
+// HTTP server depend on, with the values of the esp32cam environment
+#ifndef HOST_SDKCONFIG_H
+#define HOST_SDKCONFIG_H
+
+#define CONFIG_HTTPD_WS_SUPPORT 1
+#define CONFIG_HTTPD_MAX_REQ_HDR_LEN 512
+#define CONFIG_HTTPD_MAX_URI_LEN 512
+#define CONFIG_LWIP_MAX_SOCKETS 16
+
+#endif
@@ -23,8 +23,18 @@
 #include "sdkconfig.h"
 #include "camera_index.h"
 #include "page.h"
-#include "detect.cpp"
+#include "detect.h"
+#include "vision.h"
+#include "seqring.h"
+#include "bufpool.h"
+#include "broadcast.h"
+#include "telemetry.h"
+#include "jpeg.h"
 #include "esp_heap_caps.h"
+#include "freertos/semphr.h"
+#include "lwip/sockets.h"
+#include <new>
+#include <stdarg.h>
 
 #if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
 #include "esp32-hal-log.h"
@@ -41,11 +51,63 @@
 
 int led_duty = 0;
 int level = 0;       // Flash led level
-int red_level = 230; // filter level for red channel
-int green_level = 160;
-int blue_level = 210;
 bool isStreaming = false;
 
+// All detection settings. They are never changed in place: a writer edits
+// a copy and publishes it as a new version, which the vision task picks up
+// at the start of a frame. See configBegin() and configEnd().
+struct DetectConfig
+{
+  uint32_t version;
+  int red_level; // filter level for red channel
+  int green_level;
+  int blue_level;
+  int detect_mode;
+  bool dc_refine;   // Refine JPEG DC detections to pixel precision
+  int min_area;     // Smallest blob in pixels in DETECT_BLOBS mode
+  bool morph_open;  // Remove specks from the threshold mask
+  int track_misses; // Missed frames before DETECT_TRACK scans the full frame
+  bool dual_core;   // Scan the bottom half of full frame scans on the other core
+  bool pipeline;    // Overlap capture, conversion and detection of successive frames
+  bool stream_boxes;   // Draw the boxes into the stream frames
+  int event_epsilon;   // Box movement in pixels that /events reports
+  int event_heartbeat; // Milliseconds without a change before /events sends a heartbeat
+
+  // Color classes detected together in one pass on every frame while any
+  // of them is enabled
+  ColorClass classes[COLOR_MAX_CLASSES];
+};
+
+// Published versions, double buffered. Writers hold config_lock.
+static SeqRing<DetectConfig, 2> config_ring;
+static SemaphoreHandle_t config_lock = NULL;
+
+// Version used by the current frame, only touched by the vision task
+static DetectConfig frame_config;
+
+// The tables and detector state below are only touched by the vision task.
+// Handlers read what they need from the published VisionResult.
+
+// Color classification table for the levels of frame_config, only rebuilt
+// when a level changes so the detectors do a single lookup per pixel
+static ColorLut color_lut;
+static ClassLut *class_lut = NULL; // 128 KB, allocated in PSRAM
+
+// Bit-packed threshold mask and scratch space for the morphology
+static BitMask frame_mask;
+static BitMask scratch_mask;
+
+// Parser state and block map of DETECT_JPEG_DC
+static JpegDCState jpeg_dc_state;
+
+// Window search state of DETECT_TRACK
+#define TRACK_MARGIN 8 // Pixels added around the predicted box
+static TrackState track_state;
+
+// Blobs found by the last detection in DETECT_BLOBS mode
+static Blob frame_blobs[BLOB_MAX_BLOBS];
+static int frame_blob_count = 0;
+
 #endif
 
 typedef struct
@@ -54,14 +116,50 @@ typedef struct
   size_t len;
 } jpg_chunking_t;
 
+static size_t jpg_encode_stream(void *arg, size_t index, const void *data, size_t len)
+{
+  jpg_chunking_t *j = (jpg_chunking_t *)arg;
+  if (!index)
+  {
+    j->len = 0;
+  }
+  if (httpd_resp_send_chunk(j->req, (const char *)data, len) != ESP_OK)
+  {
+    return 0;
+  }
+  j->len += len;
+  return len;
+}
+
 #define PART_BOUNDARY "123456789000000000000987654321"
 static const char *_STREAM_CONTENT_TYPE = "multipart/x-mixed-replace;boundary=" PART_BOUNDARY;
 static const char *_STREAM_BOUNDARY = "\r\n--" PART_BOUNDARY "\r\n";
-static const char *_STREAM_PART = "Content-Type: image/jpeg\r\nContent-Length: %u\r\nX-Timestamp: %d.%06d\r\n\r\n";
+static const char *_STREAM_PART_HEAD = "Content-Type: image/jpeg\r\nContent-Length: %u\r\nX-Timestamp: %d.%06d\r\n";
 
 httpd_handle_t stream_httpd = NULL;
 httpd_handle_t camera_httpd = NULL;
 
+// Formats at len into a reply of size bytes and advances len. Once the
+// reply is full nothing more is written and it returns false.
+static bool appendf(char *buf, size_t size, size_t &len, const char *format, ...)
+{
+  if (len >= size)
+  {
+    return false;
+  }
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buf + len, size - len, format, args);
+  va_end(args);
+  if (n < 0 || (size_t)n >= size - len)
+  {
+    len = size;
+    return false;
+  }
+  len += n;
+  return true;
+}
+
 #if CONFIG_LED_ILLUMINATOR_ENABLED
 void enable_led(bool en)
 { // Turn LED On or Off
@@ -79,236 +177,1440 @@ void enable_led(bool en)
 }
 #endif
 
+// BMP conversion buffers, borrowed per frame instead of a frame2bmp()
+// allocation. Sized for the largest frame size /control accepts.
+#define BMP_HEADER_SIZE 54
+#define BMP_POOL_COUNT 4 // Conversion and detection, a /bmp reply and the next frame
+#define BMP_POOL_FRAMESIZE FRAMESIZE_QVGA
+static BufferPool bmp_pool;
+
+#define ANNOTATED_JPEG_QUALITY 70 // /bmp?format=jpeg
+
 /**
- * Draw a rectangle on a BMP image
+ * Convert a camera frame into a top-down 24-bit BMP, the same image as
+ * frame2bmp() but in a buffer of the caller.
  *
- * @param bmpData Pointer to the BMP image data
- * @param len Size of the BMP data in bytes
- * @param left X-coordinate of the left edge of the rectangle (in pixels)
- * @param top Y-coordinate of the top edge of the rectangle (in pixels)
- * @param right X-coordinate of the right edge of the rectangle (in pixels)
- * @param bottom Y-coordinate of the bottom edge of the rectangle (in pixels)
- * @return Error codes:
- * 0: Success
- * 1: Invalid BMP signature
- * 2: Unsupported bits per pixel (only 24-bit supported)
- * 3: Rectangle out of bounds
- * 4: Insufficient data length
- * 5: Null pointer provided
+ * @param fb Camera frame
+ * @param buf Output buffer
+ * @param size Size of buf in bytes
+ * @param len Output parameter for the size of the BMP
+ * @return false if the frame does not fit or cannot be converted
  */
-int drawRect(uint8_t *bmpData, size_t len, int left, int top, int right, int bottom)
+static bool frameToBmp(camera_fb_t *fb, uint8_t *buf, size_t size, size_t &len)
+{
+  size_t pixels = fb->width * fb->height * 3;
+  if (size < BMP_HEADER_SIZE + pixels)
+  {
+    log_e("Frame %ux%u too large for a BMP buffer", (unsigned)fb->width, (unsigned)fb->height);
+    return false;
+  }
+
+  int32_t header[13] = {
+      (int32_t)(BMP_HEADER_SIZE + pixels), // File size
+      0,                                   // Reserved
+      BMP_HEADER_SIZE,                     // Offset to the pixels
+      40,                                  // Info header size
+      (int32_t)fb->width,
+      -(int32_t)fb->height, // Negative: rows top-down
+      1 | (24 << 16),       // Planes, bits per pixel
+      0,                    // No compression
+      (int32_t)pixels,
+      0x0B13, 0x0B13, // 72 DPI
+      0, 0};
+  buf[0] = 'B';
+  buf[1] = 'M';
+  memcpy(buf + 2, header, sizeof(header));
+
+  if (!fmt2rgb888(fb->buf, fb->len, fb->format, buf + BMP_HEADER_SIZE))
+  {
+    return false;
+  }
+  len = BMP_HEADER_SIZE + pixels;
+  return true;
+}
+
+// BMP of a frame in a buffer of the pool, NULL if no buffer came free or
+// the conversion failed. Give it back with poolGive().
+static uint8_t *borrowBmp(camera_fb_t *fb, size_t &len)
+{
+  uint8_t *buf = poolTake(bmp_pool, pdMS_TO_TICKS(100));
+  if (buf == NULL)
+  {
+    log_e("No free BMP buffer");
+    return NULL;
+  }
+  if (!frameToBmp(fb, buf, bmp_pool.size, len))
+  {
+    poolGive(bmp_pool, buf);
+    return NULL;
+  }
+  return buf;
+}
+
+static esp_err_t bmp_handler(httpd_req_t *req);
+
+// Map a camera pixel format onto a raw layout detectRaw() can scan.
+// Returns false for formats that need a frame2bmp() conversion first.
+static bool rawFrameFormat(pixformat_t pixformat, FrameFormat &format)
+{
+  switch (pixformat)
+  {
+  case PIXFORMAT_RGB565:
+    format = FRAME_RGB565;
+    return true;
+  case PIXFORMAT_YUV422:
+    format = FRAME_YUV422;
+    return true;
+  case PIXFORMAT_GRAYSCALE:
+    format = FRAME_GRAY8;
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Box of the largest blob of the last detection
+static bool largestBlob(int &left, int &top, int &right, int &bottom)
+{
+  if (frame_blob_count == 0)
+  {
+    return false;
+  }
+  left = frame_blobs[0].left;
+  top = frame_blobs[0].top;
+  right = frame_blobs[0].right;
+  bottom = frame_blobs[0].bottom;
+  return true;
+}
+
+// Publish the first version of the settings
+static bool configInit()
+{
+  config_lock = xSemaphoreCreateMutex();
+  if (config_lock == NULL)
+  {
+    Serial.println("Config lock not created");
+    return false;
+  }
+
+  // Red, green and blue markers as the default classes. They are off, so
+  // frames only get the class pass once a class is enabled.
+  static const ColorClass default_classes[] = {
+      {false, 150, 255, 0, 100, 0, 100},
+      {false, 0, 100, 120, 255, 0, 100},
+      {false, 0, 100, 0, 120, 150, 255}};
+
+  DetectConfig config;
+  memset(&config, 0, sizeof(config));
+  config.version = 1;
+  config.red_level = 230;
+  config.green_level = 160;
+  config.blue_level = 210;
+  config.detect_mode = DETECT_FULL;
+  config.dc_refine = true;
+  config.min_area = 4;
+  config.morph_open = false;
+  config.track_misses = 10;
+  config.dual_core = true;
+  config.pipeline = false;
+  config.stream_boxes = true;
+  config.event_epsilon = 2;
+  config.event_heartbeat = 5000;
+  memcpy(config.classes, default_classes, sizeof(default_classes));
+  seqRingWrite(config_ring, config);
+  return true;
+}
+
+// Latest published settings, for readers
+static void configLatest(DetectConfig &config)
+{
+  seqRingLatest(config_ring, config);
+}
+
+// Start changing the settings: locks out other writers and returns a copy
+// of the latest version to edit
+static void configBegin(DetectConfig &config)
+{
+  xSemaphoreTake(config_lock, portMAX_DELAY);
+  seqRingLatest(config_ring, config);
+}
+
+// Publish the edited copy as a new version if it was changed
+static void configEnd(DetectConfig &config, bool changed)
+{
+  if (changed)
+  {
+    config.version++;
+    seqRingWrite(config_ring, config);
+  }
+  xSemaphoreGive(config_lock);
+}
+
+// Rebuild the class table after a color class changed
+static bool updateClassLut(const ColorClass *classes)
+{
+  if (class_lut == NULL)
+  {
+    class_lut = (ClassLut *)heap_caps_malloc(sizeof(ClassLut), MALLOC_CAP_SPIRAM);
+    if (class_lut == NULL)
+    {
+      Serial.println("Class table allocation failed");
+      return false;
+    }
+  }
+  classLutBuild(*class_lut, classes, COLOR_MAX_CLASSES);
+  return true;
+}
+
+// Switch the vision task to the latest settings at the start of a frame.
+// Tables are only rebuilt for the parts of the settings that changed, once
+// per version.
+static void applyConfig()
+{
+  DetectConfig config;
+  if (!seqRingLatest(config_ring, config) || config.version == frame_config.version)
+  {
+    return;
+  }
+  bool first = frame_config.version == 0;
+
+  if (first || config.red_level != frame_config.red_level ||
+      config.green_level != frame_config.green_level || config.blue_level != frame_config.blue_level)
+  {
+    colorLutBuildLevels(color_lut, config.red_level, config.green_level, config.blue_level);
+  }
+  if (first || memcmp(config.classes, frame_config.classes, sizeof(config.classes)))
+  {
+    updateClassLut(config.classes);
+  }
+  if (first || config.detect_mode != frame_config.detect_mode || config.track_misses != frame_config.track_misses)
+  {
+    trackBegin(track_state, config.track_misses, TRACK_MARGIN);
+  }
+  frame_config = config;
+}
+
+// Assign a control value to a setting, true if that changed it
+template <typename T>
+static bool setField(T &field, int val)
+{
+  T old = field;
+  field = val;
+  return field != old;
+}
+
+// Set a field of a color class from a class<n>_<field> control variable,
+// changed tells whether its value changed
+static int setClassField(DetectConfig &config, const char *variable, int val, bool &changed)
+{
+  int id;
+  char field[8];
+  if (sscanf(variable, "class%d_%7s", &id, field) != 2 || id < 0 || id >= COLOR_MAX_CLASSES)
+  {
+    return -1;
+  }
+
+  ColorClass &cc = config.classes[id];
+  uint8_t level = constrain(val, 0, 255);
+  if (!strcmp(field, "on"))
+    changed = setField(cc.enabled, val);
+  else if (!strcmp(field, "rmin"))
+    changed = setField(cc.rmin, level);
+  else if (!strcmp(field, "rmax"))
+    changed = setField(cc.rmax, level);
+  else if (!strcmp(field, "gmin"))
+    changed = setField(cc.gmin, level);
+  else if (!strcmp(field, "gmax"))
+    changed = setField(cc.gmax, level);
+  else if (!strcmp(field, "bmin"))
+    changed = setField(cc.bmin, level);
+  else if (!strcmp(field, "bmax"))
+    changed = setField(cc.bmax, level);
+  else
+  {
+    return -1;
+  }
+  return ESP_OK;
+}
+
+// Change a detection setting from a control variable. The settings are
+// changed on a copy that is only published when a value really changed,
+// as every new version makes the vision task check its tables.
+static int setConfigVar(const char *variable, int val)
+{
+  DetectConfig config;
+  configBegin(config);
+  bool changed = false;
+  int res = ESP_OK;
+
+  if (!strcmp(variable, "red_level"))
+  {
+    changed = setField(config.red_level, val);
+    Serial.printf("Red level %d\r\n", val);
+  }
+  else if (!strcmp(variable, "green_level"))
+  {
+    changed = setField(config.green_level, val);
+    Serial.printf("Green level %d\r\n", val);
+  }
+  else if (!strcmp(variable, "blue_level"))
+  {
+    changed = setField(config.blue_level, val);
+    Serial.printf("Blue level %d\r\n", val);
+  }
+  else if (!strcmp(variable, "detect_mode"))
+  {
+    changed = setField(config.detect_mode, val);
+    Serial.printf("Detect mode %d\r\n", val);
+  }
+  else if (!strcmp(variable, "dc_refine"))
+  {
+    changed = setField(config.dc_refine, val);
+  }
+  else if (!strcmp(variable, "min_area"))
+  {
+    changed = setField(config.min_area, val);
+  }
+  else if (!strcmp(variable, "morph_open"))
+  {
+    changed = setField(config.morph_open, val);
+  }
+  else if (!strcmp(variable, "dual_core"))
+  {
+    changed = setField(config.dual_core, val);
+  }
+  else if (!strcmp(variable, "pipeline"))
+  {
+    changed = setField(config.pipeline, val);
+  }
+  else if (!strcmp(variable, "track_misses"))
+  {
+    changed = setField(config.track_misses, val);
+  }
+  else if (!strcmp(variable, "stream_boxes"))
+  {
+    changed = setField(config.stream_boxes, val);
+  }
+  else if (!strcmp(variable, "event_epsilon"))
+  {
+    changed = setField(config.event_epsilon, val);
+  }
+  else if (!strcmp(variable, "event_heartbeat"))
+  {
+    changed = setField(config.event_heartbeat, val);
+  }
+  else if (!strncmp(variable, "class", 5))
+  {
+    res = setClassField(config, variable, val, changed);
+  }
+  else
+  {
+    log_i("Unknown command: %s", variable);
+    res = -1;
+  }
+
+  configEnd(config, changed);
+  return res;
+}
+
+// Detect on a camera frame. RGB565 and YUV422 frames are thresholded in
+// place, JPEG frames either by their DC coefficients or by using the BMP
+// conversion of the frame in bmp.
+static bool detectFrame(
+    const DetectConfig &config, camera_fb_t *fb, uint8_t *bmp, size_t bmp_len,
+    int &left, int &top, int &right, int &bottom)
 {
-  // Check for null pointer
-  if (bmpData == NULL)
+  if (config.detect_mode == DETECT_JPEG_DC && fb->format == PIXFORMAT_JPEG)
+  {
+    return detectJpegDC(
+        fb->buf, fb->len,
+        color_lut, config.dc_refine, jpeg_dc_state,
+        left, top, right, bottom);
+  }
+
+  FrameFormat format;
+  bool raw = rawFrameFormat(fb->format, format);
+
+  if (config.detect_mode == DETECT_TRACK)
+  {
+    bool found = raw ? detectTrackRaw(
+                           fb->buf, fb->len, fb->width, fb->height, format,
+                           color_lut, track_state,
+                           left, top, right, bottom)
+                     : detectTrack(
+                           bmp, bmp_len, color_lut, track_state,
+                           left, top, right, bottom);
+    log_i("Track: %d of %d pixels scanned", track_state.scanned, track_state.framePixels);
+    return found;
+  }
+
+  if (config.detect_mode == DETECT_PYRAMID)
+  {
+    return raw ? detectPyramidRaw(
+                     fb->buf, fb->len, fb->width, fb->height, format,
+                     color_lut,
+                     left, top, right, bottom)
+               : detectPyramid(
+                     bmp, bmp_len, color_lut,
+                     left, top, right, bottom);
+  }
+
+  // Mask stage: threshold to 1 bit per pixel and open the mask so single
+  // pixels do not widen the box
+  if (config.morph_open)
+  {
+    bool masked = raw ? thresholdMaskRaw(
+                            fb->buf, fb->len, fb->width, fb->height, format,
+                            color_lut,
+                            frame_mask)
+                      : thresholdMask(
+                            bmp, bmp_len,
+                            color_lut,
+                            frame_mask);
+    if (masked)
+    {
+      maskOpen(frame_mask, scratch_mask);
+      if (config.detect_mode != DETECT_BLOBS)
+      {
+        return maskBounds(frame_mask, left, top, right, bottom);
+      }
+      frame_blob_count = maskBlobs(frame_mask, blobLabeler, frame_blobs, BLOB_MAX_BLOBS, config.min_area);
+      return largestBlob(left, top, right, bottom);
+    }
+  }
+
+  // Two-core split of the full frame and blob scans
+  ImageView view;
+  if (config.dual_core &&
+      (raw ? imageFromFrame(fb->buf, fb->len, fb->width, fb->height, format, view)
+           : imageFromBMP(bmp, bmp_len, view)))
   {
-    return 5; // Null pointer provided
+    if (config.detect_mode == DETECT_BLOBS)
+    {
+      frame_blob_count = detectBlobsSplit(view, color_lut, frame_blobs, BLOB_MAX_BLOBS, config.min_area);
+      return largestBlob(left, top, right, bottom);
+    }
+    return detectSplit(view, color_lut, left, top, right, bottom);
   }
 
-  // Check if we have enough data for the header
-  if (len < 54)
+  if (config.detect_mode == DETECT_BLOBS)
   {
-    return 4; // Insufficient data length
+    if (raw)
+    {
+      frame_blob_count = detectBlobsRaw(
+          fb->buf, fb->len, fb->width, fb->height, format,
+          color_lut,
+          frame_blobs, BLOB_MAX_BLOBS, config.min_area);
+    }
+    else
+    {
+      frame_blob_count = detectBlobs(
+          bmp, bmp_len,
+          color_lut,
+          frame_blobs, BLOB_MAX_BLOBS, config.min_area);
+    }
+    return largestBlob(left, top, right, bottom);
   }
 
-  // Check if we have a valid BMP file (should start with "BM")
-  if (bmpData[0] != 'B' || bmpData[1] != 'M')
+  if (raw)
   {
-    return 1; // Invalid BMP signature
+    return detectRaw(
+        fb->buf, fb->len, fb->width, fb->height, format,
+        color_lut,
+        left, top, right, bottom);
   }
+  return detectLut(
+      bmp, bmp_len, color_lut,
+      left, top, right, bottom);
+}
 
-  // Extract important BMP header information
-  int width = *(int *)&bmpData[18];
-  int height = *(int *)&bmpData[22];
-  if (height < 0)
-    height = height * -1;
-  int bitsPerPixel = *(short *)&bmpData[28];
-  int dataOffset = *(int *)&bmpData[10];
-  // Serial.printf("draw width = %d, height= %d\r\n", width, height);
+// True if the frames get the class pass
+static bool classesEnabled(const DetectConfig &config)
+{
+  for (int c = 0; c < COLOR_MAX_CLASSES; c++)
+  {
+    if (config.classes[c].enabled)
+    {
+      return true;
+    }
+  }
+  return false;
+}
 
-  // Check if the image is 24-bit (3 bytes per pixel)
-  if (bitsPerPixel != 24)
+// Detect all color classes in a frame in one pass. JPEG frames are scanned
+// in their BMP conversion. Returns the bitmask of the classes found.
+static int detectFrameClasses(
+    const DetectConfig &config, camera_fb_t *fb, uint8_t *bmp, size_t bmp_len,
+    Blob *results)
+{
+  if (class_lut == NULL)
   {
-    return 2; // Only 24-bit BMPs are supported
+    return 0;
   }
 
-  // Calculate row padding (rows are padded to multiple of 4 bytes)
-  int rowPadding = (width * 3) % 4;
-  if (rowPadding != 0)
+  ImageView view;
+  FrameFormat format;
+  if (rawFrameFormat(fb->format, format))
   {
-    rowPadding = 4 - rowPadding;
+    if (config.dual_core && imageFromFrame(fb->buf, fb->len, fb->width, fb->height, format, view))
+    {
+      return detectClassesSplit(view, *class_lut, results);
+    }
+    return detectClassesRaw(
+        fb->buf, fb->len, fb->width, fb->height, format,
+        *class_lut,
+        results);
   }
 
-  // Make sure the rectangle coordinates are valid
-  if (left > right)
+  if (bmp == NULL)
   {
-    int temp = left;
-    left = right;
-    right = temp;
+    return 0;
   }
+  if (config.dual_core && imageFromBMP(bmp, bmp_len, view))
+  {
+    return detectClassesSplit(view, *class_lut, results);
+  }
+  return detectClasses(
+      bmp, bmp_len,
+      *class_lut,
+      results);
+}
+
+// Measure the levels of the centre of a frame and use them for detection
+static bool calibrateFrame(camera_fb_t *fb, uint8_t *&bmp, size_t &bmp_len)
+{
+  int red_level, green_level, blue_level;
+  bool calibrated;
+  FrameFormat format;
+  if (rawFrameFormat(fb->format, format))
+  {
+    calibrated = getCalibrationRaw(
+        fb->buf, fb->len, fb->width, fb->height, format,
+        red_level, green_level, blue_level);
+  }
+  else
+  {
+    if (bmp == NULL)
+    {
+      bmp = borrowBmp(fb, bmp_len);
+    }
+    calibrated = bmp != NULL && getCalibration(
+                                    bmp, bmp_len,
+                                    red_level, green_level, blue_level);
+  }
+
+  if (calibrated)
+  {
+    // The new levels are used from the next frame on
+    DetectConfig config;
+    configBegin(config);
+    bool changed = setField(config.red_level, red_level);
+    changed |= setField(config.green_level, green_level);
+    changed |= setField(config.blue_level, blue_level);
+    configEnd(config, changed);
+    Serial.printf(
+        "red_level:%d green_level:%d blue_level:%d\r\n",
+        red_level, green_level, blue_level);
+  }
+  else
+  {
+    Serial.println("getCalibration error");
+  }
+  return calibrated;
+}
+
+// Vision tasks. They own the camera: every frame is captured, converted
+// and detected here and the result is published for the handlers and
+// loop(). Handlers that need the pixels of a frame post a request that is
+// served with the next frame, so the detection rate does not depend on the
+// clients.
+//
+// Each stage has its own task and frames are passed on through queues.
+// Normally one frame is in flight at a time. With the pipeline setting up
+// to VISION_PIPELINE_DEPTH frames are, so the capture of a frame overlaps
+// the conversion of the previous one and the detection of the one before
+// that: more frames per second for one frame more latency.
+
+#define VISION_CORE 1  // Detection on the Arduino core, the split worker then runs on core 0
+#define CAPTURE_CORE 0 // Capture and conversion
+#define VISION_PRIORITY 5
+#define VISION_STACK_SIZE 8192
+#define CAPTURE_STACK_SIZE 4096
+#define VISION_TIMEOUT_MS 2000
+#define VISION_HISTORY 8        // Results kept for readers
+#define VISION_PIPELINE_DEPTH 3 // Frames in flight, one per camera frame buffer
+
+// A frame on its way through the stages
+struct FrameJob
+{
+  camera_fb_t *fb;
+  uint8_t *bmp; // From bmp_pool, NULL if not converted
+  size_t bmp_len;
+  int64_t captured; // esp_timer time the frame was handed to the capture stage
+  uint32_t captureUs, convertUs;
+};
+
+static QueueHandle_t convert_queue = NULL;
+static QueueHandle_t detect_queue = NULL;
+static TaskHandle_t capture_task = NULL;
+static std::atomic<int> frames_in_flight(0);
+
+enum VisionRequest
+{
+  VISION_NONE,
+  VISION_BUSY, // Being served by the vision task
+  VISION_JPEG,
+  VISION_BMP,
+  VISION_CALIBRATE
+};
+
+// Reply to a request, buf is owned by the requester afterwards. A BMP is
+// a buffer of bmp_pool, a JPEG is allocated.
+struct VisionReply
+{
+  bool ok;
+  uint8_t *buf;
+  size_t len;
+  struct timeval timestamp;
+  VisionResult result;
+};
+
+// Results of the last frames. Only the vision task writes, readers take
+// copies without locking and never delay the capture.
+static SeqRing<VisionResult, VISION_HISTORY> vision_results;
+
+static portMUX_TYPE vision_mux = portMUX_INITIALIZER_UNLOCKED;
+static volatile int vision_request = VISION_NONE; // Under vision_mux
+static VisionReply vision_reply;
+static SemaphoreHandle_t vision_request_lock = NULL; // One request at a time
+static SemaphoreHandle_t vision_served = NULL;       // Given when a request was served
+
+// Serve a pending request with the current frame. The BMP of the frame is
+// reused when the detection made one.
+static void serveRequest(camera_fb_t *fb, uint8_t *&bmp, size_t &bmp_len, const VisionResult &result)
+{
+  portENTER_CRITICAL(&vision_mux);
+  int request = vision_request;
+  if (request != VISION_NONE)
+  {
+    vision_request = VISION_BUSY;
+  }
+  portEXIT_CRITICAL(&vision_mux);
+  if (request == VISION_NONE)
+  {
+    return;
+  }
+
+  VisionReply &reply = vision_reply;
+  reply.ok = false;
+  reply.buf = NULL;
+  reply.len = 0;
+  reply.timestamp = fb->timestamp;
+  reply.result = result;
+  switch (request)
+  {
+  case VISION_JPEG:
+    if (fb->format == PIXFORMAT_JPEG)
+    {
+      reply.buf = (uint8_t *)malloc(fb->len);
+      if (reply.buf != NULL)
+      {
+        memcpy(reply.buf, fb->buf, fb->len);
+        reply.len = fb->len;
+        reply.ok = true;
+      }
+    }
+    else
+    {
+      reply.ok = frame2jpg(fb, 80, &reply.buf, &reply.len);
+    }
+    break;
+  case VISION_BMP:
+    if (bmp == NULL)
+    {
+      bmp = borrowBmp(fb, bmp_len);
+    }
+    reply.buf = bmp;
+    reply.len = bmp_len;
+    reply.ok = bmp != NULL;
+    bmp = NULL; // Handed over
+    break;
+  case VISION_CALIBRATE:
+    reply.ok = calibrateFrame(fb, bmp, bmp_len);
+    break;
+  }
+
+  portENTER_CRITICAL(&vision_mux);
+  vision_request = VISION_NONE;
+  portEXIT_CRITICAL(&vision_mux);
+  xSemaphoreGive(vision_served);
+}
+
+// Outlines of a result for jpegDrawBoxes(), which counts rows from the top
+static int resultBoxes(const VisionResult &result, int height, JpegBox *boxes)
+{
+  if (!result.found)
+  {
+    return 0;
+  }
+  boxes[0] = {result.left, height - 1 - result.top, result.right, height - 1 - result.bottom};
+  int count = 1;
+  for (int i = 1; i < result.blobCount; i++) // Blob 0 is the box itself
+  {
+    const Blob &b = result.blobs[i];
+    boxes[count++] = {b.left, height - 1 - b.top, b.right, height - 1 - b.bottom};
+  }
+  return count;
+}
 
-  if (top > bottom)
+// Frames of the stream clients, allocated once by broadcastBegin(). A
+// QVGA JPEG stays well below the size, painted blocks grow it by at most
+// half.
+#define STREAM_POOL_COUNT (BROADCAST_MAX_CLIENTS + 2)
+#define STREAM_FRAME_SIZE (32 * 1024)
+
+// JPEG copy of a frame for the stream clients, with the boxes drawn into
+// the JPEG data when stream_boxes is set. Nothing is encoded without
+// clients or when every frame of the pool is still being sent.
+static void broadcastFrame(camera_fb_t *fb, const VisionResult &result)
+{
+  if (broadcastClients() == 0)
+  {
+    return;
+  }
+  SharedFrame *frame = frameAlloc();
+  if (frame == NULL)
+  {
+    return; // The clients are behind, they skip this frame anyway
+  }
+
+  uint8_t *jpg_buf = fb->buf;
+  size_t jpg_len = fb->len;
+  bool converted = fb->format != PIXFORMAT_JPEG;
+  if (converted && !frame2jpg(fb, 80, &jpg_buf, &jpg_len))
+  {
+    log_e("JPEG compression failed");
+    frameRelease(frame);
+    return;
+  }
+
+  JpegBox boxes[BLOB_MAX_BLOBS];
+  int count = frame_config.stream_boxes ? resultBoxes(result, fb->height, boxes) : 0;
+  bool painted = count > 0 && jpegDrawBoxes(jpg_buf, jpg_len, boxes, count, frame->buf, frame->size, frame->len);
+  if (!painted && jpg_len <= frame->size)
+  {
+    memcpy(frame->buf, jpg_buf, jpg_len);
+    frame->len = jpg_len;
+  }
+  if (painted || jpg_len <= frame->size)
+  {
+    frame->frame = result.frame;
+    frame->timestamp = fb->timestamp;
+    frame->width = fb->width;
+    frame->height = fb->height;
+    frame->result = result;
+    broadcastPublish(frame);
+  }
+  else
+  {
+    log_e("Stream frame of %u bytes too large", (unsigned)jpg_len);
+    frameRelease(frame);
+  }
+  if (converted)
+  {
+    free(jpg_buf);
+  }
+}
+
+// Clients that get results pushed: /ws and /events. The vision task only
+// queues a send on the server task, which never waits for a client: one
+// that cannot take a result at once is closed. The clients are only
+// touched on the server task and need no lock.
+
+static volatile int ws_client_count = 0;
+static volatile int sse_client_count = 0;
+static std::atomic<bool> push_pending(false); // A send is queued
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+
+// WebSocket clients of /ws. The result of every frame is pushed as a binary
+// record (visionPack()), or as JSON to clients that connected with
+// /ws?format=json. Every result from the ring that a client has not seen yet
+// is sent.
+
+#define WS_MAX_CLIENTS 4
+
+struct WsClient
+{
+  int fd; // -1 if the slot is free
+  bool json;
+  uint32_t sent; // Last frame sent
+};
+
+#define WS_CLIENT_FREE {-1, false, 0}
+static WsClient ws_clients[WS_MAX_CLIENTS] = {WS_CLIENT_FREE, WS_CLIENT_FREE, WS_CLIENT_FREE, WS_CLIENT_FREE};
+
+static void wsDrop(WsClient &client)
+{
+  client.fd = -1;
+  ws_client_count--;
+}
+
+// The results are pushed on the server task, so a send must not wait for a
+// client whose TCP window is full: that would hold up every handler.
+// httpd_ws_send_frame_async() blocks, so the frame is built here and sent
+// with MSG_DONTWAIT. A frame that does not go out at once leaves the
+// client behind with a partial frame, the caller closes it.
+static bool wsSend(WsClient &client, const VisionResult &result)
+{
+  static uint8_t buf[4 + VISION_JSON_MAX]; // Longest header, then the payload
+  uint8_t *payload = buf + 4;
+  size_t len = client.json ? visionJson(result, (char *)payload) : visionPack(result, payload);
+
+  // Single unmasked frame, the length in the fewest bytes (RFC 6455 5.2)
+  uint8_t *frame = len < 126 ? payload - 2 : payload - 4;
+  frame[0] = 0x80 | (client.json ? HTTPD_WS_TYPE_TEXT : HTTPD_WS_TYPE_BINARY);
+  if (len < 126)
+  {
+    frame[1] = len;
+  }
+  else
+  {
+    frame[1] = 126;
+    frame[2] = len >> 8;
+    frame[3] = len & 0xFF;
+  }
+  int total = payload + len - frame;
+  return httpd_socket_send(camera_httpd, client.fd, (const char *)frame, total, MSG_DONTWAIT) == total;
+}
+
+static void wsSendResults(const VisionResult &latest)
+{
+  VisionResult result;
+  for (int i = 0; i < WS_MAX_CLIENTS; i++)
+  {
+    WsClient &client = ws_clients[i];
+    if (client.fd < 0)
+    {
+      continue;
+    }
+    if (httpd_ws_get_fd_info(camera_httpd, client.fd) != HTTPD_WS_CLIENT_WEBSOCKET)
+    {
+      wsDrop(client); // Closed
+      continue;
+    }
+    uint32_t first = client.sent + 1;
+    if (latest.frame >= VISION_HISTORY && first <= latest.frame - VISION_HISTORY)
+    {
+      first = latest.frame - VISION_HISTORY + 1; // Older results are overwritten
+    }
+    for (uint32_t frame = first; frame <= latest.frame; frame++)
+    {
+      if (!visionResult(frame, result))
+      {
+        continue; // Overwritten while sending
+      }
+      if (!wsSend(client, result))
+      {
+        log_e("WebSocket send failed");
+        httpd_sess_trigger_close(camera_httpd, client.fd);
+        wsDrop(client);
+        break;
+      }
+    }
+    client.sent = latest.frame;
+  }
+}
+
+static esp_err_t ws_handler(httpd_req_t *req)
+{
+  int fd = httpd_req_to_sockfd(req);
+  if (req->method == HTTP_GET)
+  {
+    // Handshake, subscribe the client from the next frame on
+    char query[32];
+    char format[8] = "";
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK)
+    {
+      httpd_query_key_value(query, "format", format, sizeof(format));
+    }
+    WsClient *client = NULL;
+    for (int i = 0; i < WS_MAX_CLIENTS; i++)
+    {
+      if (ws_clients[i].fd == fd)
+      {
+        client = &ws_clients[i]; // Socket of a client that is gone
+        break;
+      }
+      if (ws_clients[i].fd < 0 && client == NULL)
+      {
+        client = &ws_clients[i];
+      }
+    }
+    if (client == NULL)
+    {
+      log_e("Too many WebSocket clients");
+      return ESP_FAIL;
+    }
+    if (client->fd != fd)
+    {
+      ws_client_count++;
+    }
+    VisionResult latest;
+    visionLatest(latest);
+    client->fd = fd;
+    client->json = !strcmp(format, "json");
+    client->sent = latest.frame;
+    return ESP_OK;
+  }
+
+  // The client does not send anything, read and discard what it does send
+  httpd_ws_frame_t frame;
+  uint8_t buf[16];
+  memset(&frame, 0, sizeof(frame));
+  esp_err_t res = httpd_ws_recv_frame(req, &frame, 0);
+  if (res != ESP_OK || frame.len > sizeof(buf))
+  {
+    return ESP_FAIL;
+  }
+  frame.payload = buf;
+  return frame.len ? httpd_ws_recv_frame(req, &frame, frame.len) : ESP_OK;
+}
+
+#endif
+
+// Server-Sent Events clients of /events. Instead of a result per frame a
+// client gets an event when the box moved more than event_epsilon pixels
+// since the last event, when the object appears or disappears, and a
+// heartbeat after event_heartbeat ms without one. The response has no
+// length and the session stays open after the handler, the events are
+// written to the socket on the server task.
+
+#define SSE_MAX_CLIENTS 4
+
+struct SseClient
+{
+  int fd; // -1 if the slot is free
+  bool found;
+  int left, top, right, bottom; // Box of the last event
+  int64_t last;                 // esp_timer time of the last event
+};
+
+#define SSE_CLIENT_FREE {-1, false, 0, 0, 0, 0, 0}
+static SseClient sse_clients[SSE_MAX_CLIENTS] = {SSE_CLIENT_FREE, SSE_CLIENT_FREE, SSE_CLIENT_FREE, SSE_CLIENT_FREE};
+
+// Called by the server when the session ends
+static void sseClosed(void *ctx)
+{
+  SseClient *client = (SseClient *)ctx;
+  client->fd = -1;
+  sse_client_count--;
+}
+
+static bool sseSend(SseClient &client, const char *event, const VisionResult &result)
+{
+  static char buf[VISION_JSON_MAX + 64];
+  int len = sprintf(buf, "event: %s\nid: %u\ndata: ", event, result.frame);
+  len += visionJson(result, buf + len);
+  len += sprintf(buf + len, "\n\n");
+
+  client.found = result.found;
+  client.left = result.left;
+  client.top = result.top;
+  client.right = result.right;
+  client.bottom = result.bottom;
+  client.last = esp_timer_get_time();
+  // Not waiting for a full TCP window, as in wsSend(). A short write is
+  // treated as a dead client and closed by the caller.
+  return httpd_socket_send(camera_httpd, client.fd, buf, len, MSG_DONTWAIT) == len;
+}
+
+static void sseSendResults(const VisionResult &result)
+{
+  DetectConfig config;
+  configLatest(config);
+  int64_t now = esp_timer_get_time();
+  for (int i = 0; i < SSE_MAX_CLIENTS; i++)
+  {
+    SseClient &client = sse_clients[i];
+    if (client.fd < 0)
+    {
+      continue;
+    }
+
+    const char *event = NULL;
+    if (result.found != client.found)
+    {
+      event = result.found ? "appear" : "disappear";
+    }
+    else if (result.found &&
+             (abs(result.left - client.left) > config.event_epsilon ||
+              abs(result.top - client.top) > config.event_epsilon ||
+              abs(result.right - client.right) > config.event_epsilon ||
+              abs(result.bottom - client.bottom) > config.event_epsilon))
+    {
+      event = "move";
+    }
+    else if (now - client.last >= (int64_t)config.event_heartbeat * 1000)
+    {
+      event = "heartbeat";
+    }
+    if (event != NULL && !sseSend(client, event, result))
+    {
+      log_e("Event send failed");
+      httpd_sess_trigger_close(camera_httpd, client.fd); // sseClosed() frees the slot
+    }
+  }
+}
+
+static esp_err_t events_handler(httpd_req_t *req)
+{
+  SseClient *client = NULL;
+  for (int i = 0; i < SSE_MAX_CLIENTS && client == NULL; i++)
+  {
+    if (sse_clients[i].fd < 0)
+    {
+      client = &sse_clients[i];
+    }
+  }
+  if (client == NULL)
+  {
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    return httpd_resp_send(req, "Too many event clients", HTTPD_RESP_USE_STRLEN);
+  }
+
+  // The response is ended by closing the connection, so it is written
+  // without the chunked encoding of httpd_resp_send_chunk()
+  static const char *header =
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: text/event-stream\r\n"
+      "Cache-Control: no-cache\r\n"
+      "Access-Control-Allow-Origin: *\r\n\r\n";
+  if (httpd_send(req, header, strlen(header)) != (int)strlen(header))
+  {
+    return ESP_FAIL;
+  }
+
+  // Start with the current state
+  VisionResult latest;
+  client->fd = httpd_req_to_sockfd(req);
+  client->found = false;
+  client->last = esp_timer_get_time();
+  if (visionLatest(latest) && !sseSend(*client, latest.found ? "appear" : "disappear", latest))
+  {
+    client->fd = -1;
+    return ESP_FAIL;
+  }
+
+  sse_client_count++;
+  req->sess_ctx = client;
+  req->free_ctx = sseClosed;
+  return ESP_OK;
+}
+
+// Runs on the server task
+static void pushResults(void * /* arg */)
+{
+  push_pending = false;
+  VisionResult latest;
+  if (!visionLatest(latest))
+  {
+    return;
+  }
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+  wsSendResults(latest);
+#endif
+  sseSendResults(latest);
+}
+
+// Called by the vision task for every result
+static void pushNotify()
+{
+  if ((ws_client_count > 0 || sse_client_count > 0) && !push_pending.exchange(true) &&
+      httpd_queue_work(camera_httpd, pushResults, NULL) != ESP_OK)
+  {
+    push_pending = false;
+  }
+}
+
+// A BMP is only made when the detection or the class pass looks at BMP
+// pixels
+static bool needsBmp(const DetectConfig &config, camera_fb_t *fb)
+{
+  FrameFormat format;
+  return !rawFrameFormat(fb->format, format) &&
+         (classesEnabled(config) || !(config.detect_mode == DETECT_JPEG_DC && fb->format == PIXFORMAT_JPEG));
+}
+
+// Capture stage, waits until fewer frames than the depth are in flight
+static void captureTask(void * /* arg */)
+{
+  for (;;)
+  {
+    DetectConfig config;
+    configLatest(config);
+    int depth = config.pipeline ? VISION_PIPELINE_DEPTH : 1;
+    while (frames_in_flight.load() >= depth)
+    {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY); // Given by the detection stage
+    }
+
+    int64_t start = esp_timer_get_time();
+    camera_fb_t *fb = esp_camera_fb_get();
+    if (!fb)
+    {
+      log_e("Camera capture failed");
+      vTaskDelay(pdMS_TO_TICKS(100));
+      continue;
+    }
+
+    FrameJob job;
+    job.fb = fb;
+    job.bmp = NULL;
+    job.bmp_len = 0;
+    job.captured = esp_timer_get_time();
+    job.captureUs = job.captured - start;
+    job.convertUs = 0;
+    frames_in_flight++;
+    xQueueSend(convert_queue, &job, portMAX_DELAY);
+  }
+}
+
+// Conversion stage. The mode is taken from the latest settings, the
+// detection stage converts itself if it changed in between.
+static void convertTask(void * /* arg */)
+{
+  for (;;)
+  {
+    FrameJob job;
+    xQueueReceive(convert_queue, &job, portMAX_DELAY);
+
+    DetectConfig config;
+    configLatest(config);
+    int64_t start = esp_timer_get_time();
+    if (needsBmp(config, job.fb))
+    {
+      job.bmp = borrowBmp(job.fb, job.bmp_len);
+    }
+    job.convertUs = esp_timer_get_time() - start;
+    xQueueSend(detect_queue, &job, portMAX_DELAY);
+  }
+}
+
+// Detection stage
+static void visionTask(void * /* arg */)
+{
+  for (;;)
+  {
+    FrameJob job;
+    xQueueReceive(detect_queue, &job, portMAX_DELAY);
+    camera_fb_t *fb = job.fb;
+
+    applyConfig();
+    const DetectConfig &config = frame_config;
+
+    int64_t start = esp_timer_get_time();
+    if (job.bmp == NULL && needsBmp(config, fb))
+    {
+      job.bmp = borrowBmp(fb, job.bmp_len);
+      int64_t converted = esp_timer_get_time();
+      job.convertUs += converted - start;
+      start = converted;
+    }
+
+    VisionResult result;
+    result.frame = vision_results.count.load(std::memory_order_relaxed) + 1;
+    result.timestamp = (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+    result.found = false;
+    result.blobCount = 0;
+    result.classesFound = 0;
+    memset(result.classes, 0, sizeof(result.classes));
+    result.trackScanned = 0;
+    result.trackPixels = 0;
+
+    if (job.bmp == NULL && needsBmp(config, fb))
+    {
+      log_e("BMP Conversion failed");
+    }
+    else
+    {
+      result.found = detectFrame(
+          config, fb, job.bmp, job.bmp_len,
+          result.left, result.top, result.right, result.bottom);
+      if (config.detect_mode == DETECT_BLOBS)
+      {
+        result.blobCount = frame_blob_count;
+        memcpy(result.blobs, frame_blobs, sizeof(Blob) * frame_blob_count);
+      }
+      if (config.detect_mode == DETECT_TRACK)
+      {
+        result.trackScanned = track_state.scanned;
+        result.trackPixels = track_state.framePixels;
+      }
+      if (classesEnabled(config))
+      {
+        result.classesFound = detectFrameClasses(config, fb, job.bmp, job.bmp_len, result.classes);
+      }
+    }
+    int64_t end = esp_timer_get_time();
+    result.captureUs = job.captureUs;
+    result.convertUs = job.convertUs;
+    result.detectUs = end - start;
+    result.latencyUs = end - job.captured;
+
+    seqRingWrite(vision_results, result);
+    pushNotify();
+    telemetryPublish(result);
+
+    serveRequest(fb, job.bmp, job.bmp_len, result);
+    broadcastFrame(fb, result);
+    poolGive(bmp_pool, job.bmp);
+    esp_camera_fb_return(fb);
+
+    frames_in_flight--;
+    xTaskNotifyGive(capture_task);
+  }
+}
+
+bool startVisionTask()
+{
+  // Everything the handlers share with the vision tasks exists before the
+  // web server takes its first request. The tables are built by the
+  // vision task when it picks up the first version of the settings.
+  configInit();
+  if (!broadcastBegin(STREAM_POOL_COUNT, STREAM_FRAME_SIZE))
+  {
+    return false;
+  }
+  telemetryBegin();
+  const resolution_info_t &largest = resolution[BMP_POOL_FRAMESIZE];
+  if (!poolBegin(bmp_pool, BMP_POOL_COUNT, BMP_HEADER_SIZE + largest.width * largest.height * 3))
+  {
+    return false;
+  }
+  if (!splitBegin())
+  {
+    Serial.println("Dual core detection not available, using one core");
+  }
+
+  vision_request_lock = xSemaphoreCreateMutex();
+  vision_served = xSemaphoreCreateBinary();
+  convert_queue = xQueueCreate(VISION_PIPELINE_DEPTH, sizeof(FrameJob));
+  detect_queue = xQueueCreate(VISION_PIPELINE_DEPTH, sizeof(FrameJob));
+  // The capture task comes first: the detection stage notifies it by its
+  // handle, which is only set once xTaskCreatePinnedToCore() returns
+  if (vision_request_lock == NULL || vision_served == NULL || convert_queue == NULL || detect_queue == NULL ||
+      xTaskCreatePinnedToCore(captureTask, "capture", CAPTURE_STACK_SIZE, NULL, VISION_PRIORITY, &capture_task, CAPTURE_CORE) != pdPASS ||
+      xTaskCreatePinnedToCore(convertTask, "convert", VISION_STACK_SIZE, NULL, VISION_PRIORITY, NULL, CAPTURE_CORE) != pdPASS ||
+      xTaskCreatePinnedToCore(visionTask, "vision", VISION_STACK_SIZE, NULL, VISION_PRIORITY, NULL, VISION_CORE) != pdPASS)
+  {
+    Serial.println("Vision task not started");
+    vision_served = NULL;
+    return false;
+  }
+  return true;
+}
+
+bool visionLatest(VisionResult &result)
+{
+  if (!seqRingLatest(vision_results, result))
+  {
+    result.frame = 0;
+    return false;
+  }
+  return true;
+}
+
+bool visionResult(uint32_t frame, VisionResult &result)
+{
+  return frame != 0 && seqRingRead(vision_results, frame - 1, result);
+}
+
+// Have the vision task serve a request with its next frame. False if no
+// frame arrived in time or the request failed.
+static bool visionRequest(int request, VisionReply &reply)
+{
+  if (vision_served == NULL)
+  {
+    return false;
+  }
+  xSemaphoreTake(vision_request_lock, portMAX_DELAY);
+  portENTER_CRITICAL(&vision_mux);
+  vision_request = request;
+  portEXIT_CRITICAL(&vision_mux);
+
+  bool served = xSemaphoreTake(vision_served, pdMS_TO_TICKS(VISION_TIMEOUT_MS)) == pdTRUE;
+  if (!served)
+  {
+    // Withdraw the request, unless the task is serving it right now
+    portENTER_CRITICAL(&vision_mux);
+    bool pending = vision_request == request;
+    if (pending)
+    {
+      vision_request = VISION_NONE;
+    }
+    portEXIT_CRITICAL(&vision_mux);
+    if (!pending)
+    {
+      xSemaphoreTake(vision_served, portMAX_DELAY);
+      served = true;
+    }
+  }
+  if (served)
   {
-    int temp = top;
-    top = bottom;
-    bottom = temp;
+    reply = vision_reply;
   }
-
-  // Make sure the rectangle fits within the image boundaries
-  if (left < 0 || top < 0 || right >= width || bottom >= height)
+  xSemaphoreGive(vision_request_lock);
+  if (!served)
   {
-    Serial.printf(
-      "left:%d top: %d right:%d width:%d bottom:%d height:%d\r\n",
-      left, top, right, width, bottom, height
-    );
-    return 3; // Rectangle would be outside image boundaries
+    log_e("No camera frame");
   }
+  return served && reply.ok;
+}
+
+// Per class detection results of the latest frame as JSON
+static esp_err_t results_handler(httpd_req_t *req)
+{
+  static char json_response[1024];
 
-  // Make sure we have enough data
-  int expectedSize = dataOffset + (width * 3 + rowPadding) * height;
-  if (len < expectedSize)
+  VisionResult result;
+  if (!visionLatest(result))
   {
-    return 4; // BMP data is truncated
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
   }
 
-  // Calculate width and height of the rectangle
-  int rectWidth = right - left + 1;
-  int rectHeight = bottom - top + 1;
+  DetectConfig config;
+  configLatest(config);
 
-  // Draw the rectangle (only the border)
-  for (int j = 0; j < rectHeight; j++)
+  char *p = json_response;
+  p += sprintf(p, "{\"frame\":%u,\"found\":%d,\"classes\":[", result.frame, result.classesFound);
+  bool first = true;
+  for (int c = 0; c < COLOR_MAX_CLASSES; c++)
   {
-    for (int i = 0; i < rectWidth; i++)
+    if (!config.classes[c].enabled)
     {
-      // Only draw if we're on the border of the rectangle
-      if (j == 0 || j == (rectHeight - 1) || i == 0 || i == (rectWidth - 1))
-      {
-        // Calculate the position in the BMP data
-        // Note: In BMP format, rows are stored bottom to top
-        int row = height - (top + j) - 1;
-        int pos = dataOffset + row * (width * 3 + rowPadding) + (left + i) * 3;
-
-        // Set the BGR values (BMP uses BGR, not RGB)
-        bmpData[pos] = 0;       // Blue component
-        bmpData[pos + 1] = 255; // Green component
-        bmpData[pos + 2] = 0;   // Red component
-      }
+      continue;
     }
+    const Blob &b = result.classes[c];
+    p += sprintf(p, "%s{\"class\":%d,\"area\":%d,", first ? "" : ",", c, b.area);
+    p += sprintf(p, "\"left\":%d,\"top\":%d,\"right\":%d,\"bottom\":%d,", b.left, b.top, b.right, b.bottom);
+    p += sprintf(p, "\"cx\":%d,\"cy\":%d}", b.cx, b.cy);
+    first = false;
   }
+  p += sprintf(p, "]}");
 
-  return 0; // Success
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, json_response, strlen(json_response));
 }
 
-static esp_err_t bmp_handler(httpd_req_t *req);
-
-extern bool getCalibration(
-    uint8_t *buf, int buf_len,
-    int &red_level, int &green_level, int &blue_level);
-
 static esp_err_t calibrate_handler(httpd_req_t *req)
 {
-  camera_fb_t *fb = NULL;
-  esp_err_t res = ESP_OK;
-
-  fb = esp_camera_fb_get();
-  if (!fb)
-  {
-    log_e("Camera capture failed");
-
-    httpd_resp_send_500(req);
-    return ESP_FAIL;
-  }
+  VisionReply reply;
+  visionRequest(VISION_CALIBRATE, reply);
 
-  uint8_t *buf = NULL;
-  size_t buf_len = 0;
-  bool converted = frame2bmp(fb, &buf, &buf_len);
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, NULL, 0);
+}
 
-  if (getCalibration(
-          buf, buf_len,
-          red_level, green_level, blue_level))
+// Draw the boxes of a result into a BMP
+static void drawResult(uint8_t *buf, size_t buf_len, const VisionResult &result)
+{
+  if (!result.found)
   {
-    Serial.printf(
-        "red_level:%d green_level:%d blue_level:%d\r\n",
-        red_level, green_level, blue_level);
+    return;
   }
-  else
+  int draw_error = drawRect(buf, buf_len, result.left, result.top, result.right, result.bottom);
+  if (draw_error != 0)
   {
-    Serial.println("getCalibration error");
+    Serial.printf("drawing error: %d\r\n", draw_error);
   }
-  esp_camera_fb_return(fb);
 
-  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-  return httpd_resp_send(req, NULL, 0);
+  // Also show the smaller blobs
+  for (int i = 1; i < result.blobCount; i++)
+  {
+    const Blob &blob = result.blobs[i];
+    drawRect(buf, buf_len, blob.left, blob.top, blob.right, blob.bottom);
+  }
 }
 
+// Picture of the next frame with the boxes drawn in. A BMP by default,
+// /bmp?format=jpeg sends the same picture as a JPEG of about a twentieth
+// of the size, with an optional &quality=<1..100>.
 static esp_err_t bmp_handler(httpd_req_t *req)
 {
-  camera_fb_t *fb = NULL;
   esp_err_t res = ESP_OK;
 
-  fb = esp_camera_fb_get();
-  if (!fb)
+  bool jpeg = false;
+  int quality = ANNOTATED_JPEG_QUALITY;
+  char query[48];
+  char value[8];
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK)
   {
-    log_e("Camera capture failed");
+    if (httpd_query_key_value(query, "format", value, sizeof(value)) == ESP_OK)
+    {
+      jpeg = !strcmp(value, "jpeg") || !strcmp(value, "jpg");
+    }
+    if (httpd_query_key_value(query, "quality", value, sizeof(value)) == ESP_OK)
+    {
+      quality = std::min(100, std::max(1, atoi(value)));
+    }
+  }
+
+  // BMP of the next frame with the result the vision task found in it
+  VisionReply reply;
+  if (!visionRequest(VISION_BMP, reply))
+  {
+    log_e("BMP Conversion failed");
     httpd_resp_send_500(req);
     return ESP_FAIL;
   }
 
-  httpd_resp_set_type(req, "image/x-windows-bmp");
-  httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.bmp");
+  httpd_resp_set_type(req, jpeg ? "image/jpeg" : "image/x-windows-bmp");
+  httpd_resp_set_hdr(req, "Content-Disposition", jpeg ? "inline; filename=capture.jpg" : "inline; filename=capture.bmp");
   httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
 
   char ts[32];
-  snprintf(ts, 32, "%lld.%06ld", fb->timestamp.tv_sec, fb->timestamp.tv_usec);
+  snprintf(ts, 32, "%lld.%06ld", (long long)reply.timestamp.tv_sec, (long)reply.timestamp.tv_usec);
   httpd_resp_set_hdr(req, "X-Timestamp", (const char *)ts);
 
-  uint8_t *buf = NULL;
-  size_t buf_len = 0;
-  bool converted = frame2bmp(fb, &buf, &buf_len);
+  uint8_t *buf = reply.buf;
+  size_t buf_len = reply.len;
+  const VisionResult &result = reply.result;
 
-  int left, top, right, bottom;
+  // Draw a rectangle around the detected area
+  drawResult(buf, buf_len, result);
 
-  // Detect largest area adhering to the color values and draw rectangle if found
-  if (detect(
-          buf, buf_len,
-          red_level, green_level, blue_level,
-          left, top, right, bottom))
+  size_t sent = buf_len;
+  if (jpeg)
   {
-    int draw_error = drawRect(buf, buf_len, left, top, right, bottom);
-    if (draw_error != 0)
+    // Encode the BGR pixels of the top-down BMP straight into the response
+    ImageView view;
+    jpg_chunking_t jchunk = {req, 0};
+    if (!imageFromBMP(buf, buf_len, view) || view.bottomUp || view.stride != view.width * 3 ||
+        !fmt2jpg_cb((uint8_t *)view.pixels, view.stride * view.height, view.width, view.height,
+                    PIXFORMAT_RGB888, quality, jpg_encode_stream, &jchunk))
+    {
+      log_e("JPEG compression failed");
+      res = ESP_FAIL;
+    }
+    else
     {
-      Serial.printf("drawing error: %d\r\n", draw_error);
+      res = httpd_resp_send_chunk(req, NULL, 0);
     }
+    sent = jchunk.len;
   }
-
-  esp_camera_fb_return(fb);
-  if (!converted)
+  else
   {
-    log_e("BMP Conversion failed");
-    httpd_resp_send_500(req);
-    return ESP_FAIL;
+    res = httpd_resp_send(req, (const char *)buf, buf_len);
   }
-  res = httpd_resp_send(req, (const char *)buf, buf_len);
-  free(buf);
+  poolGive(bmp_pool, buf);
 
-  log_i("BMP: %llums, %uB", (uint64_t)((fr_end - fr_start) / 1000), buf_len);
+  log_i("%s: %uus detect, %uB", jpeg ? "JPEG" : "BMP", result.detectUs, (unsigned)sent);
   return res;
 }
 
-static size_t jpg_encode_stream(void *arg, size_t index, const void *data, size_t len)
-{
-  jpg_chunking_t *j = (jpg_chunking_t *)arg;
-  if (!index)
-  {
-    j->len = 0;
-  }
-  if (httpd_resp_send_chunk(j->req, (const char *)data, len) != ESP_OK)
-  {
-    return 0;
-  }
-  j->len += len;
-  return len;
-}
-
 // BMP header structure
 typedef struct
 {
@@ -332,12 +1634,10 @@ typedef struct
 
 static esp_err_t capture_handler(httpd_req_t *req)
 {
-  camera_fb_t *fb = NULL;
   esp_err_t res = ESP_OK;
 
-  fb = esp_camera_fb_get();
-
-  if (!fb)
+  VisionReply reply;
+  if (!visionRequest(VISION_JPEG, reply))
   {
     log_e("Camera capture failed");
     httpd_resp_send_500(req);
@@ -350,269 +1650,213 @@ static esp_err_t capture_handler(httpd_req_t *req)
 
   // Timestamp
   char ts[32];
-  snprintf(ts, 32, "%lld.%06ld", fb->timestamp.tv_sec, fb->timestamp.tv_usec);
+  snprintf(ts, 32, "%lld.%06ld", (long long)reply.timestamp.tv_sec, (long)reply.timestamp.tv_usec);
   httpd_resp_set_hdr(req, "X-Timestamp", (const char *)ts);
 
-  static uint8_t *bmpBuffer = NULL;
-  static size_t bmpLen;
+  res = httpd_resp_send(req, (const char *)reply.buf, reply.len);
+  free(reply.buf);
+  return res;
+}
 
-  if (fb->format == PIXFORMAT_JPEG)
-  {
-    frame2bmp(fb, &bmpBuffer, &bmpLen);
+// Stream clients. The stream server runs all its handlers on one task, so
+// stream_handler only starts the response and hands the socket to a task of
+// its own that sends the frames of the broadcaster. Every client then gets
+// every frame it can keep up with, however many are connected.
 
-    BMPHeader header;
+#define STREAM_STACK_SIZE 4096
+#define STREAM_PRIORITY 4   // Below the vision tasks
+#define STREAM_WAIT_MS 1000 // Checks for a closed session while no frames arrive
+#define STREAM_PART_SIZE 768 // Part headers with a line per blob
 
-    res = httpd_resp_send(req, (const char *)fb->buf, fb->len);
+struct StreamClient
+{
+  std::atomic<int> refs; // Held by the session and by the task
+  bool closed;           // Set when the server closed the session, under lock
+  SemaphoreHandle_t lock;
+  httpd_handle_t hd;
+  int fd;
+};
+
+static void streamClientRelease(StreamClient *client)
+{
+  if (client->refs.fetch_sub(1) == 1)
+  {
+    vSemaphoreDelete(client->lock);
+    delete client;
   }
-  else
+}
+
+// Called by the server when the session ends. The lock makes the task
+// finish the send in progress, so it never writes to a reused socket.
+static void streamClientClosed(void *ctx)
+{
+  StreamClient *client = (StreamClient *)ctx;
+  xSemaphoreTake(client->lock, portMAX_DELAY);
+  client->closed = true;
+  xSemaphoreGive(client->lock);
+  streamClientRelease(client);
+}
+
+static bool streamSendAll(int fd, const char *data, size_t len)
+{
+  while (len > 0)
   {
-    // Convert to jpg and return
-    jpg_chunking_t jchunk = {req, 0};
-    res = frame2jpg_cb(fb, 80, jpg_encode_stream, &jchunk) ? ESP_OK : ESP_FAIL;
-    httpd_resp_send_chunk(req, NULL, 0);
+    int sent = send(fd, data, len, 0); // Times out after the send_wait_timeout of the server
+    if (sent <= 0)
+    {
+      return false;
+    }
+    data += sent;
+    len -= sent;
   }
-  esp_camera_fb_return(fb);
-  return res;
+  return true;
 }
 
-static esp_err_t stream_handler(httpd_req_t *req)
+// Send data as one chunk of the chunked response started by stream_handler
+static bool streamChunk(int fd, const char *data, size_t len)
 {
-  camera_fb_t *fb = NULL;
-  struct timeval _timestamp;
-  esp_err_t res = ESP_OK;
-  size_t _jpg_buf_len = 0;
-  uint8_t *_jpg_buf = NULL;
-  char *part_buf[128];
+  char size[12];
+  int n = snprintf(size, sizeof(size), "%x\r\n", (unsigned)len);
+  return streamSendAll(fd, size, n) && streamSendAll(fd, data, len) && streamSendAll(fd, "\r\n", 2);
+}
 
-  static int64_t last_frame = 0;
-  if (!last_frame)
+// Part headers with the detection result of the frame. Boxes use the
+// coordinates of detect(), with y counted from the bottom row. 0 if they
+// do not fit into size bytes.
+static size_t streamPartHeader(char *buf, size_t size, const SharedFrame *frame)
+{
+  const VisionResult &result = frame->result;
+  size_t len = 0;
+  appendf(buf, size, len, _STREAM_PART_HEAD, (unsigned)frame->len, (int)frame->timestamp.tv_sec,
+          (int)frame->timestamp.tv_usec);
+  appendf(buf, size, len, "X-Frame: %u\r\n", frame->frame);
+  appendf(buf, size, len, "X-Frame-Size: %dx%d\r\n", frame->width, frame->height);
+  if (result.found)
+  {
+    appendf(buf, size, len, "X-Object-Box: %d,%d,%d,%d\r\n", result.left, result.top, result.right, result.bottom);
+  }
+  for (int i = 0; i < result.blobCount; i++)
   {
-    last_frame = esp_timer_get_time();
+    const Blob &b = result.blobs[i];
+    appendf(buf, size, len, "X-Object-Blob: %d,%d,%d,%d,%d,%d,%d\r\n", b.left, b.top, b.right, b.bottom, b.area, b.cx,
+            b.cy);
   }
+  return appendf(buf, size, len, "X-Detect-Us: %u\r\n\r\n", result.detectUs) ? len : 0;
+}
 
-  res = httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
-  if (res != ESP_OK)
+static bool streamSendFrame(StreamClient *client, const SharedFrame *frame)
+{
+  char part_buf[STREAM_PART_SIZE];
+  size_t hlen = streamPartHeader(part_buf, sizeof(part_buf), frame);
+  if (hlen == 0)
   {
-    return res;
+    log_e("Stream part header too long");
+    return false;
   }
 
-  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-  httpd_resp_set_hdr(req, "X-Framerate", "60");
+  xSemaphoreTake(client->lock, portMAX_DELAY);
+  bool ok = !client->closed &&
+            streamChunk(client->fd, part_buf, hlen) &&
+            streamChunk(client->fd, (const char *)frame->buf, frame->len) &&
+            streamChunk(client->fd, _STREAM_BOUNDARY, strlen(_STREAM_BOUNDARY));
+  xSemaphoreGive(client->lock);
+  return ok;
+}
 
-  while (true)
+static void streamTask(void *arg)
+{
+  StreamClient *client = (StreamClient *)arg;
+  int slot = broadcastSubscribe();
+  if (slot < 0)
   {
-    fb = esp_camera_fb_get();
-    if (!fb)
-    {
-      log_e("Camera capture failed");
-      res = ESP_FAIL;
-    }
-    else
+    log_e("Too many stream clients");
+  }
+
+  uint32_t sent = 0;
+  int64_t last_frame = esp_timer_get_time();
+  while (slot >= 0)
+  {
+    SharedFrame *frame = broadcastNext(sent, pdMS_TO_TICKS(STREAM_WAIT_MS));
+    if (frame == NULL)
     {
-      _timestamp.tv_sec = fb->timestamp.tv_sec;
-      _timestamp.tv_usec = fb->timestamp.tv_usec;
-      if (fb->format != PIXFORMAT_JPEG)
-      {
-        bool jpeg_converted = frame2jpg(fb, 80, &_jpg_buf, &_jpg_buf_len);
-        esp_camera_fb_return(fb);
-        fb = NULL;
-        if (!jpeg_converted)
-        {
-          log_e("JPEG compression failed");
-          res = ESP_FAIL;
-        }
-      }
-      else
+      xSemaphoreTake(client->lock, portMAX_DELAY);
+      bool closed = client->closed;
+      xSemaphoreGive(client->lock);
+      if (closed)
       {
-        _jpg_buf_len = fb->len;
-        _jpg_buf = fb->buf;
+        break;
       }
-#if CONFIG_ESP_FACE_DETECT_ENABLED
+      continue;
     }
-    else
-    {
-      if (fb->format == PIXFORMAT_RGB565
-#if CONFIG_ESP_FACE_RECOGNITION_ENABLED
-          && !recognition_enabled
-#endif
-      )
-      {
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-        fr_ready = esp_timer_get_time();
-#endif
-#if TWO_STAGE
-        std::list<dl::detect::result_t> &candidates = s1.infer((uint16_t *)fb->buf, {(int)fb->height, (int)fb->width, 3});
-        std::list<dl::detect::result_t> &results = s2.infer((uint16_t *)fb->buf, {(int)fb->height, (int)fb->width, 3}, candidates);
-#else
-        std::list<dl::detect::result_t> &results = s1.infer((uint16_t *)fb->buf, {(int)fb->height, (int)fb->width, 3});
-#endif
-#if CONFIG_ESP_FACE_DETECT_ENABLED && ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-        fr_face = esp_timer_get_time();
-        fr_recognize = fr_face;
-#endif
-        if (results.size() > 0)
-        {
-          fb_data_t rfb;
-          rfb.width = fb->width;
-          rfb.height = fb->height;
-          rfb.data = fb->buf;
-          rfb.bytes_per_pixel = 2;
-          rfb.format = FB_RGB565;
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-          detected = true;
-#endif
-          draw_face_boxes(&rfb, &results, face_id);
-        }
-        s = fmt2jpg(fb->buf, fb->len, fb->width, fb->height, PIXFORMAT_RGB565, 80, &_jpg_buf, &_jpg_buf_len);
-        esp_camera_fb_return(fb);
-        fb = NULL;
-        if (!s)
-        {
-          log_e("fmt2jpg failed");
-          res = ESP_FAIL;
-        }
-#if CONFIG_ESP_FACE_DETECT_ENABLED && ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-        fr_encode = esp_timer_get_time();
-#endif
-      }
-      else
-      {
-        out_len = fb->width * fb->height * 3;
-        out_width = fb->width;
-        out_height = fb->height;
-        out_buf = (uint8_t *)malloc(out_len);
-        if (!out_buf)
-        {
-          log_e("out_buf malloc failed");
-          res = ESP_FAIL;
-        }
-        else
-        {
-          s = fmt2rgb888(fb->buf, fb->len, fb->format, out_buf);
-          esp_camera_fb_return(fb);
-          fb = NULL;
-          if (!s)
-          {
-            free(out_buf);
-            log_e("To rgb888 failed");
-            res = ESP_FAIL;
-          }
-          else
-          {
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-            fr_ready = esp_timer_get_time();
-#endif
 
-            fb_data_t rfb;
-            rfb.width = out_width;
-            rfb.height = out_height;
-            rfb.data = out_buf;
-            rfb.bytes_per_pixel = 3;
-            rfb.format = FB_BGR888;
-
-#if TWO_STAGE
-            std::list<dl::detect::result_t> &candidates = s1.infer((uint8_t *)out_buf, {(int)out_height, (int)out_width, 3});
-            std::list<dl::detect::result_t> &results = s2.infer((uint8_t *)out_buf, {(int)out_height, (int)out_width, 3}, candidates);
-#else
-            std::list<dl::detect::result_t> &results = s1.infer((uint8_t *)out_buf, {(int)out_height, (int)out_width, 3});
-#endif
-
-#if CONFIG_ESP_FACE_DETECT_ENABLED && ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-            fr_face = esp_timer_get_time();
-            fr_recognize = fr_face;
-#endif
-
-            if (results.size() > 0)
-            {
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-              detected = true;
-#endif
-#if CONFIG_ESP_FACE_RECOGNITION_ENABLED
-              if (recognition_enabled)
-              {
-                face_id = run_face_recognition(&rfb, &results);
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-                fr_recognize = esp_timer_get_time();
-#endif
-              }
-#endif
-              draw_face_boxes(&rfb, &results, face_id);
-            }
-            s = fmt2jpg(out_buf, out_len, out_width, out_height, PIXFORMAT_RGB888, 90, &_jpg_buf, &_jpg_buf_len);
-            free(out_buf);
-            if (!s)
-            {
-              log_e("fmt2jpg failed");
-              res = ESP_FAIL;
-            }
-#if CONFIG_ESP_FACE_DETECT_ENABLED && ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-            fr_encode = esp_timer_get_time();
-#endif
-          }
-        }
-      }
+    bool ok = streamSendFrame(client, frame);
+    sent = frame->frame;
+    size_t len = frame->len;
+    frameRelease(frame);
+    if (!ok)
+    {
+      log_e("Send frame failed");
+      break;
     }
-#endif
-  }
-  if (res == ESP_OK)
-  {
-    res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY, strlen(_STREAM_BOUNDARY));
+
+    int64_t fr_end = esp_timer_get_time();
+    uint32_t frame_time = (fr_end - last_frame) / 1000;
+    last_frame = fr_end;
+    log_i("MJPG: %uB %ums (%.1ffps), frame %u", (unsigned)len, frame_time, 1000.0 / frame_time, sent);
   }
-  if (res == ESP_OK)
+
+  broadcastUnsubscribe(slot);
+  xSemaphoreTake(client->lock, portMAX_DELAY);
+  if (!client->closed)
   {
-    size_t hlen = snprintf((char *)part_buf, 128, _STREAM_PART, _jpg_buf_len, _timestamp.tv_sec, _timestamp.tv_usec);
-    res = httpd_resp_send_chunk(req, (const char *)part_buf, hlen);
+    httpd_sess_trigger_close(client->hd, client->fd);
   }
-  if (res == ESP_OK)
+  xSemaphoreGive(client->lock);
+  streamClientRelease(client);
+  vTaskDelete(NULL);
+}
+
+static esp_err_t stream_handler(httpd_req_t *req)
+{
+  if (broadcastClients() >= BROADCAST_MAX_CLIENTS)
   {
-    res = httpd_resp_send_chunk(req, (const char *)_jpg_buf, _jpg_buf_len);
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    return httpd_resp_send(req, "Too many stream clients", HTTPD_RESP_USE_STRLEN);
   }
-  if (fb)
+
+  StreamClient *client = new (std::nothrow) StreamClient;
+  if (client == NULL || (client->lock = xSemaphoreCreateMutex()) == NULL)
   {
-    esp_camera_fb_return(fb);
-    fb = NULL;
-    _jpg_buf = NULL;
+    delete client;
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
   }
-  else if (_jpg_buf)
+  client->refs.store(2);
+  client->closed = false;
+  client->hd = req->handle;
+  client->fd = httpd_req_to_sockfd(req);
+
+  esp_err_t res = httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
+  if (res == ESP_OK)
   {
-    free(_jpg_buf);
-    _jpg_buf = NULL;
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    httpd_resp_set_hdr(req, "X-Framerate", "60");
+    // Sends the response headers, the parts follow from the task
+    res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY, strlen(_STREAM_BOUNDARY));
   }
-  if (res != ESP_OK)
+  if (res != ESP_OK ||
+      xTaskCreate(streamTask, "stream", STREAM_STACK_SIZE, client, STREAM_PRIORITY, NULL) != pdPASS)
   {
-    log_e("Send frame failed");
-    break;
+    log_e("Stream not started");
+    vSemaphoreDelete(client->lock);
+    delete client;
+    return ESP_FAIL;
   }
-  int64_t fr_end = esp_timer_get_time();
-
-#if CONFIG_ESP_FACE_DETECT_ENABLED && ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-  int64_t ready_time = (fr_ready - fr_start) / 1000;
-  int64_t face_time = (fr_face - fr_ready) / 1000;
-  int64_t recognize_time = (fr_recognize - fr_face) / 1000;
-  int64_t encode_time = (fr_encode - fr_recognize) / 1000;
-  int64_t process_time = (fr_encode - fr_start) / 1000;
-#endif
-
-  int64_t frame_time = fr_end - last_frame;
-  frame_time /= 1000;
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-  uint32_t avg_frame_time = ra_filter_run(&ra_filter, frame_time);
-#endif
-  log_i(
-      "MJPG: %uB %ums (%.1ffps), AVG: %ums (%.1ffps)"
-#if CONFIG_ESP_FACE_DETECT_ENABLED
-      ", %u+%u+%u+%u=%u %s%d"
-#endif
-      ,
-      (uint32_t)(_jpg_buf_len), (uint32_t)frame_time, 1000.0 / (uint32_t)frame_time, avg_frame_time, 1000.0 / avg_frame_time
-#if CONFIG_ESP_FACE_DETECT_ENABLED
-      ,
-      (uint32_t)ready_time, (uint32_t)face_time, (uint32_t)recognize_time, (uint32_t)encode_time, (uint32_t)process_time, (detected) ? "DETECTED " : "", face_id
-#endif
-  );
-}
 
-return res;
+  // The session keeps its socket open after the handler returns
+  req->sess_ctx = client;
+  req->free_ctx = streamClientClosed;
+  return ESP_OK;
 }
 
 static esp_err_t parse_get(httpd_req_t *req, char **obuf)
@@ -665,6 +1909,11 @@ static esp_err_t cmd_handler(httpd_req_t *req)
 
   if (!strcmp(variable, "framesize"))
   {
+    if (val > BMP_POOL_FRAMESIZE)
+    {
+      log_w("Frame size %d does not fit the BMP buffers, using %d", val, BMP_POOL_FRAMESIZE);
+      val = BMP_POOL_FRAMESIZE;
+    }
     if (s->pixformat == PIXFORMAT_JPEG)
     {
       res = s->set_framesize(s, (framesize_t)val);
@@ -768,29 +2017,9 @@ static esp_err_t cmd_handler(httpd_req_t *req)
     Serial.printf("Led=%d\r\n", level);
     ledcWrite(0, level);
   }
-  else if (!strcmp(variable, "red_level"))
-  {
-    red_level = val;
-    Serial.printf("Red level %d\r\n", val);
-    res = ESP_OK;
-  }
-  else if (!strcmp(variable, "green_level"))
-  {
-    green_level = val;
-    Serial.printf("Green level %d\r\n", val);
-    res = ESP_OK;
-  }
-  else if (!strcmp(variable, "blue_level"))
-  {
-    blue_level = val;
-    Serial.printf("Blue level %d\r\n", val);
-    res = ESP_OK;
-  }
-
   else
   {
-    log_i("Unknown command: %s", variable);
-    res = -1;
+    res = setConfigVar(variable, val);
   }
 
   if (res < 0)
@@ -802,95 +2031,151 @@ static esp_err_t cmd_handler(httpd_req_t *req)
   return httpd_resp_send(req, NULL, 0);
 }
 
-static int print_reg(char *p, sensor_t *s, uint16_t reg, uint32_t mask)
+static void print_reg(char *buf, size_t size, size_t &len, sensor_t *s, uint16_t reg, uint32_t mask)
 {
-  return sprintf(p, "\"0x%x\":%u,", reg, s->get_reg(s, reg, mask));
+  appendf(buf, size, len, "\"0x%x\":%u,", reg, s->get_reg(s, reg, mask));
 }
 
 static esp_err_t status_handler(httpd_req_t *req)
 {
-  static char json_response[1024];
+  static char json_response[4096];
 
   sensor_t *s = esp_camera_sensor_get();
-  char *p = json_response;
-  *p++ = '{';
+  size_t size = sizeof(json_response);
+  size_t len = 0;
+  appendf(json_response, size, len, "{");
 
   if (s->id.PID == OV5640_PID || s->id.PID == OV3660_PID)
   {
     for (int reg = 0x3400; reg < 0x3406; reg += 2)
     {
-      p += print_reg(p, s, reg, 0xFFF); // 12 bit
+      print_reg(json_response, size, len, s, reg, 0xFFF); // 12 bit
     }
-    p += print_reg(p, s, 0x3406, 0xFF);
+    print_reg(json_response, size, len, s, 0x3406, 0xFF);
 
-    p += print_reg(p, s, 0x3500, 0xFFFF0); // 16 bit
-    p += print_reg(p, s, 0x3503, 0xFF);
-    p += print_reg(p, s, 0x350a, 0x3FF);  // 10 bit
-    p += print_reg(p, s, 0x350c, 0xFFFF); // 16 bit
+    print_reg(json_response, size, len, s, 0x3500, 0xFFFF0); // 16 bit
+    print_reg(json_response, size, len, s, 0x3503, 0xFF);
+    print_reg(json_response, size, len, s, 0x350a, 0x3FF);  // 10 bit
+    print_reg(json_response, size, len, s, 0x350c, 0xFFFF); // 16 bit
 
     for (int reg = 0x5480; reg <= 0x5490; reg++)
     {
-      p += print_reg(p, s, reg, 0xFF);
+      print_reg(json_response, size, len, s, reg, 0xFF);
     }
 
     for (int reg = 0x5380; reg <= 0x538b; reg++)
     {
-      p += print_reg(p, s, reg, 0xFF);
+      print_reg(json_response, size, len, s, reg, 0xFF);
     }
 
     for (int reg = 0x5580; reg < 0x558a; reg++)
     {
-      p += print_reg(p, s, reg, 0xFF);
+      print_reg(json_response, size, len, s, reg, 0xFF);
     }
-    p += print_reg(p, s, 0x558a, 0x1FF); // 9 bit
+    print_reg(json_response, size, len, s, 0x558a, 0x1FF); // 9 bit
   }
   else if (s->id.PID == OV2640_PID)
   {
-    p += print_reg(p, s, 0xd3, 0xFF);
-    p += print_reg(p, s, 0x111, 0xFF);
-    p += print_reg(p, s, 0x132, 0xFF);
-  }
-
-  p += sprintf(p, "\"xclk\":%u,", s->xclk_freq_hz / 1000000);
-  p += sprintf(p, "\"pixformat\":%u,", s->pixformat);
-  p += sprintf(p, "\"framesize\":%u,", s->status.framesize);
-  p += sprintf(p, "\"quality\":%u,", s->status.quality);
-  p += sprintf(p, "\"brightness\":%d,", s->status.brightness);
-  p += sprintf(p, "\"contrast\":%d,", s->status.contrast);
-  p += sprintf(p, "\"saturation\":%d,", s->status.saturation);
-  p += sprintf(p, "\"sharpness\":%d,", s->status.sharpness);
-  p += sprintf(p, "\"special_effect\":%u,", s->status.special_effect);
-  p += sprintf(p, "\"wb_mode\":%u,", s->status.wb_mode);
-  p += sprintf(p, "\"awb\":%u,", s->status.awb);
-  p += sprintf(p, "\"awb_gain\":%u,", s->status.awb_gain);
-  p += sprintf(p, "\"aec\":%u,", s->status.aec);
-  p += sprintf(p, "\"aec2\":%u,", s->status.aec2);
-  p += sprintf(p, "\"ae_level\":%d,", s->status.ae_level);
-  p += sprintf(p, "\"aec_value\":%u,", s->status.aec_value);
-  p += sprintf(p, "\"agc\":%u,", s->status.agc);
-  p += sprintf(p, "\"agc_gain\":%u,", s->status.agc_gain);
-  p += sprintf(p, "\"gainceiling\":%u,", s->status.gainceiling);
-  p += sprintf(p, "\"bpc\":%u,", s->status.bpc);
-  p += sprintf(p, "\"wpc\":%u,", s->status.wpc);
-  p += sprintf(p, "\"raw_gma\":%u,", s->status.raw_gma);
-  p += sprintf(p, "\"lenc\":%u,", s->status.lenc);
-  p += sprintf(p, "\"hmirror\":%u,", s->status.hmirror);
-  p += sprintf(p, "\"dcw\":%u,", s->status.dcw);
-  p += sprintf(p, "\"colorbar\":%u,", s->status.colorbar);
-  p += sprintf(p, "\"red_level\":%u,", red_level);
-  p += sprintf(p, "\"green_level\":%u,", green_level);
-  p += sprintf(p, "\"blue_level\":%u", blue_level);
+    print_reg(json_response, size, len, s, 0xd3, 0xFF);
+    print_reg(json_response, size, len, s, 0x111, 0xFF);
+    print_reg(json_response, size, len, s, 0x132, 0xFF);
+  }
+
+  appendf(json_response, size, len, "\"xclk\":%u,", s->xclk_freq_hz / 1000000);
+  appendf(json_response, size, len, "\"pixformat\":%u,", s->pixformat);
+  appendf(json_response, size, len, "\"framesize\":%u,", s->status.framesize);
+  appendf(json_response, size, len, "\"quality\":%u,", s->status.quality);
+  appendf(json_response, size, len, "\"brightness\":%d,", s->status.brightness);
+  appendf(json_response, size, len, "\"contrast\":%d,", s->status.contrast);
+  appendf(json_response, size, len, "\"saturation\":%d,", s->status.saturation);
+  appendf(json_response, size, len, "\"sharpness\":%d,", s->status.sharpness);
+  appendf(json_response, size, len, "\"special_effect\":%u,", s->status.special_effect);
+  appendf(json_response, size, len, "\"wb_mode\":%u,", s->status.wb_mode);
+  appendf(json_response, size, len, "\"awb\":%u,", s->status.awb);
+  appendf(json_response, size, len, "\"awb_gain\":%u,", s->status.awb_gain);
+  appendf(json_response, size, len, "\"aec\":%u,", s->status.aec);
+  appendf(json_response, size, len, "\"aec2\":%u,", s->status.aec2);
+  appendf(json_response, size, len, "\"ae_level\":%d,", s->status.ae_level);
+  appendf(json_response, size, len, "\"aec_value\":%u,", s->status.aec_value);
+  appendf(json_response, size, len, "\"agc\":%u,", s->status.agc);
+  appendf(json_response, size, len, "\"agc_gain\":%u,", s->status.agc_gain);
+  appendf(json_response, size, len, "\"gainceiling\":%u,", s->status.gainceiling);
+  appendf(json_response, size, len, "\"bpc\":%u,", s->status.bpc);
+  appendf(json_response, size, len, "\"wpc\":%u,", s->status.wpc);
+  appendf(json_response, size, len, "\"raw_gma\":%u,", s->status.raw_gma);
+  appendf(json_response, size, len, "\"lenc\":%u,", s->status.lenc);
+  appendf(json_response, size, len, "\"hmirror\":%u,", s->status.hmirror);
+  appendf(json_response, size, len, "\"dcw\":%u,", s->status.dcw);
+  appendf(json_response, size, len, "\"colorbar\":%u,", s->status.colorbar);
+  DetectConfig config;
+  configLatest(config);
+  VisionResult result, older;
+  visionLatest(result);
+  appendf(json_response, size, len, "\"config_version\":%u,", config.version);
+  appendf(json_response, size, len, "\"red_level\":%u,", config.red_level);
+  appendf(json_response, size, len, "\"green_level\":%u,", config.green_level);
+  appendf(json_response, size, len, "\"blue_level\":%u,", config.blue_level);
+  appendf(json_response, size, len, "\"detect_mode\":%d,", config.detect_mode);
+  appendf(json_response, size, len, "\"dc_refine\":%u,", config.dc_refine);
+  appendf(json_response, size, len, "\"min_area\":%d,", config.min_area);
+  appendf(json_response, size, len, "\"morph_open\":%u,", config.morph_open);
+  appendf(json_response, size, len, "\"dual_core\":%u,", config.dual_core);
+  appendf(json_response, size, len, "\"pipeline\":%u,", config.pipeline);
+  appendf(json_response, size, len, "\"blobs\":%d,", result.blobCount);
+  appendf(json_response, size, len, "\"track_misses\":%d,", config.track_misses);
+  appendf(json_response, size, len, "\"stream_boxes\":%u,", config.stream_boxes);
+  appendf(json_response, size, len, "\"event_epsilon\":%d,", config.event_epsilon);
+  appendf(json_response, size, len, "\"event_heartbeat\":%d,", config.event_heartbeat);
+  appendf(json_response, size, len, "\"track_scanned\":%d,", result.trackScanned);
+  appendf(json_response, size, len, "\"track_pixels\":%d,", result.trackPixels);
+  for (int c = 0; c < COLOR_MAX_CLASSES; c++)
+  {
+    const ColorClass &cc = config.classes[c];
+    appendf(json_response, size, len, "\"class%d_on\":%u,", c, cc.enabled);
+    appendf(json_response, size, len, "\"class%d_rmin\":%u,\"class%d_rmax\":%u,", c, cc.rmin, c, cc.rmax);
+    appendf(json_response, size, len, "\"class%d_gmin\":%u,\"class%d_gmax\":%u,", c, cc.gmin, c, cc.gmax);
+    appendf(json_response, size, len, "\"class%d_bmin\":%u,\"class%d_bmax\":%u,", c, cc.bmin, c, cc.bmax);
+    appendf(json_response, size, len, "\"class%d_area\":%d,", c, result.classes[c].area);
+  }
+  appendf(json_response, size, len, "\"classes_found\":%d,", result.classesFound);
+  appendf(json_response, size, len, "\"vision_frame\":%u,", result.frame);
+  appendf(json_response, size, len, "\"vision_detect_us\":%u,", result.detectUs);
+  appendf(json_response, size, len, "\"stage_capture_us\":%u,", result.captureUs);
+  appendf(json_response, size, len, "\"stage_convert_us\":%u,", result.convertUs);
+  appendf(json_response, size, len, "\"frame_latency_us\":%u,", result.latencyUs);
+
+  // Frame rate over the results still in the ring
+  float fps = 0;
+  uint32_t span = VISION_HISTORY - 1;
+  if (result.frame > span && visionResult(result.frame - span, older) && result.timestamp > older.timestamp)
+  {
+    fps = span * 1e6f / (result.timestamp - older.timestamp);
+  }
+  appendf(json_response, size, len, "\"vision_fps\":%.1f,", fps);
+  appendf(json_response, size, len, "\"stream_clients\":%d,", broadcastClients());
+  appendf(json_response, size, len, "\"ws_clients\":%d,", ws_client_count);
+  appendf(json_response, size, len, "\"event_clients\":%d,", sse_client_count);
+  char telemetry_host[16];
+  int telemetry_port = telemetryTarget(telemetry_host);
+  appendf(json_response, size, len, "\"telemetry_host\":\"%s\",", telemetry_host);
+  appendf(json_response, size, len, "\"telemetry_port\":%d,", telemetry_port);
+  appendf(json_response, size, len, "\"telemetry_sent\":%u,", telemetrySent());
+  appendf(json_response, size, len, "\"telemetry_errors\":%u,", telemetryErrors());
+  appendf(json_response, size, len, "\"bmp_buffers_free\":%d", poolAvailable(bmp_pool));
 #if CONFIG_LED_ILLUMINATOR_ENABLED
-  p += sprintf(p, ",\"led_intensity\":%u", led_duty);
+  appendf(json_response, size, len, ",\"led_intensity\":%u", led_duty);
 #else
-  p += sprintf(p, ",\"led_intensity\":%d", -1);
+  appendf(json_response, size, len, ",\"led_intensity\":%d", -1);
 #endif
-  *p++ = '}';
-  *p++ = 0;
+  if (!appendf(json_response, size, len, "}"))
+  {
+    log_e("Status reply too long");
+    return httpd_resp_send_500(req);
+  }
   httpd_resp_set_type(req, "application/json");
   httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
   // Serial.printf("JSON: %s\r\n", json_response);
-  return httpd_resp_send(req, json_response, strlen(json_response));
+  return httpd_resp_send(req, json_response, len);
 }
 
 static esp_err_t xclk_handler(httpd_req_t *req)
@@ -924,6 +2209,41 @@ static esp_err_t xclk_handler(httpd_req_t *req)
   return httpd_resp_send(req, NULL, 0);
 }
 
+// Sets the UDP telemetry target: /telemetry?host=<ipv4>&port=<port>,
+// port 0 stops sending
+static esp_err_t telemetry_handler(httpd_req_t *req)
+{
+  char *buf = NULL;
+  char _host[16];
+  char _port[8];
+
+  if (parse_get(req, &buf) != ESP_OK)
+  {
+    return ESP_FAIL;
+  }
+  if (httpd_query_key_value(buf, "host", _host, sizeof(_host)) != ESP_OK)
+  {
+    free(buf);
+    httpd_resp_send_404(req);
+    return ESP_FAIL;
+  }
+  int port = TELEMETRY_DEFAULT_PORT;
+  if (httpd_query_key_value(buf, "port", _port, sizeof(_port)) == ESP_OK)
+  {
+    port = atoi(_port);
+  }
+  free(buf);
+
+  log_i("Telemetry to %s:%d", _host, port);
+  if (port < 0 || port > 65535 || !telemetrySetTarget(_host, port))
+  {
+    return httpd_resp_send_500(req);
+  }
+
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, NULL, 0);
+}
+
 static esp_err_t reg_handler(httpd_req_t *req)
 {
   char *buf = NULL;
@@ -1204,6 +2524,43 @@ void startCameraServer()
 #endif
   };
 
+  httpd_uri_t results_uri = {
+      .uri = "/results",
+      .method = HTTP_GET,
+      .handler = results_handler,
+      .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+      ,
+      .is_websocket = true,
+      .handle_ws_control_frames = false,
+      .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t events_uri = {
+      .uri = "/events",
+      .method = HTTP_GET,
+      .handler = events_handler,
+      .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+      ,
+      .is_websocket = false,
+      .handle_ws_control_frames = false,
+      .supported_subprotocol = NULL
+#endif
+  };
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+  httpd_uri_t ws_uri = {
+      .uri = "/ws",
+      .method = HTTP_GET,
+      .handler = ws_handler,
+      .user_ctx = NULL,
+      .is_websocket = true,
+      .handle_ws_control_frames = false,
+      .supported_subprotocol = NULL};
+#endif
+
   httpd_uri_t xclk_uri = {
       .uri = "/xclk",
       .method = HTTP_GET,
@@ -1217,6 +2574,19 @@ void startCameraServer()
 #endif
   };
 
+  httpd_uri_t telemetry_uri = {
+      .uri = "/telemetry",
+      .method = HTTP_GET,
+      .handler = telemetry_handler,
+      .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+      ,
+      .is_websocket = true,
+      .handle_ws_control_frames = false,
+      .supported_subprotocol = NULL
+#endif
+  };
+
   httpd_uri_t reg_uri = {
       .uri = "/reg",
       .method = HTTP_GET,
@@ -1279,8 +2649,14 @@ void startCameraServer()
     httpd_register_uri_handler(camera_httpd, &capture_uri);
     httpd_register_uri_handler(camera_httpd, &bmp_uri);
     httpd_register_uri_handler(camera_httpd, &calibrate_uri);
+    httpd_register_uri_handler(camera_httpd, &results_uri);
+    httpd_register_uri_handler(camera_httpd, &events_uri);
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    httpd_register_uri_handler(camera_httpd, &ws_uri);
+#endif
 
     httpd_register_uri_handler(camera_httpd, &xclk_uri);
+    httpd_register_uri_handler(camera_httpd, &telemetry_uri);
     httpd_register_uri_handler(camera_httpd, &reg_uri);
     httpd_register_uri_handler(camera_httpd, &greg_uri);
     httpd_register_uri_handler(camera_httpd, &pll_uri);
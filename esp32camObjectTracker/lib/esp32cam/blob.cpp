@@ -0,0 +1,233 @@
+#include <string.h>
+#include <algorithm>
+#include "detect.h"
+
+// Run-length based connected component labeling. Runs of matching pixels
+// are fed in raster order and joined with the overlapping runs of the row
+// above through a union-find table, so every pixel is looked at only once
+// and all storage lives in the BlobLabeler.
+
+// Labeler state is too large for the httpd task stack
+BlobLabeler blobLabeler;
+
+static uint16_t findRoot(BlobLabeler &lab, uint16_t label)
+{
+    while (lab.parent[label] != label)
+    {
+        lab.parent[label] = lab.parent[lab.parent[label]]; // Path halving
+        label = lab.parent[label];
+    }
+    return label;
+}
+
+static uint16_t unite(BlobLabeler &lab, uint16_t a, uint16_t b)
+{
+    a = findRoot(lab, a);
+    b = findRoot(lab, b);
+    if (a < b)
+    {
+        lab.parent[b] = a;
+        return a;
+    }
+    lab.parent[a] = b;
+    return b;
+}
+
+void blobBegin(BlobLabeler &lab, int width, int height)
+{
+    lab.width = width;
+    lab.height = height;
+    lab.row = -2;
+    lab.cur = 0;
+    lab.nruns[0] = lab.nruns[1] = 0;
+    lab.cursor = 0;
+    lab.nlabels = 0;
+    lab.overflow = false;
+    lab.firstRow = -1;
+    lab.nfirst = 0;
+}
+
+void blobRun(BlobLabeler &lab, int y, int x0, int x1)
+{
+    if (y != lab.row)
+    {
+        // Start a new row, the current row becomes the previous one unless
+        // rows without runs were skipped
+        int prev = lab.cur;
+        lab.cur ^= 1;
+        if (y != lab.row + 1)
+        {
+            lab.nruns[prev] = 0;
+        }
+        lab.nruns[lab.cur] = 0;
+        lab.cursor = 0;
+        lab.row = y;
+    }
+
+    const BlobRun *prevRuns = lab.runs[lab.cur ^ 1];
+    int nprev = lab.nruns[lab.cur ^ 1];
+
+    if (lab.nruns[lab.cur] >= BLOB_MAX_RUNS)
+    {
+        lab.overflow = true;
+        return;
+    }
+
+    // Skip the runs of the previous row that end left of this one, they
+    // cannot touch any of the following runs either
+    while (lab.cursor < nprev && prevRuns[lab.cursor].x1 < x0 - 1)
+    {
+        lab.cursor++;
+    }
+
+    // Join with every 8-connected run of the previous row
+    int label = -1;
+    for (int i = lab.cursor; i < nprev && prevRuns[i].x0 <= x1 + 1; i++)
+    {
+        label = label < 0 ? findRoot(lab, prevRuns[i].label) : unite(lab, label, prevRuns[i].label);
+    }
+
+    if (label < 0)
+    {
+        if (lab.nlabels >= BLOB_MAX_LABELS)
+        {
+            lab.overflow = true; // Label table full, the run is dropped
+            return;
+        }
+        label = lab.nlabels++;
+        lab.parent[label] = label;
+        BlobStats &s = lab.stats[label];
+        s.area = 0;
+        s.sumX = s.sumY = 0;
+        s.minX = x0;
+        s.maxX = x1;
+        s.minY = s.maxY = y;
+    }
+
+    BlobRun &run = lab.runs[lab.cur][lab.nruns[lab.cur]++];
+    run.x0 = x0;
+    run.x1 = x1;
+    run.label = label;
+
+    // The first row is kept for blobMerge()
+    if (lab.firstRow < 0)
+    {
+        lab.firstRow = y;
+    }
+    if (y == lab.firstRow)
+    {
+        lab.first[lab.nfirst++] = run;
+    }
+
+    // Statistics are kept on the label the run got, blobEnd() merges them
+    BlobStats &s = lab.stats[label];
+    int n = x1 - x0 + 1;
+    s.area += n;
+    s.sumX += (x0 + x1) * n / 2;
+    s.sumY += y * n;
+    s.minX = std::min<int>(s.minX, x0);
+    s.maxX = std::max<int>(s.maxX, x1);
+    s.minY = std::min<int>(s.minY, y);
+    s.maxY = std::max<int>(s.maxY, y);
+}
+
+void blobStatsMerge(BlobStats &to, const BlobStats &from)
+{
+    to.area += from.area;
+    to.sumX += from.sumX;
+    to.sumY += from.sumY;
+    to.minX = std::min(to.minX, from.minX);
+    to.maxX = std::max(to.maxX, from.maxX);
+    to.minY = std::min(to.minY, from.minY);
+    to.maxY = std::max(to.maxY, from.maxY);
+}
+
+void blobMerge(BlobLabeler &lab, const BlobLabeler &below)
+{
+    // Append the labels of the lower band, the union-find links keep
+    // pointing to the same labels because parent[i] <= i
+    int base = lab.nlabels;
+    int count = std::min(below.nlabels, BLOB_MAX_LABELS - base);
+    for (int i = 0; i < count; i++)
+    {
+        lab.parent[base + i] = base + below.parent[i];
+        lab.stats[base + i] = below.stats[i];
+    }
+    lab.nlabels = base + count;
+    lab.overflow = lab.overflow || below.overflow || count < below.nlabels;
+
+    // Join the runs on both sides of the seam, the same way blobRun() joins
+    // a run with the row above
+    if (lab.row < 0 || below.firstRow != lab.row + 1)
+    {
+        return; // One of the rows along the seam is empty
+    }
+    const BlobRun *upper = lab.runs[lab.cur];
+    int nupper = lab.nruns[lab.cur];
+    int cursor = 0;
+    for (int j = 0; j < below.nfirst; j++)
+    {
+        const BlobRun &run = below.first[j];
+        if (run.label >= count)
+        {
+            continue; // Label was dropped above
+        }
+        while (cursor < nupper && upper[cursor].x1 < run.x0 - 1)
+        {
+            cursor++;
+        }
+        for (int i = cursor; i < nupper && upper[i].x0 <= run.x1 + 1; i++)
+        {
+            unite(lab, upper[i].label, base + run.label);
+        }
+    }
+}
+
+int blobEnd(BlobLabeler &lab, Blob *blobs, int maxBlobs, int minArea)
+{
+    // Merge the statistics of every label into its root
+    for (int i = 0; i < lab.nlabels; i++)
+    {
+        uint16_t root = findRoot(lab, i);
+        if (root == i)
+        {
+            continue;
+        }
+        blobStatsMerge(lab.stats[root], lab.stats[i]);
+    }
+
+    // Keep the largest blobs, sorted on area by insertion
+    int count = 0;
+    for (int i = 0; i < lab.nlabels; i++)
+    {
+        const BlobStats &s = lab.stats[i];
+        if (lab.parent[i] != i || s.area < minArea)
+        {
+            continue;
+        }
+        int pos = count < maxBlobs ? count++ : maxBlobs;
+        while (pos > 0 && blobs[pos - 1].area < s.area)
+        {
+            if (pos < maxBlobs)
+            {
+                blobs[pos] = blobs[pos - 1];
+            }
+            pos--;
+        }
+        if (pos >= maxBlobs)
+        {
+            continue; // Smaller than all kept blobs
+        }
+
+        // Same coordinate convention as detect(), the y axis is flipped
+        Blob &b = blobs[pos];
+        b.area = s.area;
+        b.left = s.minX;
+        b.right = s.maxX;
+        b.top = lab.height - s.minY - 1;
+        b.bottom = lab.height - s.maxY - 1;
+        b.cx = s.sumX / s.area;
+        b.cy = lab.height - s.sumY / s.area - 1;
+    }
+    return count;
+}
@@ -0,0 +1,164 @@
+#include <Arduino.h>
+#include <new>
+#include "broadcast.h"
+
+// Frame broadcaster. The vision task captures every frame once and
+// publishes a JPEG copy here, each stream client waits on its own task for
+// a newer frame. A client that is still sending when the next frames are
+// published only gets the newest one, so a slow connection drops frames
+// without holding up the vision task or the other clients.
+
+static portMUX_TYPE broadcast_mux = portMUX_INITIALIZER_UNLOCKED;
+static SharedFrame *latest = NULL;                  // Under broadcast_mux
+static TaskHandle_t clients[BROADCAST_MAX_CLIENTS]; // Under broadcast_mux
+static std::atomic<int> client_count(0);            // Changed under broadcast_mux
+static BufferPool frame_pool;                       // SharedFrame and its buffer per block
+static const size_t frame_header = (sizeof(SharedFrame) + 7) & ~(size_t)7; // JPEG data follows, aligned
+
+SharedFrame *frameAlloc()
+{
+    uint8_t *mem = poolTake(frame_pool, 0);
+    if (mem == NULL)
+    {
+        return NULL;
+    }
+    SharedFrame *frame = (SharedFrame *)mem;
+    frame->refs.store(1);
+    frame->frame = 0;
+    frame->len = 0;
+    frame->size = frame_pool.size - frame_header;
+    frame->buf = mem + frame_header;
+    return frame;
+}
+
+void frameRelease(SharedFrame *frame)
+{
+    if (frame != NULL && frame->refs.fetch_sub(1) == 1)
+    {
+        poolGive(frame_pool, (uint8_t *)frame);
+    }
+}
+
+/**
+ * Sets up the broadcaster and its pool of frames.
+ *
+ * @param count Number of frames
+ * @param size Bytes of JPEG data per frame
+ * @return false if the pool could not be allocated
+ */
+bool broadcastBegin(int count, size_t size)
+{
+    portENTER_CRITICAL(&broadcast_mux);
+    for (int i = 0; i < BROADCAST_MAX_CLIENTS; i++)
+    {
+        clients[i] = NULL;
+    }
+    client_count = 0;
+    portEXIT_CRITICAL(&broadcast_mux);
+
+    if (!poolBegin(frame_pool, count, frame_header + size))
+    {
+        Serial.println("Stream frame pool not allocated");
+        return false;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        uint8_t *mem = poolTake(frame_pool, 0);
+        new (mem) SharedFrame;
+        poolGive(frame_pool, mem);
+    }
+    return true;
+}
+
+void broadcastPublish(SharedFrame *frame)
+{
+    // Tasks are woken after the critical section, FreeRTOS calls are not
+    // allowed while the spinlock is held
+    TaskHandle_t wake[BROADCAST_MAX_CLIENTS];
+    portENTER_CRITICAL(&broadcast_mux);
+    SharedFrame *previous = latest;
+    latest = frame;
+    for (int i = 0; i < BROADCAST_MAX_CLIENTS; i++)
+    {
+        wake[i] = clients[i];
+    }
+    portEXIT_CRITICAL(&broadcast_mux);
+
+    for (int i = 0; i < BROADCAST_MAX_CLIENTS; i++)
+    {
+        if (wake[i] != NULL)
+        {
+            xTaskNotifyGive(wake[i]);
+        }
+    }
+    frameRelease(previous); // Clients still sending it hold their own reference
+}
+
+int broadcastSubscribe()
+{
+    int client = -1;
+    portENTER_CRITICAL(&broadcast_mux);
+    for (int i = 0; i < BROADCAST_MAX_CLIENTS && client < 0; i++)
+    {
+        if (clients[i] == NULL)
+        {
+            clients[i] = xTaskGetCurrentTaskHandle();
+            client_count++;
+            client = i;
+        }
+    }
+    portEXIT_CRITICAL(&broadcast_mux);
+    return client;
+}
+
+void broadcastUnsubscribe(int client)
+{
+    if (client < 0 || client >= BROADCAST_MAX_CLIENTS)
+    {
+        return;
+    }
+    portENTER_CRITICAL(&broadcast_mux);
+    if (clients[client] != NULL)
+    {
+        clients[client] = NULL;
+        client_count--;
+    }
+    SharedFrame *last = client_count == 0 ? latest : NULL;
+    if (last != NULL)
+    {
+        latest = NULL; // Nobody is watching, do not keep an old frame around
+    }
+    portEXIT_CRITICAL(&broadcast_mux);
+    frameRelease(last);
+}
+
+int broadcastClients()
+{
+    return client_count;
+}
+
+SharedFrame *broadcastNext(uint32_t after, TickType_t wait)
+{
+    TickType_t start = xTaskGetTickCount();
+    for (;;)
+    {
+        portENTER_CRITICAL(&broadcast_mux);
+        SharedFrame *frame = latest;
+        bool newer = frame != NULL && frame->frame != after;
+        if (newer)
+        {
+            frame->refs++;
+        }
+        portEXIT_CRITICAL(&broadcast_mux);
+        if (newer)
+        {
+            return frame;
+        }
+
+        TickType_t waited = xTaskGetTickCount() - start;
+        if (waited >= wait || ulTaskNotifyTake(pdTRUE, wait - waited) == 0)
+        {
+            return NULL;
+        }
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef BROADCAST_H
+#define BROADCAST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <atomic>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "bufpool.h"
+#include "vision.h"
+
+#define BROADCAST_MAX_CLIENTS 4
+
+// JPEG of one camera frame with its detection result, shared by all stream
+// clients. The broadcaster keeps a reference to the newest frame and every
+// client takes one while it sends the frame, the last frameRelease() hands
+// it back to the pool of the broadcaster.
+struct SharedFrame
+{
+    std::atomic<int> refs;
+    uint32_t frame; // Vision frame number
+    struct timeval timestamp;
+    int width, height;
+    VisionResult result; // Detection result of this frame
+    size_t len;   // Bytes of JPEG data
+    size_t size;  // Bytes buf can hold
+    uint8_t *buf; // Allocated with the frame
+};
+
+// Free frame of the pool with one reference held by the caller, NULL if
+// all are in use. Never waits.
+SharedFrame *frameAlloc();
+
+void frameRelease(SharedFrame *frame);
+
+// Allocate the pool of count frames of size bytes of JPEG data each, once
+// in PSRAM. Every client holds at most one frame, so BROADCAST_MAX_CLIENTS
+// plus the newest one and the one being filled are enough.
+bool broadcastBegin(int count, size_t size);
+
+// Make a frame the newest one and wake the clients. Takes over the
+// reference of the caller.
+void broadcastPublish(SharedFrame *frame);
+
+// Register the calling task as a client, -1 if all slots are taken
+int broadcastSubscribe();
+
+void broadcastUnsubscribe(int client);
+
+// Clients that are subscribed, frames only need to be published when
+// there are any
+int broadcastClients();
+
+// Newest frame after frame number after, with a reference for the caller.
+// Frames published while the caller was busy are skipped. NULL if none was
+// published within wait ticks.
+SharedFrame *broadcastNext(uint32_t after, TickType_t wait);
+
+#endif
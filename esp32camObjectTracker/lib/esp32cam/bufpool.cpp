@@ -0,0 +1,63 @@
+#include <Arduino.h>
+#include "esp_heap_caps.h"
+#include "bufpool.h"
+
+/**
+ * Allocates all buffers of a pool in PSRAM.
+ *
+ * @param pool Pool to set up
+ * @param count Number of buffers
+ * @param size Bytes per buffer
+ * @return false if the memory is not available, nothing is allocated then
+ */
+bool poolBegin(BufferPool &pool, int count, size_t size)
+{
+    pool.size = size;
+    pool.count = 0;
+    pool.free = xQueueCreate(count, sizeof(uint8_t *));
+    if (pool.free == NULL)
+    {
+        Serial.println("Buffer pool queue not created");
+        return false;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        uint8_t *buf = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+        if (buf == NULL)
+        {
+            Serial.printf("Buffer pool allocation of %d x %u bytes failed\r\n", count, (unsigned)size);
+            while (xQueueReceive(pool.free, &buf, 0) == pdTRUE)
+            {
+                heap_caps_free(buf);
+            }
+            return false;
+        }
+        xQueueSend(pool.free, &buf, 0);
+    }
+    pool.count = count;
+    return true;
+}
+
+uint8_t *poolTake(BufferPool &pool, TickType_t wait)
+{
+    uint8_t *buf = NULL;
+    if (pool.count == 0 || xQueueReceive(pool.free, &buf, wait) != pdTRUE)
+    {
+        return NULL;
+    }
+    return buf;
+}
+
+void poolGive(BufferPool &pool, uint8_t *buf)
+{
+    if (buf != NULL)
+    {
+        xQueueSend(pool.free, &buf, 0); // Never full, every buffer has a slot
+    }
+}
+
+int poolAvailable(const BufferPool &pool)
+{
+    return pool.count ? uxQueueMessagesWaiting(pool.free) : 0;
+}
@@ -0,0 +1,30 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+// Fixed set of equally sized buffers, allocated once in PSRAM. Buffers are
+// borrowed with poolTake() and handed back with poolGive(), from any task,
+// so memory use stays flat however long the device runs.
+struct BufferPool
+{
+    QueueHandle_t free; // Pointers to the buffers that are not borrowed
+    size_t size;        // Bytes per buffer
+    int count;
+};
+
+bool poolBegin(BufferPool &pool, int count, size_t size);
+
+// Borrow a buffer, waiting up to wait ticks for one to be returned. NULL if
+// none became free in time.
+uint8_t *poolTake(BufferPool &pool, TickType_t wait);
+
+void poolGive(BufferPool &pool, uint8_t *buf);
+
+// Buffers that are not borrowed
+int poolAvailable(const BufferPool &pool);
+
+#endif
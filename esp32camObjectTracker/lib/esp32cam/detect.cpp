@@ -1,5 +1,9 @@
 #include <stdint.h>
+#include <string.h>
 #include <Arduino.h>
+#include <utility>
+#include "detect.h"
+#include "jpeg.h"
 
 void displayBMPHeader(const uint8_t *bmpBuffer, size_t bufferLength)
 {
@@ -152,86 +156,542 @@ static void debug_rgb_info(int width, int height, int x, int y, uint8_t r, uint8
     }
 }
 
-bool getCalibration(
-    uint8_t *buf, int buf_len,
-    int &red_level, int &green_level, int &blue_level)
+// Expand a big-endian RGB565 pixel to 8 bit channels, the same way
+// fmt2rgb888() does it.
+static inline void rgb565ToRGB(const uint8_t *p, int &r, int &g, int &b)
 {
-    // DEBUG
-    displayBMPHeader(buf, buf_len);
+    uint8_t hb = p[0];
+    uint8_t lb = p[1];
+    r = hb & 0xF8;
+    g = ((hb & 0x07) << 5) | ((lb & 0xE0) >> 3);
+    b = (lb & 0x1F) << 3;
+}
+
+static inline int clamp255(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+// BT.601 YUV to RGB conversion in 8.8 fixed point
+static inline void yuvToRGB(int y, int u, int v, int &r, int &g, int &b)
+{
+    u -= 128;
+    v -= 128;
+    r = clamp255(y + ((359 * v) >> 8));
+    g = clamp255(y - ((88 * u + 183 * v) >> 8));
+    b = clamp255(y + ((454 * u) >> 8));
+}
+
+// Number of bytes a raw frame of the given format and size occupies
+static int rawFrameSize(int width, int height, FrameFormat format)
+{
+    switch (format)
+    {
+    case FRAME_BGR888:
+        return width * height * 3;
+    case FRAME_GRAY8:
+        return width * height;
+    default:
+        // Both RGB565 and YUV422 use 16 bits per pixel on average
+        return width * height * 2;
+    }
+}
 
-    // BMP file format handling
+/**
+ * Describe the pixel data of a 24-bit BMP. The header is only parsed here,
+ * the kernels work on the view.
+ *
+ * @return false if the buffer does not hold a complete 24-bit BMP
+ */
+bool imageFromBMP(const uint8_t *buf, int buf_len, ImageView &view)
+{
     // The BMP header is typically 54 bytes
     const int HEADER_SIZE = 54;
 
-    if (buf_len <= HEADER_SIZE)
+    if (buf == NULL || buf_len <= HEADER_SIZE)
     {
-        Serial.println("getCalibration error: 0");
         return false; // Buffer too small to contain a valid BMP
     }
 
-    // Extract image dimensions from BMP header
-    int width = *reinterpret_cast<int *>(&buf[18]);
-    int height = *reinterpret_cast<int *>(&buf[22]);
-    int bitsPerPixel = *reinterpret_cast<short *>(&buf[28]);
+    int32_t width, height;
+    int16_t bitsPerPixel;
+    memcpy(&width, &buf[18], sizeof(width));
+    memcpy(&height, &buf[22], sizeof(height));
+    memcpy(&bitsPerPixel, &buf[28], sizeof(bitsPerPixel));
 
-    // Ensure it's a 24-bit BMP (RGB)
     if (bitsPerPixel != 24)
     {
-        Serial.printf("getCalibration error: 1, bitsPerPixel:%d\r\n", bitsPerPixel);
         return false; // Only supporting 24-bit BMPs
     }
 
-    // Calculate row padding (BMP rows are padded to 4-byte boundaries)
-    int paddedRowSize = ((width * 3 + 3) / 4) * 4;
-    int dataSize = paddedRowSize * height;
+    // BMP files store image data bottom-up unless the height is negative
+    view.bottomUp = height > 0;
+    if (!view.bottomUp)
+    {
+        height = -height;
+    }
+    if (width <= 0 || height <= 0)
+    {
+        return false;
+    }
 
-    // Check if buffer is large enough
-    if (buf_len < HEADER_SIZE + dataSize)
+    // Rows are padded to 4-byte boundaries
+    view.stride = ((width * 3 + 3) / 4) * 4;
+    if (buf_len < HEADER_SIZE + view.stride * height)
     {
-        Serial.printf("getCalibration error: 2 buf_len:%d dataSize:%d\r\n", buf_len, dataSize);
         return false; // Buffer too small for the image dimensions
     }
 
-    // BMP files store image data bottom-up by default
-    // Check if height is negative, which means top-down storage
-    bool isTopDown = height < 0;
-    if (isTopDown)
+    view.pixels = buf + HEADER_SIZE;
+    view.width = width;
+    view.height = height;
+    view.format = FRAME_BGR888;
+    return true;
+}
+
+/**
+ * Describe a raw camera frame buffer, rows top-down without padding.
+ *
+ * @return false if the buffer is too small for the frame
+ */
+bool imageFromFrame(
+    const uint8_t *buf, int buf_len, int width, int height, FrameFormat format,
+    ImageView &view)
+{
+    if (buf == NULL || width <= 0 || height <= 0 || buf_len < rawFrameSize(width, height, format))
+    {
+        return false;
+    }
+
+    view.pixels = buf;
+    view.width = width;
+    view.height = height;
+    view.stride = rawFrameSize(width, 1, format);
+    view.format = format;
+    view.bottomUp = false;
+    return true;
+}
+
+// Pixel access for each frame format. The kernels below are instantiated
+// for every format and row order, so their inner loops do not branch on
+// either.
+template <FrameFormat F>
+struct Pixel;
+
+template <>
+struct Pixel<FRAME_BGR888>
+{
+    static inline bool match(const uint8_t *row, int x, const ColorLut &lut)
     {
-        height = -height;
+        return colorLutBGR(lut, row + x * 3);
+    }
+    static inline uint8_t classes(const uint8_t *row, int x, const ClassLut &lut)
+    {
+        return lut.rgb[colorIndexBGR(row + x * 3)];
+    }
+    static inline void rgb(const uint8_t *row, int x, int &r, int &g, int &b)
+    {
+        b = row[x * 3];
+        g = row[x * 3 + 1];
+        r = row[x * 3 + 2];
     }
+};
 
-    // Pointer to start of pixel data
-    uint8_t *pixelData = buf + HEADER_SIZE;
+template <>
+struct Pixel<FRAME_RGB565>
+{
+    static inline bool match(const uint8_t *row, int x, const ColorLut &lut)
+    {
+        return colorLutRGB565(lut, row + x * 2);
+    }
+    static inline uint8_t classes(const uint8_t *row, int x, const ClassLut &lut)
+    {
+        return lut.rgb[colorIndexRGB565(row + x * 2)];
+    }
+    static inline void rgb(const uint8_t *row, int x, int &r, int &g, int &b)
+    {
+        rgb565ToRGB(row + x * 2, r, g, b);
+    }
+};
 
-    int offset = 2;
-    int sum_red_level = 0;
-    int sum_green_level = 0;
-    int sum_blue_level = 0;
-    int nrOfSamples = 0;
+// Two pixels share the chroma of their 4 byte group Y0 U Y1 V
+template <>
+struct Pixel<FRAME_YUV422>
+{
+    static inline bool match(const uint8_t *row, int x, const ColorLut &lut)
+    {
+        const uint8_t *p = row + (x & ~1) * 2;
+        return colorLutYUV(lut, p[(x & 1) * 2], p[1], p[3]);
+    }
+    static inline uint8_t classes(const uint8_t *row, int x, const ClassLut &lut)
+    {
+        const uint8_t *p = row + (x & ~1) * 2;
+        return lut.yuv[colorIndexYUV(p[(x & 1) * 2], p[1], p[3])];
+    }
+    static inline void rgb(const uint8_t *row, int x, int &r, int &g, int &b)
+    {
+        const uint8_t *p = row + (x & ~1) * 2;
+        yuvToRGB(p[(x & 1) * 2], p[1], p[3], r, g, b);
+    }
+};
 
-    for (int y = (height / 2) - offset; y < (height / 2) + offset; y++)
+// Luma only, classified as a color without chroma
+template <>
+struct Pixel<FRAME_GRAY8>
+{
+    static inline bool match(const uint8_t *row, int x, const ColorLut &lut)
+    {
+        return colorLutYUV(lut, row[x], 128, 128);
+    }
+    static inline uint8_t classes(const uint8_t *row, int x, const ClassLut &lut)
+    {
+        return lut.yuv[colorIndexYUV(row[x], 128, 128)];
+    }
+    static inline void rgb(const uint8_t *row, int x, int &r, int &g, int &b)
+    {
+        r = g = b = row[x];
+    }
+};
+
+// Row y counted from the top of the image
+template <bool BottomUp>
+static inline const uint8_t *imageRow(const ImageView &view, int y)
+{
+    return view.pixels + (BottomUp ? view.height - 1 - y : y) * view.stride;
+}
+
+// Run Kernel<format, bottomUp>::run(view, args...) for the layout of the view
+template <template <FrameFormat, bool> class Kernel, typename... Args>
+static bool runKernel(const ImageView &view, Args &&...args)
+{
+    switch (view.format)
+    {
+    case FRAME_BGR888:
+        return view.bottomUp ? Kernel<FRAME_BGR888, true>::run(view, std::forward<Args>(args)...)
+                             : Kernel<FRAME_BGR888, false>::run(view, std::forward<Args>(args)...);
+    case FRAME_RGB565:
+        return view.bottomUp ? Kernel<FRAME_RGB565, true>::run(view, std::forward<Args>(args)...)
+                             : Kernel<FRAME_RGB565, false>::run(view, std::forward<Args>(args)...);
+    case FRAME_YUV422:
+        return view.bottomUp ? Kernel<FRAME_YUV422, true>::run(view, std::forward<Args>(args)...)
+                             : Kernel<FRAME_YUV422, false>::run(view, std::forward<Args>(args)...);
+    case FRAME_GRAY8:
+        return view.bottomUp ? Kernel<FRAME_GRAY8, true>::run(view, std::forward<Args>(args)...)
+                             : Kernel<FRAME_GRAY8, false>::run(view, std::forward<Args>(args)...);
+    }
+    return false;
+}
+
+// Box of the matching pixels inside the window [x0..x1]x[y0..y1], looking
+// at every step-th pixel of every step-th row. Rows counted from the top.
+template <FrameFormat F, bool BottomUp>
+struct BoundsKernel
+{
+    static bool run(
+        const ImageView &view, const ColorLut &lut,
+        int x0, int y0, int x1, int y1, int step,
+        int &minX, int &minY, int &maxX, int &maxY)
+    {
+        minX = x1 + 1;
+        minY = y1 + 1;
+        maxX = -1;
+        maxY = -1;
+        int last = x0 + (x1 - x0) / step * step; // Last pixel looked at in a row
+        for (int y = y0; y <= y1; y += step)
+        {
+            const uint8_t *row = imageRow<BottomUp>(view, y);
+
+            // First match from the left, then the last one from the right.
+            // The pixels in between cannot change the box, and the box is
+            // only updated once per row.
+            int left = x0;
+            while (left + 3 * step <= last &&
+                   !(Pixel<F>::match(row, left, lut) | Pixel<F>::match(row, left + step, lut) |
+                     Pixel<F>::match(row, left + 2 * step, lut) | Pixel<F>::match(row, left + 3 * step, lut)))
+            {
+                left += 4 * step; // One branch per 4 pixels, their lookups overlap
+            }
+            while (left <= last && !Pixel<F>::match(row, left, lut))
+            {
+                left += step;
+            }
+            if (left > last)
+            {
+                continue;
+            }
+            int right = last;
+            while (right > left && !Pixel<F>::match(row, right, lut))
+            {
+                right -= step;
+            }
+
+            minX = std::min(minX, left);
+            maxX = std::max(maxX, right);
+            if (maxY < 0)
+            {
+                minY = y;
+            }
+            maxY = y;
+        }
+        return maxX >= 0;
+    }
+};
+
+// Sum of the colors inside the window [x0..x1]x[y0..y1]
+template <FrameFormat F, bool BottomUp>
+struct SumKernel
+{
+    static bool run(
+        const ImageView &view,
+        int x0, int y0, int x1, int y1,
+        int &sumR, int &sumG, int &sumB)
+    {
+        sumR = sumG = sumB = 0;
+        for (int y = y0; y <= y1; y++)
+        {
+            const uint8_t *row = imageRow<BottomUp>(view, y);
+            for (int x = x0; x <= x1; x++)
+            {
+                int r, g, b;
+                Pixel<F>::rgb(row, x, r, g, b);
+                sumR += r;
+                sumG += g;
+                sumB += b;
+            }
+        }
+        return true;
+    }
+};
+
+// Feed the runs of matching pixels in rows [y0..y1] to a labeler
+template <FrameFormat F, bool BottomUp>
+struct LabelKernel
+{
+    static bool run(const ImageView &view, const ColorLut &lut, int y0, int y1, BlobLabeler &lab)
+    {
+        for (int y = y0; y <= y1; y++)
+        {
+            const uint8_t *row = imageRow<BottomUp>(view, y);
+            int start = -1;
+            for (int x = 0; x < view.width; x++)
+            {
+                if (Pixel<F>::match(row, x, lut))
+                {
+                    if (start < 0)
+                    {
+                        start = x;
+                    }
+                }
+                else if (start >= 0)
+                {
+                    blobRun(lab, y, start, x - 1);
+                    start = -1;
+                }
+            }
+            if (start >= 0)
+            {
+                blobRun(lab, y, start, view.width - 1);
+            }
+        }
+        return true;
+    }
+};
+
+// Threshold into a bit-packed mask, 32 pixels per store
+template <FrameFormat F, bool BottomUp>
+struct MaskKernel
+{
+    static bool run(const ImageView &view, const ColorLut &lut, BitMask &mask)
+    {
+        for (int y = 0; y < view.height; y++)
+        {
+            const uint8_t *row = imageRow<BottomUp>(view, y);
+            uint32_t *out = mask.bits + y * mask.stride;
+            for (int k = 0; k < mask.stride; k++)
+            {
+                uint32_t word = 0;
+                int end = std::min(32, view.width - k * 32);
+                for (int i = 0; i < end; i++)
+                {
+                    word |= (uint32_t)Pixel<F>::match(row, k * 32 + i, lut) << i;
+                }
+                out[k] = word;
+            }
+        }
+        return true;
+    }
+};
+
+// Accumulate the statistics of every color class in rows [y0..y1]
+template <FrameFormat F, bool BottomUp>
+struct ClassKernel
+{
+    static bool run(const ImageView &view, const ClassLut &lut, int y0, int y1, BlobStats *stats)
     {
-        for (int x = (width / 2) - offset; x < (width / 2) + offset; x++)
+        for (int y = y0; y <= y1; y++)
         {
-            // Calculate position in BMP data
-            // BMP stores colors as BGR
-            int actualY = isTopDown ? y : (height - 1 - y);
-            int pos = actualY * paddedRowSize + x * 3;
-
-            sum_red_level = sum_red_level + pixelData[pos + 2];
-            sum_green_level = sum_green_level + pixelData[pos + 1];
-            sum_blue_level = sum_blue_level + pixelData[pos];
-            nrOfSamples++;
+            const uint8_t *row = imageRow<BottomUp>(view, y);
+            for (int x = 0; x < view.width; x++)
+            {
+                uint8_t classes = Pixel<F>::classes(row, x, lut);
+                while (classes)
+                {
+                    BlobStats &s = stats[__builtin_ctz(classes)];
+                    classes &= classes - 1;
+                    s.area++;
+                    s.sumX += x;
+                    s.sumY += y;
+                    s.minX = std::min<int>(s.minX, x);
+                    s.maxX = std::max<int>(s.maxX, x);
+                    s.minY = std::min<int>(s.minY, y);
+                    s.maxY = std::max<int>(s.maxY, y);
+                }
+            }
         }
+        return true;
+    }
+};
+
+// Box of the matching pixels inside a window, rows counted from the top
+static bool scanWindow(
+    const ImageView &view, const ColorLut &lut,
+    int x0, int y0, int x1, int y1,
+    int &minX, int &minY, int &maxX, int &maxY)
+{
+    return runKernel<BoundsKernel>(view, lut, x0, y0, x1, y1, 1, minX, minY, maxX, maxY);
+}
+
+bool detectRows(
+    const ImageView &view, const ColorLut &lut, int y0, int y1,
+    int &minX, int &minY, int &maxX, int &maxY)
+{
+    return scanWindow(view, lut, 0, y0, view.width - 1, y1, minX, minY, maxX, maxY);
+}
+
+void labelRows(const ImageView &view, const ColorLut &lut, int y0, int y1, BlobLabeler &lab)
+{
+    runKernel<LabelKernel>(view, lut, y0, y1, lab);
+}
+
+void classRows(const ImageView &view, const ClassLut &lut, int y0, int y1, BlobStats *stats)
+{
+    runKernel<ClassKernel>(view, lut, y0, y1, stats);
+}
+
+// Average color of the centre area of an image
+static bool calibrateImage(
+    const ImageView &view,
+    int &red_level, int &green_level, int &blue_level)
+{
+    int offset = 2;
+    int x = view.width / 2 - offset;
+    int y = view.height / 2 - offset;
+    if (x < 0 || y < 0)
+    {
+        return false;
     }
+
+    int sum_red_level, sum_green_level, sum_blue_level;
+    runKernel<SumKernel>(
+        view, x, y, x + 2 * offset - 1, y + 2 * offset - 1,
+        sum_red_level, sum_green_level, sum_blue_level);
+
     // Calculate averages
+    int nrOfSamples = 4 * offset * offset;
     red_level = sum_red_level / nrOfSamples;
     green_level = sum_green_level / nrOfSamples;
     blue_level = sum_blue_level / nrOfSamples;
+    return true;
+}
+
+bool getCalibration(
+    uint8_t *buf, int buf_len,
+    int &red_level, int &green_level, int &blue_level)
+{
+    // DEBUG
+    displayBMPHeader(buf, buf_len);
+
+    ImageView view;
+    if (!imageFromBMP(buf, buf_len, view))
+    {
+        Serial.printf("getCalibration error: buf_len:%d\r\n", buf_len);
+        return false;
+    }
+    return calibrateImage(view, red_level, green_level, blue_level);
+}
+
+/**
+ * Calibration on a raw camera frame buffer. Averages the color of the
+ * centre area, like getCalibration() does for a BMP.
+ */
+bool getCalibrationRaw(
+    const uint8_t *buf, int buf_len, int width, int height, FrameFormat format,
+    int &red_level, int &green_level, int &blue_level)
+{
+    ImageView view;
+    if (!imageFromFrame(buf, buf_len, width, height, format, view))
+    {
+        Serial.printf("getCalibrationRaw error: buf_len:%d\r\n", buf_len);
+        return false;
+    }
+    return calibrateImage(view, red_level, green_level, blue_level);
+}
+
+/**
+ * Box around all pixels of an image that the color table accepts. This is
+ * the kernel behind detectLut() and detectRaw().
+ *
+ * @param view Image to scan, see imageFromBMP() and imageFromFrame()
+ * @param lut Color classification table, see colorLutBuild()
+ * @param left Output parameter for the left coordinate of detected rectangle
+ * @param top Output parameter for the top coordinate of detected rectangle
+ * @param right Output parameter for the right coordinate of detected rectangle
+ * @param bottom Output parameter for the bottom coordinate of detected rectangle
+ * @return true if detection successful, false otherwise
+ */
+bool detectImage(
+    const ImageView &view, const ColorLut &lut,
+    int &left, int &top, int &right, int &bottom)
+{
+    int minX, minY, maxX, maxY;
+    if (!scanWindow(view, lut, 0, 0, view.width - 1, view.height - 1, minX, minY, maxX, maxY))
+    {
+        return false; // No matching pixels found
+    }
 
+    // Flip the y axis
+    left = minX;
+    right = maxX;
+    top = view.height - minY - 1;
+    bottom = view.height - maxY - 1;
     return true;
 }
 
+/**
+ * Detects regions in a BMP image that match a color classification table.
+ * Finds a rectangle enclosing all pixels the table accepts.
+ *
+ * @param buf Pointer to the BMP image data
+ * @param buf_len Length of the buffer in bytes
+ * @param lut Color classification table, see colorLutBuild()
+ * @param left Output parameter for the left coordinate of detected rectangle
+ * @param top Output parameter for the top coordinate of detected rectangle
+ * @param right Output parameter for the right coordinate of detected rectangle
+ * @param bottom Output parameter for the bottom coordinate of detected rectangle
+ * @return true if detection successful, false otherwise
+ */
+bool detectLut(
+    uint8_t *buf, int buf_len, const ColorLut &lut,
+    int &left, int &top, int &right, int &bottom)
+{
+    ImageView view;
+    if (!imageFromBMP(buf, buf_len, view))
+    {
+        return false;
+    }
+    return detectImage(view, lut, left, top, right, bottom);
+}
+
 /**
  * Detects regions in a BMP image that match specific color criteria.
  * Finds a rectangle enclosing all pixels that meet the following criteria:
@@ -239,6 +699,11 @@ bool getCalibration(
  * - green value must be <= the specified green maximum
  * - blue value must be <= the specified blue maximum
  *
+ * The levels are compared with the 8 bit channels of every pixel, and the
+ * function keeps no state between calls. To detect many frames with the
+ * same levels, build a table once with colorLutBuildLevels() and use
+ * detectLut(), which classifies a BMP pixel by its RGB565 color.
+ *
  * @param buf Pointer to the BMP image data
  * @param buf_len Length of the buffer in bytes
  * @param red_level Minimum red value to match
@@ -255,101 +720,830 @@ bool detect(
     int red_level, int green_level, int blue_level,
     int &left, int &top, int &right, int &bottom)
 {
-    // BMP file format handling
-    // The BMP header is typically 54 bytes
-    const int HEADER_SIZE = 54;
+    ImageView view;
+    if (!imageFromBMP(buf, buf_len, view))
+    {
+        return false;
+    }
 
-    if (buf_len <= HEADER_SIZE)
+    int minX = view.width, minY = view.height, maxX = -1, maxY = -1;
+    for (int y = 0; y < view.height; y++)
     {
-        return false; // Buffer too small to contain a valid BMP
+        const uint8_t *row = view.bottomUp ? imageRow<true>(view, y) : imageRow<false>(view, y);
+        for (int x = 0; x < view.width; x++)
+        {
+            const uint8_t *p = row + x * 3; // BGR
+            if (p[2] >= red_level && p[1] <= green_level && p[0] <= blue_level)
+            {
+                minX = std::min(minX, x);
+                minY = std::min(minY, y);
+                maxX = std::max(maxX, x);
+                maxY = std::max(maxY, y);
+            }
+        }
+    }
+    if (maxX < 0)
+    {
+        return false; // No matching pixels found
     }
 
-    // Extract image dimensions from BMP header
-    int width = *reinterpret_cast<int *>(&buf[18]);
-    int height = *reinterpret_cast<int *>(&buf[22]);
-    int bitsPerPixel = *reinterpret_cast<short *>(&buf[28]);
+    // Flip the y axis
+    left = minX;
+    right = maxX;
+    top = view.height - minY - 1;
+    bottom = view.height - maxY - 1;
+    return true;
+}
+
+void colorLutBuild(ColorLut &lut, ColorClassifier match, void *ctx)
+{
+    memset(&lut, 0, sizeof(lut));
+    int r, g, b;
 
-    // Ensure it's a 24-bit BMP (RGB)
-    if (bitsPerPixel != 24)
+    // RGB cell r5 g6 b5, expanded like rgb565ToRGB() so RGB565 frames are
+    // classified exactly
+    for (int i = 0; i < 2048 * 32; i++)
     {
-        return false; // Only supporting 24-bit BMPs
+        uint8_t rgb565[2] = {(uint8_t)(i >> 8), (uint8_t)i};
+        rgb565ToRGB(rgb565, r, g, b);
+        if (match(r, g, b, ctx))
+        {
+            lut.rgb[i >> 5] |= 1u << (i & 31);
+        }
     }
 
-    // Calculate row padding (BMP rows are padded to 4-byte boundaries)
-    int paddedRowSize = ((width * 3 + 3) / 4) * 4;
-    int dataSize = paddedRowSize * height;
+    // YUV cell y6 u5 v5, evaluated at the center of the cell
+    for (int i = 0; i < 2048 * 32; i++)
+    {
+        int y = ((i >> 10) << 2) | 2;
+        int u = (((i >> 5) & 0x1F) << 3) | 4;
+        int v = ((i & 0x1F) << 3) | 4;
+        yuvToRGB(y, u, v, r, g, b);
+        if (match(r, g, b, ctx))
+        {
+            lut.yuv[i >> 5] |= 1u << (i & 31);
+        }
+    }
+}
+
+struct LevelCriteria
+{
+    int red_level, green_level, blue_level;
+};
+
+static bool matchLevels(int r, int g, int b, void *ctx)
+{
+    const LevelCriteria *c = (const LevelCriteria *)ctx;
+    return r >= c->red_level && g <= c->green_level && b <= c->blue_level;
+}
+
+void colorLutBuildLevels(ColorLut &lut, int red_level, int green_level, int blue_level)
+{
+    LevelCriteria criteria = {red_level, green_level, blue_level};
+    colorLutBuild(lut, matchLevels, &criteria);
+}
 
-    // Check if buffer is large enough
-    if (buf_len < HEADER_SIZE + dataSize)
+/**
+ * Detects regions in a raw RGB565, YUV422 or GRAY8 camera frame buffer that
+ * match a color classification table, like detectLut(). The frame is
+ * scanned in place, so no JPEG decode or BMP buffer is needed.
+ *
+ * The returned coordinates use the same convention as detect() so the
+ * rectangle can be handed to drawRect() on a BMP of the same frame.
+ *
+ * @param buf Pointer to the frame buffer (fb->buf)
+ * @param buf_len Length of the frame buffer in bytes (fb->len)
+ * @param width Width of the frame in pixels
+ * @param height Height of the frame in pixels
+ * @param format Layout of the frame buffer
+ * @param lut Color classification table, see colorLutBuild()
+ * @param left Output parameter for the left coordinate of detected rectangle
+ * @param top Output parameter for the top coordinate of detected rectangle
+ * @param right Output parameter for the right coordinate of detected rectangle
+ * @param bottom Output parameter for the bottom coordinate of detected rectangle
+ * @return true if detection successful, false otherwise
+ */
+bool detectRaw(
+    const uint8_t *buf, int buf_len, int width, int height, FrameFormat format,
+    const ColorLut &lut,
+    int &left, int &top, int &right, int &bottom)
+{
+    ImageView view;
+    if (!imageFromFrame(buf, buf_len, width, height, format, view))
     {
-        return false; // Buffer too small for the image dimensions
+        return false;
     }
+    return detectImage(view, lut, left, top, right, bottom);
+}
 
-    // BMP files store image data bottom-up by default
-    // Check if height is negative, which means top-down storage
-    bool isTopDown = height < 0;
-    if (isTopDown)
+// Index of the block of component c that covers the luma block at (bx, by)
+// inside an MCU.
+static int mcuBlockIndex(const JpegImage &img, int c, int bx, int by)
+{
+    int first = 0;
+    for (int i = 0; i < c; i++)
     {
-        height = -height;
+        first += img.comp[i].h * img.comp[i].v;
     }
+    const JpegComponent &comp = img.comp[c];
+    int cx = bx * comp.h / img.hmax;
+    int cy = by * comp.v / img.vmax;
+    return first + cy * comp.h + cx;
+}
 
-    // Pointer to start of pixel data
-    uint8_t *pixelData = buf + HEADER_SIZE;
+// Full resolution pass over the MCUs touching the border ring of the block
+// box [bl..br]x[bt..bb]. Tightens the pixel box to the matching pixels.
+static bool refineJpegDC(
+    int bl, int bt, int br, int bb,
+    const ColorLut &lut, JpegDCState &state,
+    int &left, int &top, int &right, int &bottom)
+{
+    const JpegImage &img = state.img;
+    int dc[JPEG_MAX_BLOCKS_PER_MCU];
+    int lumaCols = img.comp[0].h;
+    int lumaRows = img.comp[0].v;
+    int first[JPEG_MAX_COMPONENTS];
+    for (int c = 0; c < img.ncomp; c++)
+    {
+        first[c] = mcuBlockIndex(img, c, 0, 0);
+    }
+
+    int minX = img.width, minY = img.height, maxX = -1, maxY = -1;
+
+    jpegScanBegin(state.scan, img);
+    for (int my = 0; my < img.mcusY; my++)
+    {
+        for (int mx = 0; mx < img.mcusX; mx++)
+        {
+            // Only MCUs with a ring block get their coefficients decoded
+            bool ring = false;
+            for (int by = my * lumaRows; by < (my + 1) * lumaRows; by++)
+            {
+                for (int bx = mx * lumaCols; bx < (mx + 1) * lumaCols; bx++)
+                {
+                    bool inBox = bx >= bl - 1 && bx <= br + 1 && by >= bt - 1 && by <= bb + 1;
+                    bool interior = bx > bl && bx < br && by > bt && by < bb;
+                    ring = ring || (inBox && !interior);
+                }
+            }
+            if (!jpegScanMcu(state.scan, dc, ring ? state.coef : NULL))
+            {
+                return false;
+            }
+            if (!ring)
+            {
+                continue;
+            }
+
+            for (int b = 0; b < img.blocksPerMcu; b++)
+            {
+                const JpegComponent &comp = img.comp[state.scan.blockComp[b]];
+                jpegIdct(state.coef[b], img.qt[comp.tq], state.samples[b]);
+            }
+
+            // Threshold the pixels of the MCU with upsampled chroma
+            for (int py = 0; py < img.mcuHeight; py++)
+            {
+                int y = my * img.mcuHeight + py;
+                if (y >= img.height)
+                {
+                    break;
+                }
+                for (int px = 0; px < img.mcuWidth; px++)
+                {
+                    int x = mx * img.mcuWidth + px;
+                    if (x >= img.width)
+                    {
+                        break;
+                    }
+                    int sample[JPEG_MAX_COMPONENTS];
+                    for (int c = 0; c < img.ncomp; c++)
+                    {
+                        const JpegComponent &comp = img.comp[c];
+                        int cx = px * comp.h / img.hmax;
+                        int cy = py * comp.v / img.vmax;
+                        int b = first[c] + (cy >> 3) * comp.h + (cx >> 3);
+                        sample[c] = state.samples[b][(cy & 7) * 8 + (cx & 7)];
+                    }
+                    if (colorLutYUV(lut, sample[0], sample[1], sample[2]))
+                    {
+                        minX = std::min(minX, x);
+                        minY = std::min(minY, y);
+                        maxX = std::max(maxX, x);
+                        maxY = std::max(maxY, y);
+                    }
+                }
+            }
+        }
+    }
+
+    if (maxX < 0)
+    {
+        return false; // Keep the block box
+    }
+
+    // Interior blocks lie inside the ring, so only the ring pixels matter
+    left = minX;
+    top = minY;
+    right = maxX;
+    bottom = maxY;
+    return true;
+}
+
+/**
+ * Detects a colored object from the DC coefficients of a JPEG frame. Each
+ * 8x8 luma block is classified by its average color, which the entropy
+ * decoder gives without any inverse DCT. At QQVGA that is a 20x15 map.
+ *
+ * The result is the bounding box of the matching blocks, optionally refined
+ * to pixel precision by fully decoding only the blocks along its border.
+ * Coordinates use the same convention as detect().
+ *
+ * @param buf Pointer to the JPEG data (fb->buf)
+ * @param buf_len Length of the JPEG data in bytes (fb->len)
+ * @param lut Color classification table, see colorLutBuild()
+ * @param refine Decode the border blocks to find the exact edges
+ * @param state Scratch space of the caller, see JpegDCState
+ * @param left Output parameter for the left coordinate of detected rectangle
+ * @param top Output parameter for the top coordinate of detected rectangle
+ * @param right Output parameter for the right coordinate of detected rectangle
+ * @param bottom Output parameter for the bottom coordinate of detected rectangle
+ * @return true if detection successful, false otherwise
+ */
+bool detectJpegDC(
+    const uint8_t *buf, int buf_len,
+    const ColorLut &lut, bool refine, JpegDCState &state,
+    int &left, int &top, int &right, int &bottom)
+{
+    JpegImage &img = state.img;
+
+    if (!jpegParse(buf, buf_len, img))
+    {
+        return false; // Not a baseline JPEG
+    }
+    if (img.ncomp != 3)
+    {
+        return false; // No color information
+    }
+
+    int lumaCols = img.comp[0].h;
+    int lumaRows = img.comp[0].v;
+    int cols = (img.width + 7) / 8;
+    int rows = (img.height + 7) / 8;
+    if (cols > JPEG_DC_MAX_COLS || rows > JPEG_DC_MAX_ROWS)
+    {
+        Serial.printf("detectJpegDC error: %dx%d too large\r\n", img.width, img.height);
+        return false;
+    }
+
+    int dc[JPEG_MAX_BLOCKS_PER_MCU];
+
+    // Build the map of block average colors from the DC coefficients
+    jpegScanBegin(state.scan, img);
+    for (int my = 0; my < img.mcusY; my++)
+    {
+        for (int mx = 0; mx < img.mcusX; mx++)
+        {
+            if (!jpegScanMcu(state.scan, dc, NULL))
+            {
+                return false; // Corrupt or truncated frame
+            }
+
+            // Block averages: DC / 8, chroma is shared by the luma blocks
+            for (int y = 0; y < lumaRows; y++)
+            {
+                int by = my * lumaRows + y;
+                for (int x = 0; x < lumaCols; x++)
+                {
+                    int bx = mx * lumaCols + x;
+                    if (bx >= cols || by >= rows)
+                    {
+                        continue; // Padding block outside the image
+                    }
+                    int luma = dc[y * lumaCols + x] / 8 + 128;
+                    int cb = dc[mcuBlockIndex(img, 1, x, y)] / 8 + 128;
+                    int cr = dc[mcuBlockIndex(img, 2, x, y)] / 8 + 128;
+                    int r, g, b;
+                    yuvToRGB(clamp255(luma), clamp255(cb), clamp255(cr), r, g, b);
+                    state.map[by * cols + bx] = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+                }
+            }
+        }
+    }
+
+    // Threshold the map
+    int bl = cols, bt = rows, br = -1, bb = -1;
+    for (int by = 0; by < rows; by++)
+    {
+        for (int bx = 0; bx < cols; bx++)
+        {
+            if (colorLutTest(lut.rgb, state.map[by * cols + bx]))
+            {
+                bl = std::min(bl, bx);
+                bt = std::min(bt, by);
+                br = std::max(br, bx);
+                bb = std::max(bb, by);
+            }
+        }
+    }
+
+    // If no matching blocks found, return false
+    if (br < 0)
+    {
+        return false;
+    }
+
+    // Block box in pixels
+    left = bl * 8;
+    top = bt * 8;
+    right = std::min(br * 8 + 7, img.width - 1);
+    bottom = std::min(bb * 8 + 7, img.height - 1);
+
+    if (refine)
+    {
+        refineJpegDC(
+            bl, bt, br, bb,
+            lut, state,
+            left, top, right, bottom);
+    }
+
+    // Flip the y axis to match detect()
+    top = img.height - top - 1;
+    bottom = img.height - bottom - 1;
+
+    return true;
+}
+
+// Label the matching pixels of an image
+static int labelImage(
+    const ImageView &view, const ColorLut &lut,
+    Blob *blobs, int maxBlobs, int minArea)
+{
+    blobBegin(blobLabeler, view.width, view.height);
+    labelRows(view, lut, 0, view.height - 1, blobLabeler);
+    return blobEnd(blobLabeler, blobs, maxBlobs, minArea);
+}
+
+/**
+ * Finds all connected areas (8-connectivity) in a BMP image that match the
+ * color table, instead of one box around every matching pixel. A single
+ * pass labels runs of matching pixels, so the cost is about the same as
+ * detectLut().
+ *
+ * @param buf Pointer to the BMP image data
+ * @param buf_len Length of the buffer in bytes
+ * @param lut Color classification table, see colorLutBuild()
+ * @param blobs Output array, sorted on area with the largest blob first
+ * @param maxBlobs Size of the blobs array
+ * @param minArea Blobs with fewer pixels are left out
+ * @return Number of blobs written to blobs
+ */
+int detectBlobs(
+    uint8_t *buf, int buf_len,
+    const ColorLut &lut,
+    Blob *blobs, int maxBlobs, int minArea)
+{
+    ImageView view;
+    if (!imageFromBMP(buf, buf_len, view))
+    {
+        return 0;
+    }
+    return labelImage(view, lut, blobs, maxBlobs, minArea);
+}
+
+int detectBlobsRaw(
+    const uint8_t *buf, int buf_len, int width, int height, FrameFormat format,
+    const ColorLut &lut,
+    Blob *blobs, int maxBlobs, int minArea)
+{
+    ImageView view;
+    if (!imageFromFrame(buf, buf_len, width, height, format, view))
+    {
+        return 0;
+    }
+    return labelImage(view, lut, blobs, maxBlobs, minArea);
+}
 
-    // Initialize boundaries to extremes (for min/max search)
-    left = width;    // Initialize to max possible value
-    top = height;    // Initialize to max possible value
-    right = -1;      // Initialize to min possible value
-    bottom = -1;     // Initialize to min possible value
+// Bits of the enabled classes whose range holds the color
+static uint8_t colorClasses(const ColorClass *classes, int count, int r, int g, int b)
+{
+    uint8_t bits = 0;
+    for (int c = 0; c < count; c++)
+    {
+        const ColorClass &cc = classes[c];
+        if (cc.enabled && r >= cc.rmin && r <= cc.rmax &&
+            g >= cc.gmin && g <= cc.gmax && b >= cc.bmin && b <= cc.bmax)
+        {
+            bits |= 1 << c;
+        }
+    }
+    return bits;
+}
+
+void classLutBuild(ClassLut &lut, const ColorClass *classes, int count)
+{
+    int r, g, b;
+    count = std::min(count, COLOR_MAX_CLASSES);
+
+    for (int i = 0; i < 65536; i++)
+    {
+        uint8_t rgb565[2] = {(uint8_t)(i >> 8), (uint8_t)i};
+        rgb565ToRGB(rgb565, r, g, b);
+        lut.rgb[i] = colorClasses(classes, count, r, g, b);
+
+        // Y6 U5 V5 evaluated at the center of the cell, as in colorLutBuild()
+        yuvToRGB(((i >> 10) << 2) | 2, (((i >> 5) & 0x1F) << 3) | 4, ((i & 0x1F) << 3) | 4, r, g, b);
+        lut.yuv[i] = colorClasses(classes, count, r, g, b);
+    }
+}
+
+void classStatsBegin(const ImageView &view, BlobStats *stats)
+{
+    for (int c = 0; c < COLOR_MAX_CLASSES; c++)
+    {
+        BlobStats &s = stats[c];
+        s.area = 0;
+        s.sumX = s.sumY = 0;
+        s.minX = view.width;
+        s.minY = view.height;
+        s.maxX = s.maxY = -1;
+    }
+}
+
+int classStatsEnd(const ImageView &view, const BlobStats *stats, Blob *results)
+{
+    int found = 0;
+    for (int c = 0; c < COLOR_MAX_CLASSES; c++)
+    {
+        const BlobStats &s = stats[c];
+        Blob &b = results[c];
+        b.area = s.area;
+        if (s.area == 0)
+        {
+            b.left = b.top = b.right = b.bottom = b.cx = b.cy = -1;
+            continue;
+        }
+        found |= 1 << c;
+
+        // Same coordinate convention as detect(), the y axis is flipped
+        b.left = s.minX;
+        b.right = s.maxX;
+        b.top = view.height - s.minY - 1;
+        b.bottom = view.height - s.maxY - 1;
+        b.cx = s.sumX / s.area;
+        b.cy = view.height - s.sumY / s.area - 1;
+    }
+    return found;
+}
+
+// One scan over an image that accumulates the statistics of every class
+static int scanClasses(const ImageView &view, const ClassLut &lut, Blob *results)
+{
+    BlobStats stats[COLOR_MAX_CLASSES];
+    classStatsBegin(view, stats);
+    classRows(view, lut, 0, view.height - 1, stats);
+    return classStatsEnd(view, stats, results);
+}
 
+/**
+ * Detects up to COLOR_MAX_CLASSES color classes in a BMP image in a single
+ * pass. Every pixel gets its class bits from one table lookup, and the
+ * area, box and centroid of each class are accumulated in the same scan.
+ *
+ * @param buf Pointer to the BMP image data
+ * @param buf_len Length of the buffer in bytes
+ * @param lut Class table, see classLutBuild()
+ * @param results Output, one entry per class
+ * @return Bitmask of the classes that were found
+ */
+int detectClasses(
+    uint8_t *buf, int buf_len,
+    const ClassLut &lut,
+    Blob *results)
+{
+    ImageView view;
+    if (!imageFromBMP(buf, buf_len, view))
+    {
+        return 0;
+    }
+    return scanClasses(view, lut, results);
+}
+
+int detectClassesRaw(
+    const uint8_t *buf, int buf_len, int width, int height, FrameFormat format,
+    const ClassLut &lut,
+    Blob *results)
+{
+    ImageView view;
+    if (!imageFromFrame(buf, buf_len, width, height, format, view))
+    {
+        return 0;
+    }
+    return scanClasses(view, lut, results);
+}
+
+void trackBegin(TrackState &track, int maxMisses, int margin)
+{
+    track.maxMisses = maxMisses;
+    track.margin = std::max(margin, 1);
+    track.locked = false;
+    track.misses = 0;
+    track.vx = track.vy = 0;
+    track.scanned = 0;
+    track.framePixels = 0;
+}
+
+static bool trackFrame(
+    const ImageView &view, const ColorLut &lut, TrackState &track,
+    int &left, int &top, int &right, int &bottom)
+{
+    int width = view.width;
+    int height = view.height;
+    int minX, minY, maxX, maxY;
     bool found = false;
+    bool windowed = track.locked && track.misses < track.maxMisses;
 
-    // Scan the entire image to find the bounding rectangle
-    for (int y = 0; y < height; y++)
+    track.scanned = 0;
+    track.framePixels = width * height;
+
+    if (windowed)
     {
-        for (int x = 0; x < width; x++)
+        // Last box moved by the predicted motion, the window widens with
+        // every missed frame
+        int frames = track.misses + 1;
+        int grow = track.margin * frames;
+        int x0 = std::max(0, track.minX + track.vx * frames - grow);
+        int y0 = std::max(0, track.minY + track.vy * frames - grow);
+        int x1 = std::min(width - 1, track.maxX + track.vx * frames + grow);
+        int y1 = std::min(height - 1, track.maxY + track.vy * frames + grow);
+
+        while (x0 <= x1 && y0 <= y1)
         {
-            // Calculate position in BMP data
-            // BMP stores colors as BGR
-            int actualY = isTopDown ? y : (height - 1 - y);
-            int pos = actualY * paddedRowSize + x * 3;
-
-            // Check if pixel meets the color criteria
-            if (pixelData[pos + 2] >= red_level &&   // R component (at offset 2)
-                pixelData[pos + 1] <= green_level && // G component (at offset 1)
-                pixelData[pos] <= blue_level)        // B component (at offset 0)
+            found = scanWindow(view, lut, x0, y0, x1, y1, minX, minY, maxX, maxY);
+            track.scanned += (x1 - x0 + 1) * (y1 - y0 + 1);
+            if (!found)
+            {
+                break;
+            }
+
+            // The object may continue past a window edge it touches, widen
+            // those edges and scan again
+            int stepX = std::max(track.margin, (x1 - x0 + 1) / 2);
+            int stepY = std::max(track.margin, (y1 - y0 + 1) / 2);
+            bool grown = false;
+            if (minX == x0 && x0 > 0)
+            {
+                x0 = std::max(0, x0 - stepX);
+                grown = true;
+            }
+            if (maxX == x1 && x1 < width - 1)
+            {
+                x1 = std::min(width - 1, x1 + stepX);
+                grown = true;
+            }
+            if (minY == y0 && y0 > 0)
+            {
+                y0 = std::max(0, y0 - stepY);
+                grown = true;
+            }
+            if (maxY == y1 && y1 < height - 1)
+            {
+                y1 = std::min(height - 1, y1 + stepY);
+                grown = true;
+            }
+            if (!grown)
             {
-                // Update the bounding rectangle
-                left = std::min(left, x);
-                top = std::min(top, y);
-                right = std::max(right, x);
-                bottom = std::max(bottom, y);
-                found = true;
+                break;
             }
         }
     }
+    else
+    {
+        found = scanWindow(view, lut, 0, 0, width - 1, height - 1, minX, minY, maxX, maxY);
+        track.scanned = width * height;
+    }
 
-    // If no matching pixels found, return false
     if (!found)
     {
+        if (windowed)
+        {
+            track.misses++;
+        }
+        else
+        {
+            track.locked = false; // Lost, keep scanning full frames
+            track.misses = 0;
+        }
         return false;
     }
 
-    // Boundary adjustment
-    if (top < 0)
-        top = 0;
-    if (top >= height)
-        top = height-1;
-    if (bottom < 0)
-        bottom = 0;
-    if (bottom >= height)
-        bottom = height-1;
+    // Motion of the box center per frame
+    if (track.locked)
+    {
+        int frames = track.misses + 1;
+        track.vx = ((minX + maxX) - (track.minX + track.maxX)) / (2 * frames);
+        track.vy = ((minY + maxY) - (track.minY + track.maxY)) / (2 * frames);
+    }
+    else
+    {
+        track.vx = track.vy = 0;
+    }
+    track.locked = true;
+    track.misses = 0;
+    track.minX = minX;
+    track.minY = minY;
+    track.maxX = maxX;
+    track.maxY = maxY;
 
-    // Flip the y axis
-    top = height-top-1;
-    bottom = height-bottom-1;
+    // Flip the y axis to match detect()
+    left = minX;
+    right = maxX;
+    top = height - minY - 1;
+    bottom = height - maxY - 1;
+    return true;
+}
 
-    // Serial.printf("(%d, %d) (%d, %d)\r\n", left, top, right, bottom);
+/**
+ * Tracking search. Once the object is found only a window around its last
+ * box, moved by the motion between the previous frames, is scanned. Pixels
+ * outside the window are not seen, so the box only matches detectLut()
+ * while all matching pixels lie in it. After track.maxMisses frames without
+ * the object the whole frame is scanned again. track.scanned tells how many
+ * pixels the frame cost.
+ *
+ * @param buf Pointer to the BMP image data
+ * @param buf_len Length of the buffer in bytes
+ * @param lut Color classification table, see colorLutBuild()
+ * @param track Tracking state, see trackBegin()
+ * @param left Output parameter for the left coordinate of detected rectangle
+ * @param top Output parameter for the top coordinate of detected rectangle
+ * @param right Output parameter for the right coordinate of detected rectangle
+ * @param bottom Output parameter for the bottom coordinate of detected rectangle
+ * @return true if detection successful, false otherwise
+ */
+bool detectTrack(
+    uint8_t *buf, int buf_len, const ColorLut &lut, TrackState &track,
+    int &left, int &top, int &right, int &bottom)
+{
+    ImageView view;
+    if (!imageFromBMP(buf, buf_len, view))
+    {
+        return false;
+    }
+    return trackFrame(view, lut, track, left, top, right, bottom);
+}
 
+bool detectTrackRaw(
+    const uint8_t *buf, int buf_len, int width, int height, FrameFormat format,
+    const ColorLut &lut, TrackState &track,
+    int &left, int &top, int &right, int &bottom)
+{
+    ImageView view;
+    if (!imageFromFrame(buf, buf_len, width, height, format, view))
+    {
+        return false;
+    }
+    return trackFrame(view, lut, track, left, top, right, bottom);
+}
+
+// Sample distance of the coarse pass of detectPyramid()
+#define PYRAMID_STEP 4
+
+static bool pyramidFrame(
+    const ImageView &view, const ColorLut &lut,
+    int &left, int &top, int &right, int &bottom)
+{
+    int width = view.width;
+    int height = view.height;
+
+    // Coarse pass over every PYRAMID_STEP-th pixel of every PYRAMID_STEP-th row
+    int minX, minY, maxX, maxY;
+    if (!runKernel<BoundsKernel>(
+            view, lut, 0, 0, width - 1, height - 1, PYRAMID_STEP,
+            minX, minY, maxX, maxY))
+    {
+        return false;
+    }
+
+    // The real edges lie less than a step outside the coarse box. Scan the
+    // bands between the coarse box and the box grown by a step at full
+    // resolution, the inside of the coarse box cannot move an edge.
+    int x0 = std::max(0, minX - (PYRAMID_STEP - 1));
+    int y0 = std::max(0, minY - (PYRAMID_STEP - 1));
+    int x1 = std::min(width - 1, maxX + PYRAMID_STEP - 1);
+    int y1 = std::min(height - 1, maxY + PYRAMID_STEP - 1);
+    const int bands[4][4] = {
+        {x0, y0, minX - 1, y1},     // Left
+        {maxX + 1, y0, x1, y1},     // Right
+        {minX, y0, maxX, minY - 1}, // Top
+        {minX, maxY + 1, maxX, y1}, // Bottom
+    };
+    int boxX0 = minX, boxY0 = minY, boxX1 = maxX, boxY1 = maxY;
+    for (int i = 0; i < 4; i++)
+    {
+        int bx0, by0, bx1, by1;
+        if (scanWindow(
+                view, lut,
+                bands[i][0], bands[i][1], bands[i][2], bands[i][3],
+                bx0, by0, bx1, by1))
+        {
+            boxX0 = std::min(boxX0, bx0);
+            boxY0 = std::min(boxY0, by0);
+            boxX1 = std::max(boxX1, bx1);
+            boxY1 = std::max(boxY1, by1);
+        }
+    }
+
+    // Flip the y axis to match detect()
+    left = boxX0;
+    right = boxX1;
+    top = height - boxY0 - 1;
+    bottom = height - boxY1 - 1;
     return true;
-}
\ No newline at end of file
+}
+
+/**
+ * Coarse to fine detection. A first pass looks at every 4th pixel of every
+ * 4th row, 1/16 of the frame. Only the bands just outside the coarse box are
+ * then scanned at full resolution to find the exact edges. Frames without
+ * the object or with one compact object cost a fraction of detectLut().
+ *
+ * Objects, or parts of them, smaller than 4x4 pixels can fall between the
+ * samples of the first pass and are not seen.
+ *
+ * @param buf Pointer to the BMP image data
+ * @param buf_len Length of the buffer in bytes
+ * @param lut Color classification table, see colorLutBuild()
+ * @param left Output parameter for the left coordinate of detected rectangle
+ * @param top Output parameter for the top coordinate of detected rectangle
+ * @param right Output parameter for the right coordinate of detected rectangle
+ * @param bottom Output parameter for the bottom coordinate of detected rectangle
+ * @return true if detection successful, false otherwise
+ */
+bool detectPyramid(
+    uint8_t *buf, int buf_len, const ColorLut &lut,
+    int &left, int &top, int &right, int &bottom)
+{
+    ImageView view;
+    if (!imageFromBMP(buf, buf_len, view))
+    {
+        return false;
+    }
+    return pyramidFrame(view, lut, left, top, right, bottom);
+}
+
+bool detectPyramidRaw(
+    const uint8_t *buf, int buf_len, int width, int height, FrameFormat format,
+    const ColorLut &lut,
+    int &left, int &top, int &right, int &bottom)
+{
+    ImageView view;
+    if (!imageFromFrame(buf, buf_len, width, height, format, view))
+    {
+        return false;
+    }
+    return pyramidFrame(view, lut, left, top, right, bottom);
+}
+
+// Threshold an image into a bit-packed mask
+static bool maskImage(const ImageView &view, const ColorLut &lut, BitMask &mask)
+{
+    if (!maskBegin(mask, view.width, view.height))
+    {
+        return false; // Frame too large for a mask
+    }
+    return runKernel<MaskKernel>(view, lut, mask);
+}
+
+/**
+ * Threshold a BMP image into a mask with 1 bit per pixel, using a color
+ * classification table. The mask can then be cleaned up with
+ * maskOpen() before maskBounds() or maskBlobs() look at it.
+ *
+ * @return false if the BMP is invalid or does not fit in a mask
+ */
+bool thresholdMask(
+    uint8_t *buf, int buf_len,
+    const ColorLut &lut,
+    BitMask &mask)
+{
+    ImageView view;
+    if (!imageFromBMP(buf, buf_len, view))
+    {
+        return false;
+    }
+    return maskImage(view, lut, mask);
+}
+
+bool thresholdMaskRaw(
+    const uint8_t *buf, int buf_len, int width, int height, FrameFormat format,
+    const ColorLut &lut,
+    BitMask &mask)
+{
+    ImageView view;
+    if (!imageFromFrame(buf, buf_len, width, height, format, view))
+    {
+        return false;
+    }
+    return maskImage(view, lut, mask);
+}
@@ -0,0 +1,372 @@
+#ifndef DETECT_H
+#define DETECT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "jpeg.h"
+
+// Pixel layouts the detection can scan. BGR888 is the layout of the BMP
+// pixel data, the others can be thresholded without a BMP conversion.
+enum FrameFormat
+{
+    FRAME_RGB565, // 2 bytes per pixel, big-endian as delivered by the sensor
+    FRAME_YUV422, // Y0 U Y1 V, 4 bytes per 2 pixels
+    FRAME_BGR888, // 3 bytes per pixel
+    FRAME_GRAY8   // 1 byte per pixel, luma only
+};
+
+// Pixels of an image in one of the layouts above. Headers are parsed once
+// into a view, see imageFromBMP() and imageFromFrame().
+struct ImageView
+{
+    const uint8_t *pixels; // First byte of the pixel data
+    int width, height;
+    int stride;            // Bytes from one row to the next
+    FrameFormat format;
+    bool bottomUp;         // Rows stored bottom row first, as in a BMP
+};
+
+bool imageFromBMP(const uint8_t *buf, int buf_len, ImageView &view);
+bool imageFromFrame(
+    const uint8_t *buf, int buf_len, int width, int height, FrameFormat format,
+    ImageView &view);
+
+// How the handlers look for the object in a frame
+enum DetectMode
+{
+    DETECT_FULL,    // Threshold every pixel
+    DETECT_JPEG_DC, // Threshold the 8x8 block averages of a JPEG frame
+    DETECT_BLOBS,   // Label connected areas and report the largest one
+    DETECT_TRACK,   // Search a window around the previous detection
+    DETECT_PYRAMID  // Sample every 4th pixel, then refine the box edges
+};
+
+// Limits of the connected component labeler, see blob.cpp
+#define BLOB_MAX_LABELS 512 // Provisional labels per frame
+#define BLOB_MAX_RUNS 256   // Runs of matching pixels per row
+#define BLOB_MAX_BLOBS 8    // Blobs reported per frame
+
+// A connected area of matching pixels. The box uses the same coordinate
+// convention as detect().
+struct Blob
+{
+    int area; // In pixels
+    int left, top, right, bottom;
+    int cx, cy; // Centroid
+};
+
+struct BlobRun
+{
+    int16_t x0, x1;
+    uint16_t label;
+};
+
+struct BlobStats
+{
+    int32_t area;
+    int32_t sumX, sumY;
+    int16_t minX, minY, maxX, maxY;
+};
+
+// Preallocated labeler state, no heap is used per frame
+struct BlobLabeler
+{
+    int width, height;
+    int row;               // Row of the runs in runs[cur]
+    int cur;               // Current run buffer, the other one holds the previous row
+    BlobRun runs[2][BLOB_MAX_RUNS];
+    int nruns[2];
+    int cursor;            // First run of the previous row that can still overlap
+    int nlabels;
+    bool overflow;         // Runs were dropped because a table was full
+    uint16_t parent[BLOB_MAX_LABELS];
+    BlobStats stats[BLOB_MAX_LABELS];
+    int firstRow;          // First row with runs, -1 before the first run
+    int nfirst;
+    BlobRun first[BLOB_MAX_RUNS]; // Runs of firstRow, see blobMerge()
+};
+
+// Labeler used by detectBlobs(), for callers on the same task
+extern BlobLabeler blobLabeler;
+
+// Feed runs of matching pixels in raster order (y ascending, then x0
+// ascending, with y counted from the top of the image) between blobBegin()
+// and blobEnd(). blobEnd() returns the number of blobs written, largest first.
+void blobBegin(BlobLabeler &lab, int width, int height);
+void blobRun(BlobLabeler &lab, int y, int x0, int x1);
+int blobEnd(BlobLabeler &lab, Blob *blobs, int maxBlobs, int minArea);
+
+// Join a labeler that was fed the rows directly below the rows of lab, as
+// when a frame is labeled in two bands. Areas crossing the seam become one
+// blob. Call before blobEnd(lab), below is not changed.
+void blobMerge(BlobLabeler &lab, const BlobLabeler &below);
+
+// Add the area, sums and box of one set of statistics to another
+void blobStatsMerge(BlobStats &to, const BlobStats &from);
+
+// Color classification table. Each table is a bitset with one bit per
+// quantized color, so testing a pixel is a single indexed load. rgb is
+// indexed by the RGB565 value (5-6-5 bits), yuv by 6 bits Y, 5 bits U and
+// 5 bits V. Both take 8 KB. BGR888 pixels are looked up by their RGB565
+// color, so for them a level only takes effect in steps of 8 (red, blue)
+// or 4 (green); detect() compares the full 8 bits.
+struct ColorLut
+{
+    uint32_t rgb[2048];
+    uint32_t yuv[2048];
+};
+
+// Color test used to fill a ColorLut, r g b in 0..255
+typedef bool (*ColorClassifier)(int r, int g, int b, void *ctx);
+
+// Fill both tables by evaluating match once for every cell. Any color
+// region can be described, not only the level box of detect().
+void colorLutBuild(ColorLut &lut, ColorClassifier match, void *ctx);
+
+// Table for the criteria of detect(): red >= red_level, green <= green_level
+// and blue <= blue_level.
+void colorLutBuildLevels(ColorLut &lut, int red_level, int green_level, int blue_level);
+
+// Table index of a pixel in each of the supported layouts
+static inline int colorIndexRGB565(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1]; // Big-endian
+}
+
+static inline int colorIndexBGR(const uint8_t *p)
+{
+    return ((p[2] & 0xF8) << 8) | ((p[1] & 0xFC) << 3) | (p[0] >> 3);
+}
+
+static inline int colorIndexYUV(int y, int u, int v)
+{
+    return ((y & 0xFC) << 8) | ((u & 0xF8) << 2) | (v >> 3);
+}
+
+static inline bool colorLutTest(const uint32_t *table, int index)
+{
+    return (table[index >> 5] >> (index & 31)) & 1;
+}
+
+// Pixel tests for the supported layouts
+static inline bool colorLutRGB565(const ColorLut &lut, const uint8_t *p)
+{
+    return colorLutTest(lut.rgb, colorIndexRGB565(p));
+}
+
+static inline bool colorLutBGR(const ColorLut &lut, const uint8_t *p)
+{
+    return colorLutTest(lut.rgb, colorIndexBGR(p));
+}
+
+static inline bool colorLutYUV(const ColorLut &lut, int y, int u, int v)
+{
+    return colorLutTest(lut.yuv, colorIndexYUV(y, u, v));
+}
+
+// Up to 8 color classes are detected in one pass, see detectClasses()
+#define COLOR_MAX_CLASSES 8
+
+// Color range of one class, every channel has to lie within [min..max]
+struct ColorClass
+{
+    bool enabled;
+    uint8_t rmin, rmax;
+    uint8_t gmin, gmax;
+    uint8_t bmin, bmax;
+};
+
+// Class table with one byte per color, bit c is set when the color belongs
+// to class c. Indexed like ColorLut, 128 KB so it belongs in PSRAM.
+struct ClassLut
+{
+    uint8_t rgb[65536];
+    uint8_t yuv[65536];
+};
+
+void classLutBuild(ClassLut &lut, const ColorClass *classes, int count);
+
+// Function that does the actual detecting of the red object in a BMP. Returns true if detection.
+bool detect(
+    uint8_t *buf, int buf_len,
+    int red_level, int green_level, int blue_level,
+    int &left, int &top, int &right, int &bottom);
+
+// Same as detect() on an image view with the color criteria in a table
+bool detectImage(
+    const ImageView &view, const ColorLut &lut,
+    int &left, int &top, int &right, int &bottom);
+
+// Same as detect() with the color criteria in a table
+bool detectLut(
+    uint8_t *buf, int buf_len, const ColorLut &lut,
+    int &left, int &top, int &right, int &bottom);
+
+// State of the tracking search, see detectTrack(). Boxes are kept with
+// rows counted from the top of the frame.
+struct TrackState
+{
+    int maxMisses;   // Frames searched in the window before a full frame scan
+    int margin;      // Pixels added around the predicted box
+    bool locked;     // The box below holds a detection
+    int misses;      // Frames since the last detection
+    int minX, minY, maxX, maxY;
+    int vx, vy;      // Motion of the box per frame
+    int scanned;     // Pixels scanned for the last frame
+    int framePixels; // Pixels of a full frame
+};
+
+void trackBegin(TrackState &track, int maxMisses, int margin);
+
+// Tracking version of detectLut(), same output convention
+bool detectTrack(
+    uint8_t *buf, int buf_len, const ColorLut &lut, TrackState &track,
+    int &left, int &top, int &right, int &bottom);
+
+// Same as detectTrack() but directly on a raw camera frame buffer.
+bool detectTrackRaw(
+    const uint8_t *buf, int buf_len, int width, int height, FrameFormat format,
+    const ColorLut &lut, TrackState &track,
+    int &left, int &top, int &right, int &bottom);
+
+// Coarse to fine version of detectLut(), see detect.cpp
+bool detectPyramid(
+    uint8_t *buf, int buf_len, const ColorLut &lut,
+    int &left, int &top, int &right, int &bottom);
+
+// Same as detectPyramid() but directly on a raw camera frame buffer.
+bool detectPyramidRaw(
+    const uint8_t *buf, int buf_len, int width, int height, FrameFormat format,
+    const ColorLut &lut,
+    int &left, int &top, int &right, int &bottom);
+
+// Same as detect() but directly on a raw camera frame buffer.
+bool detectRaw(
+    const uint8_t *buf, int buf_len, int width, int height, FrameFormat format,
+    const ColorLut &lut,
+    int &left, int &top, int &right, int &bottom);
+
+// Largest block grid the JPEG DC detector handles (VGA)
+#define JPEG_DC_MAX_COLS 80
+#define JPEG_DC_MAX_ROWS 60
+
+// Parser state and block map of detectJpegDC(), about 16 KB, too large for
+// a task stack. Each task that detects on JPEG frames needs its own.
+struct JpegDCState
+{
+    JpegImage img;
+    JpegScan scan;
+    uint16_t map[JPEG_DC_MAX_ROWS * JPEG_DC_MAX_COLS]; // Average color of every 8x8 block as RGB565
+    int16_t coef[JPEG_MAX_BLOCKS_PER_MCU][64];
+    uint8_t samples[JPEG_MAX_BLOCKS_PER_MCU][64];
+};
+
+// Detection on the DC coefficients of a JPEG frame, see detect.cpp
+bool detectJpegDC(
+    const uint8_t *buf, int buf_len,
+    const ColorLut &lut, bool refine, JpegDCState &state,
+    int &left, int &top, int &right, int &bottom);
+
+// Label all areas matching the color criteria in a BMP, largest first
+int detectBlobs(
+    uint8_t *buf, int buf_len,
+    const ColorLut &lut,
+    Blob *blobs, int maxBlobs, int minArea);
+
+// Same as detectBlobs() but directly on a raw camera frame buffer.
+int detectBlobsRaw(
+    const uint8_t *buf, int buf_len, int width, int height, FrameFormat format,
+    const ColorLut &lut,
+    Blob *blobs, int maxBlobs, int minArea);
+
+// Statistics of every color class in one scan of a BMP. results must hold
+// COLOR_MAX_CLASSES entries, a class that was not found gets area 0.
+// Returns a bitmask of the classes found.
+int detectClasses(
+    uint8_t *buf, int buf_len,
+    const ClassLut &lut,
+    Blob *results);
+
+// Same as detectClasses() but directly on a raw camera frame buffer.
+int detectClassesRaw(
+    const uint8_t *buf, int buf_len, int width, int height, FrameFormat format,
+    const ClassLut &lut,
+    Blob *results);
+
+// Largest frame a bit-packed mask holds (QVGA), see mask.cpp
+#define MASK_MAX_WIDTH 320
+#define MASK_MAX_HEIGHT 240
+
+// Threshold result with 1 bit per pixel, rows top-down
+struct BitMask
+{
+    int width, height;
+    int stride; // 32 bit words per row
+    uint32_t bits[MASK_MAX_HEIGHT * MASK_MAX_WIDTH / 32];
+};
+
+// Set the size of a mask, false if it does not fit
+bool maskBegin(BitMask &mask, int width, int height);
+
+// 3x3 morphology on a mask, tmp is scratch space of the same size
+void maskErode(BitMask &mask, BitMask &tmp);
+void maskDilate(BitMask &mask, BitMask &tmp);
+void maskOpen(BitMask &mask, BitMask &tmp);
+
+// Box around all set pixels, same coordinate convention as detect()
+bool maskBounds(const BitMask &mask, int &left, int &top, int &right, int &bottom);
+
+// Label the set pixels of a mask, see detectBlobs()
+int maskBlobs(const BitMask &mask, BlobLabeler &lab, Blob *blobs, int maxBlobs, int minArea);
+
+// Threshold a BMP or a raw camera frame into a mask
+bool thresholdMask(
+    uint8_t *buf, int buf_len,
+    const ColorLut &lut,
+    BitMask &mask);
+
+bool thresholdMaskRaw(
+    const uint8_t *buf, int buf_len, int width, int height, FrameFormat format,
+    const ColorLut &lut,
+    BitMask &mask);
+
+// Band kernels, rows y0 up to and including y1 counted from the top. These
+// let a frame be scanned in parts, see split.cpp.
+bool detectRows(
+    const ImageView &view, const ColorLut &lut, int y0, int y1,
+    int &minX, int &minY, int &maxX, int &maxY);
+void labelRows(const ImageView &view, const ColorLut &lut, int y0, int y1, BlobLabeler &lab);
+void classRows(const ImageView &view, const ClassLut &lut, int y0, int y1, BlobStats *stats);
+
+// Empty statistics for COLOR_MAX_CLASSES classes before classRows(), and
+// the results of detectClasses() from them afterwards
+void classStatsBegin(const ImageView &view, BlobStats *stats);
+int classStatsEnd(const ImageView &view, const BlobStats *stats, Blob *results);
+
+// Two-core detection, see split.cpp. The top half of the frame is scanned
+// by the calling task and the bottom half by a worker task pinned to the
+// other core. splitBegin() starts the workers; without them, or while the
+// workers are busy with another frame, both halves are scanned by the
+// caller. The results are the same as those of the single-core detectors.
+bool splitBegin();
+bool detectSplit(
+    const ImageView &view, const ColorLut &lut,
+    int &left, int &top, int &right, int &bottom);
+int detectBlobsSplit(
+    const ImageView &view, const ColorLut &lut,
+    Blob *blobs, int maxBlobs, int minArea);
+int detectClassesSplit(const ImageView &view, const ClassLut &lut, Blob *results);
+
+bool getCalibration(
+    uint8_t *buf, int buf_len,
+    int &red_level, int &green_level, int &blue_level);
+
+bool getCalibrationRaw(
+    const uint8_t *buf, int buf_len, int width, int height, FrameFormat format,
+    int &red_level, int &green_level, int &blue_level);
+
+// Draw the border of a rectangle in detect() coordinates on a 24-bit BMP,
+// 0 on success, see draw.cpp for the error codes
+int drawRect(uint8_t *bmpData, size_t len, int left, int top, int right, int bottom);
+
+#endif
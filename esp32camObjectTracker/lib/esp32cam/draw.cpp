@@ -0,0 +1,106 @@
+#include <Arduino.h>
+#include "detect.h"
+
+// Paint one BMP pixel green (BMP uses BGR, not RGB)
+static inline void drawPixel(uint8_t *p)
+{
+    p[0] = 0;   // Blue component
+    p[1] = 255; // Green component
+    p[2] = 0;   // Red component
+}
+
+/**
+ * Draw a rectangle on a BMP image
+ *
+ * @param bmpData Pointer to the BMP image data
+ * @param len Size of the BMP data in bytes
+ * @param left X-coordinate of the left edge of the rectangle (in pixels)
+ * @param top Y-coordinate of the top edge of the rectangle (in pixels)
+ * @param right X-coordinate of the right edge of the rectangle (in pixels)
+ * @param bottom Y-coordinate of the bottom edge of the rectangle (in pixels)
+ * @return Error codes:
+ * 0: Success
+ * 1: Invalid BMP signature
+ * 2: Not a complete 24-bit BMP
+ * 3: Rectangle out of bounds
+ * 4: Insufficient data length
+ * 5: Null pointer provided
+ */
+int drawRect(uint8_t *bmpData, size_t len, int left, int top, int right, int bottom)
+{
+    // Check for null pointer
+    if (bmpData == NULL)
+    {
+        return 5; // Null pointer provided
+    }
+
+    // Check if we have enough data for the header
+    if (len < 54)
+    {
+        return 4; // Insufficient data length
+    }
+
+    // Check if we have a valid BMP file (should start with "BM")
+    if (bmpData[0] != 'B' || bmpData[1] != 'M')
+    {
+        return 1; // Invalid BMP signature
+    }
+
+    // Parse the header once into a view of the pixel data
+    ImageView view;
+    if (!imageFromBMP(bmpData, len, view))
+    {
+        return 2; // Only complete 24-bit BMPs are supported
+    }
+    int width = view.width;
+    int height = view.height;
+    // Serial.printf("draw width = %d, height= %d\r\n", width, height);
+
+    // Make sure the rectangle coordinates are valid
+    if (left > right)
+    {
+        int temp = left;
+        left = right;
+        right = temp;
+    }
+
+    if (top > bottom)
+    {
+        int temp = top;
+        top = bottom;
+        bottom = temp;
+    }
+
+    // Make sure the rectangle fits within the image boundaries
+    if (left < 0 || top < 0 || right >= width || bottom >= height)
+    {
+        Serial.printf(
+            "left:%d top: %d right:%d width:%d bottom:%d height:%d\r\n",
+            left, top, right, width, bottom, height
+        );
+        return 3; // Rectangle would be outside image boundaries
+    }
+
+    // Draw the rectangle (only the border). The y axis is flipped as in
+    // detect(), y counts rows from the bottom of the image.
+    uint8_t *pixels = bmpData + (view.pixels - bmpData);
+    for (int y = top; y <= bottom; y++)
+    {
+        int row = view.bottomUp ? y : height - y - 1;
+        uint8_t *line = pixels + row * view.stride;
+        if (y == top || y == bottom)
+        {
+            for (int x = left; x <= right; x++)
+            {
+                drawPixel(line + x * 3);
+            }
+        }
+        else
+        {
+            drawPixel(line + left * 3);
+            drawPixel(line + right * 3);
+        }
+    }
+
+    return 0; // Success
+}
@@ -6,6 +6,7 @@
 
 extern void setupLedFlash(int pin);
 extern void startCameraServer();
+extern bool startVisionTask();
 
 // Function that does the actual detecting of the red object. Returns true if detection.
 extern bool detect(
@@ -13,7 +14,20 @@ extern bool detect(
     int red_level, int green_level, int blue_level,
     int &left, int &top, int &right, int &bottom);
 
-static void setup_camera()
+// Pixel format the sensor delivers. With PIXFORMAT_JPEG every detection
+// needs a frame2bmp() round-trip, with PIXFORMAT_RGB565 or PIXFORMAT_YUV422
+// the detection runs directly on the frame buffer.
+#define DETECT_PIXFORMAT PIXFORMAT_JPEG
+// #define DETECT_PIXFORMAT PIXFORMAT_RGB565
+// #define DETECT_PIXFORMAT PIXFORMAT_YUV422
+// #define DETECT_PIXFORMAT PIXFORMAT_GRAYSCALE
+
+// Frame size the sensor delivers. The 'Pyramid' detect mode scans a QVGA
+// frame in less time than a full QQVGA scan.
+#define DETECT_FRAMESIZE FRAMESIZE_QQVGA
+// #define DETECT_FRAMESIZE FRAMESIZE_QVGA
+
+static void setup_camera(pixformat_t pixel_format, framesize_t frame_size)
 {
     Serial.println("Initializing camera");
 
@@ -40,23 +54,19 @@ static void setup_camera()
 
     //    config.frame_size = FRAMESIZE_UXGA;
     //    config.frame_size = FRAMESIZE_HQVGA;
-    config.frame_size = FRAMESIZE_QQVGA;
-    config.pixel_format = PIXFORMAT_JPEG;
-    //    config.pixel_format = PIXFORMAT_YUV422;
-    // config.pixel_format = PIXFORMAT_RGB565;
-    config.grab_mode = CAMERA_GRAB_WHEN_EMPTY;
-    // config.grab_mode = CAMERA_GRAB_LATEST;
-
-    // config.fb_location = CAMERA_FB_IN_PSRAM;
-    config.fb_location = CAMERA_FB_IN_DRAM;
-
-    config.jpeg_quality = 63; // low jpeg quality
-    config.fb_count = 1;
-    config.frame_size = FRAMESIZE_QQVGA;
+    config.frame_size = frame_size;
+    config.pixel_format = pixel_format;
     config.jpeg_quality = 10;
-    config.fb_count = 2;
     config.grab_mode = CAMERA_GRAB_LATEST;
-    config.fb_location = CAMERA_FB_IN_DRAM;
+
+    // One buffer per frame in flight in the vision pipeline, see
+    // VISION_PIPELINE_DEPTH in app_httpd.cpp. The pipeline can be switched
+    // on at any time with /control, but the driver allocates its buffers
+    // only here, so the count cannot follow the setting. Without the
+    // pipeline the spare buffers let the sensor fill the next frame while
+    // one is detected. Three frames do not fit in the scarce DRAM.
+    config.fb_count = 3;
+    config.fb_location = CAMERA_FB_IN_PSRAM;
 
     // camera init
     esp_err_t err = esp_camera_init(&config);
@@ -74,20 +84,25 @@ static void setup_camera()
     s->set_whitebal(s, false); // Disable awb for better color detection
 
     s->set_saturation(s, 2); // Saturation to max for better colors
-    s->set_quality(s, 63);   // Low quality, no need for a lot of pixels
+    if (pixel_format == PIXFORMAT_JPEG)
+    {
+        s->set_quality(s, 63); // Low quality, no need for a lot of pixels
+    }
     Serial.printf("Camera initialized\r\n");
 }
 
 // Main esp32cam initialisation with webserver task for camera
-// configuration.
+// configuration and the vision task that detects on every frame.
 void esp32cam_setup()
 {
     Serial.println("esp32cam_setup");
-    setup_camera();
+    setup_camera(DETECT_PIXFORMAT, DETECT_FRAMESIZE);
 
     // For LED flash pwm
     ledcSetup(0, 5000, 8);
     ledcAttachPin(4, 0);
 
+    // The handlers use the queues and settings of the vision task
+    startVisionTask();
     startCameraServer();
 }
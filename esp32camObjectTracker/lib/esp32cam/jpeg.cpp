@@ -0,0 +1,540 @@
+#include <string.h>
+#include "jpeg.h"
+
+// Position in natural (row major) order of each zigzag index
+const uint8_t jpegZigzag[64] = {
+    0, 1, 8, 16, 9, 2, 3, 10,
+    17, 24, 32, 25, 18, 11, 4, 5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63};
+
+static inline int read16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+// Build the canonical decoding tables from the DHT code length counts
+static bool buildHuffTable(JpegHuffTable &t, const uint8_t *counts, const uint8_t *symbols, int nsymbols)
+{
+    memset(&t, 0, sizeof(t));
+    memcpy(t.vals, symbols, nsymbols);
+
+    int code = 0;
+    int k = 0;
+    for (int len = 1; len <= 16; len++)
+    {
+        t.valptr[len] = k;
+        t.mincode[len] = code;
+        code += counts[len - 1];
+        k += counts[len - 1];
+        t.maxcode[len] = counts[len - 1] ? code - 1 : -1;
+        if (code > (1 << len))
+        {
+            return false; // Over-subscribed code
+        }
+        code <<= 1;
+    }
+    t.maxcode[17] = 0x7FFFFFFF; // Sentinel
+
+    // Lookahead table for codes of up to 8 bits
+    k = 0;
+    code = 0;
+    for (int len = 1; len <= 8; len++)
+    {
+        for (int i = 0; i < counts[len - 1]; i++, k++, code++)
+        {
+            int shift = 8 - len;
+            for (int fill = 0; fill < (1 << shift); fill++)
+            {
+                t.look[(code << shift) | fill] = len;
+                t.lookSym[(code << shift) | fill] = symbols[k];
+            }
+        }
+        code <<= 1;
+    }
+
+    t.present = true;
+    return true;
+}
+
+bool jpegParse(const uint8_t *buf, size_t len, JpegImage &img)
+{
+    memset(&img, 0, sizeof(img));
+
+    if (buf == NULL || len < 4 || buf[0] != 0xFF || buf[1] != 0xD8)
+    {
+        return false; // No SOI marker
+    }
+
+    const uint8_t *p = buf + 2;
+    const uint8_t *end = buf + len;
+    bool haveFrame = false;
+
+    while (p + 4 <= end)
+    {
+        if (p[0] != 0xFF)
+        {
+            return false;
+        }
+        uint8_t marker = p[1];
+        if (marker == 0xFF)
+        {
+            p++; // Fill byte
+            continue;
+        }
+        int segLen = read16(p + 2);
+        const uint8_t *seg = p + 4;
+        const uint8_t *segEnd = p + 2 + segLen;
+        if (segLen < 2 || segEnd > end)
+        {
+            return false;
+        }
+        int segSize = segLen - 2; // Bytes after the length field
+
+        switch (marker)
+        {
+        case 0xDB: // DQT
+            while (seg < segEnd)
+            {
+                int pq = seg[0] >> 4;
+                int tq = seg[0] & 0x0F;
+                seg++;
+                if (tq > 3 || seg + (pq ? 128 : 64) > segEnd)
+                {
+                    return false;
+                }
+                for (int i = 0; i < 64; i++)
+                {
+                    img.qt[tq][jpegZigzag[i]] = pq ? read16(seg + i * 2) : seg[i];
+                }
+                seg += pq ? 128 : 64;
+            }
+            break;
+
+        case 0xC4: // DHT
+            while (seg + 17 <= segEnd)
+            {
+                int tc = seg[0] >> 4;
+                int th = seg[0] & 0x0F;
+                const uint8_t *counts = seg + 1;
+                int nsymbols = 0;
+                for (int i = 0; i < 16; i++)
+                {
+                    nsymbols += counts[i];
+                }
+                if (tc > 1 || th > 1 || nsymbols > 256 || seg + 17 + nsymbols > segEnd)
+                {
+                    return false;
+                }
+                JpegHuffTable &t = tc ? img.ac[th] : img.dc[th];
+                if (!buildHuffTable(t, counts, seg + 17, nsymbols))
+                {
+                    return false;
+                }
+                seg += 17 + nsymbols;
+            }
+            break;
+
+        case 0xDD: // DRI
+            if (segSize < 2)
+            {
+                return false;
+            }
+            img.restartInterval = read16(seg);
+            break;
+
+        case 0xC0: // SOF0, baseline
+        case 0xC1: // SOF1, extended sequential with huffman coding
+        {
+            if (segSize < 6 || seg[0] != 8)
+            {
+                return false; // Truncated, or not 8 bit samples
+            }
+            img.height = read16(seg + 1);
+            img.width = read16(seg + 3);
+            img.ncomp = seg[5];
+            if (img.ncomp < 1 || img.ncomp > JPEG_MAX_COMPONENTS || img.width <= 0 || img.height <= 0 ||
+                segSize < 6 + img.ncomp * 3)
+            {
+                return false;
+            }
+            img.blocksPerMcu = 0;
+            for (int i = 0; i < img.ncomp; i++)
+            {
+                JpegComponent &c = img.comp[i];
+                c.id = seg[6 + i * 3];
+                c.h = seg[7 + i * 3] >> 4;
+                c.v = seg[7 + i * 3] & 0x0F;
+                c.tq = seg[8 + i * 3] & 0x03;
+                if (c.h < 1 || c.h > 2 || c.v < 1 || c.v > 2)
+                {
+                    return false; // Only the usual 4:4:4, 4:2:2 and 4:2:0
+                }
+                img.hmax = c.h > img.hmax ? c.h : img.hmax;
+                img.vmax = c.v > img.vmax ? c.v : img.vmax;
+                img.blocksPerMcu += c.h * c.v;
+            }
+            if (img.ncomp == 1)
+            {
+                // A single component scan is not interleaved, every MCU is one block
+                img.comp[0].h = img.comp[0].v = 1;
+                img.hmax = img.vmax = 1;
+                img.blocksPerMcu = 1;
+            }
+            if (img.blocksPerMcu > JPEG_MAX_BLOCKS_PER_MCU)
+            {
+                return false;
+            }
+            img.mcuWidth = img.hmax * 8;
+            img.mcuHeight = img.vmax * 8;
+            img.mcusX = (img.width + img.mcuWidth - 1) / img.mcuWidth;
+            img.mcusY = (img.height + img.mcuHeight - 1) / img.mcuHeight;
+            haveFrame = true;
+            break;
+        }
+
+        case 0xC2: // Progressive and other frame types are not supported
+        case 0xC3:
+        case 0xC5:
+        case 0xC6:
+        case 0xC7:
+        case 0xC9:
+        case 0xCA:
+        case 0xCB:
+        case 0xCD:
+        case 0xCE:
+        case 0xCF:
+            return false;
+
+        case 0xDA: // SOS
+        {
+            if (!haveFrame || segSize < 1 || seg[0] != img.ncomp)
+            {
+                return false; // Only a single interleaved scan
+            }
+            if (segSize < 1 + img.ncomp * 2 + 3)
+            {
+                return false; // Truncated component list or spectral selection
+            }
+            for (int i = 0; i < img.ncomp; i++)
+            {
+                uint8_t id = seg[1 + i * 2];
+                uint8_t tables = seg[2 + i * 2];
+                if (img.comp[i].id != id)
+                {
+                    return false;
+                }
+                img.comp[i].td = (tables >> 4) & 0x01;
+                img.comp[i].ta = tables & 0x01;
+                if (!img.dc[img.comp[i].td].present || !img.ac[img.comp[i].ta].present)
+                {
+                    return false;
+                }
+            }
+            img.scan = segEnd;
+            img.end = end;
+            return true;
+        }
+
+        default: // APPn, COM and friends
+            break;
+        }
+        p = segEnd;
+    }
+    return false;
+}
+
+static void fillBits(JpegBitReader &br)
+{
+    while (br.bits <= 24)
+    {
+        uint32_t byte = 0;
+        if (!br.marker && br.p < br.end)
+        {
+            byte = *br.p;
+            if (byte == 0xFF)
+            {
+                uint8_t next = br.p + 1 < br.end ? br.p[1] : 0xD9;
+                if (next == 0x00)
+                {
+                    br.p += 2; // Stuffed zero byte
+                }
+                else
+                {
+                    br.marker = true; // Leave the marker for jpegScanMcu()
+                    byte = 0;
+                }
+            }
+            else
+            {
+                br.p++;
+            }
+        }
+        br.acc |= byte << (24 - br.bits);
+        br.bits += 8;
+    }
+}
+
+static inline int getBits(JpegBitReader &br, int n)
+{
+    if (n == 0)
+    {
+        return 0;
+    }
+    if (br.bits < n)
+    {
+        fillBits(br);
+    }
+    int v = br.acc >> (32 - n);
+    br.acc <<= n;
+    br.bits -= n;
+    return v;
+}
+
+// Sign extend an n bit magnitude category value
+static inline int extend(int v, int n)
+{
+    return v < (1 << (n - 1)) ? v - (1 << n) + 1 : v;
+}
+
+static int decodeSymbol(JpegBitReader &br, const JpegHuffTable &t)
+{
+    if (br.bits < 16)
+    {
+        fillBits(br);
+    }
+    int peek = br.acc >> 24;
+    int len = t.look[peek];
+    if (len)
+    {
+        br.acc <<= len;
+        br.bits -= len;
+        return t.lookSym[peek];
+    }
+
+    // Slow path for codes longer than 8 bits
+    uint32_t code = br.acc >> 23;
+    len = 9;
+    while (len <= 16 && (int32_t)code > t.maxcode[len])
+    {
+        len++;
+        code = br.acc >> (32 - len);
+    }
+    if (len > 16)
+    {
+        return -1; // Corrupt data
+    }
+    br.acc <<= len;
+    br.bits -= len;
+    return t.vals[t.valptr[len] + code - t.mincode[len]];
+}
+
+void jpegScanBegin(JpegScan &scan, const JpegImage &img)
+{
+    memset(&scan, 0, sizeof(scan));
+    scan.img = &img;
+    scan.br.p = img.scan;
+    scan.br.end = img.end;
+    scan.restartsLeft = img.restartInterval;
+
+    int b = 0;
+    for (int c = 0; c < img.ncomp; c++)
+    {
+        for (int y = 0; y < img.comp[c].v; y++)
+        {
+            for (int x = 0; x < img.comp[c].h; x++, b++)
+            {
+                scan.blockComp[b] = c;
+                scan.blockX[b] = x;
+                scan.blockY[b] = y;
+            }
+        }
+    }
+}
+
+// Skip to the next restart marker and reset the DC predictors
+static bool restart(JpegScan &scan)
+{
+    JpegBitReader &br = scan.br;
+    // Drop whatever is left of the current byte and any buffered bytes
+    br.acc = 0;
+    br.bits = 0;
+    br.marker = false;
+    while (br.p + 1 < br.end && !(br.p[0] == 0xFF && br.p[1] >= 0xD0 && br.p[1] <= 0xD7))
+    {
+        br.p++;
+    }
+    if (br.p + 1 >= br.end)
+    {
+        return false;
+    }
+    br.p += 2;
+    memset(scan.pred, 0, sizeof(scan.pred));
+    scan.restartsLeft = scan.img->restartInterval;
+    return true;
+}
+
+bool jpegScanMcu(JpegScan &scan, int *dc, int16_t (*coef)[64])
+{
+    const JpegImage &img = *scan.img;
+
+    if (img.restartInterval)
+    {
+        if (scan.restartsLeft == 0 && !restart(scan))
+        {
+            return false;
+        }
+        scan.restartsLeft--;
+    }
+
+    JpegBitReader &br = scan.br;
+    for (int b = 0; b < img.blocksPerMcu; b++)
+    {
+        const JpegComponent &comp = img.comp[scan.blockComp[b]];
+        const JpegHuffTable &ac = img.ac[comp.ta];
+
+        int s = decodeSymbol(br, img.dc[comp.td]);
+        if (s < 0 || s > 11)
+        {
+            return false;
+        }
+        int &pred = scan.pred[scan.blockComp[b]];
+        pred += s ? extend(getBits(br, s), s) : 0;
+        dc[b] = pred * img.qt[comp.tq][0];
+
+        int16_t *block = coef ? coef[b] : NULL;
+        if (block)
+        {
+            memset(block, 0, 64 * sizeof(int16_t));
+            block[0] = pred;
+        }
+
+        // The AC coefficients still have to be decoded to find the next block
+        for (int k = 1; k < 64;)
+        {
+            int rs = decodeSymbol(br, ac);
+            if (rs < 0)
+            {
+                return false;
+            }
+            int r = rs >> 4;
+            s = rs & 0x0F;
+            if (s == 0)
+            {
+                if (r != 15)
+                {
+                    break; // End of block
+                }
+                k += 16;
+                continue;
+            }
+            k += r;
+            if (k > 63)
+            {
+                return false;
+            }
+            int v = getBits(br, s);
+            if (block)
+            {
+                block[jpegZigzag[k]] = extend(v, s);
+            }
+            k++;
+        }
+    }
+    scan.mcu++;
+    return true;
+}
+
+// cos((2x + 1) * u * pi / 16) * C(u) / 2 in 1.12 fixed point, [x][u]
+static const int16_t idctTable[8][8] = {
+    {1448, 2009, 1892, 1703, 1448, 1138, 784, 400},
+    {1448, 1703, 784, -400, -1448, -2009, -1892, -1138},
+    {1448, 1138, -784, -2009, -1448, 400, 1892, 1703},
+    {1448, 400, -1892, -1138, 1448, 1703, -784, -2009},
+    {1448, -400, -1892, 1138, 1448, -1703, -784, 2009},
+    {1448, -1138, -784, 2009, -1448, -400, 1892, -1703},
+    {1448, -1703, 784, 400, -1448, 2009, -1892, 1138},
+    {1448, -2009, 1892, -1703, 1448, -1138, 784, -400}};
+
+void jpegIdct(const int16_t *coef, const uint16_t *qt, uint8_t *out)
+{
+    int32_t tmp[64];
+
+    // Rows: tmp[v][x] = sum_u C(u) F(v,u) cos(...)
+    for (int v = 0; v < 8; v++)
+    {
+        int32_t in[8];
+        bool zero = true;
+        for (int u = 0; u < 8; u++)
+        {
+            in[u] = coef[v * 8 + u] * qt[v * 8 + u];
+            zero = zero && in[u] == 0;
+        }
+        for (int x = 0; x < 8; x++)
+        {
+            int32_t sum = 0;
+            if (!zero)
+            {
+                for (int u = 0; u < 8; u++)
+                {
+                    sum += in[u] * idctTable[x][u];
+                }
+            }
+            tmp[v * 8 + x] = sum >> 6; // 6 fraction bits
+        }
+    }
+
+    // Columns
+    for (int x = 0; x < 8; x++)
+    {
+        for (int y = 0; y < 8; y++)
+        {
+            int32_t sum = 0;
+            for (int v = 0; v < 8; v++)
+            {
+                sum += tmp[v * 8 + x] * idctTable[y][v];
+            }
+            // Remove 6 + 12 fraction bits, round and undo the level shift
+            int s = ((sum + (1 << 17)) >> 18) + 128;
+            out[y * 8 + x] = s < 0 ? 0 : (s > 255 ? 255 : s);
+        }
+    }
+}
+
+void jpegFdct(const uint8_t *in, const uint16_t *qt, int16_t *coef)
+{
+    int32_t tmp[64];
+
+    // Rows: tmp[y][u] = sum_x (f(y,x) - 128) C(u) cos(...)
+    for (int y = 0; y < 8; y++)
+    {
+        for (int u = 0; u < 8; u++)
+        {
+            int32_t sum = 0;
+            for (int x = 0; x < 8; x++)
+            {
+                sum += (in[y * 8 + x] - 128) * idctTable[x][u];
+            }
+            tmp[y * 8 + u] = sum >> 6; // 6 fraction bits
+        }
+    }
+
+    // Columns, then quantize with rounding to the nearest step
+    for (int u = 0; u < 8; u++)
+    {
+        for (int v = 0; v < 8; v++)
+        {
+            int32_t sum = 0;
+            for (int y = 0; y < 8; y++)
+            {
+                sum += tmp[y * 8 + u] * idctTable[y][v];
+            }
+            int64_t q = (int64_t)qt[v * 8 + u] << 18; // Step with 6 + 12 fraction bits
+            coef[v * 8 + u] = sum >= 0 ? (sum + q / 2) / q : -((-sum + q / 2) / q);
+        }
+    }
+}
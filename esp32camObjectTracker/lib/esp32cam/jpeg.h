@@ -0,0 +1,122 @@
+#ifndef JPEG_H
+#define JPEG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Minimal baseline JPEG bitstream access, just enough to walk the entropy
+// coded data of the frames the camera produces without a full decode.
+
+#define JPEG_MAX_COMPONENTS 3
+#define JPEG_MAX_BLOCKS_PER_MCU 10
+
+struct JpegHuffTable
+{
+    bool present;
+    uint8_t look[256];     // 8 bit lookahead: code length, 0 when longer
+    uint8_t lookSym[256];  // 8 bit lookahead: symbol
+    int32_t maxcode[18];   // largest code of each length, -1 if none
+    int16_t valptr[17];    // index of the first symbol of each length
+    uint16_t mincode[17];  // smallest code of each length
+    uint8_t vals[256];     // symbols in code order
+};
+
+struct JpegComponent
+{
+    uint8_t id;
+    uint8_t h, v; // sampling factors
+    uint8_t tq;   // quantization table
+    uint8_t td;   // DC huffman table
+    uint8_t ta;   // AC huffman table
+};
+
+struct JpegImage
+{
+    int width, height;
+    int ncomp;
+    JpegComponent comp[JPEG_MAX_COMPONENTS];
+    uint16_t qt[4][64]; // natural order
+    JpegHuffTable dc[2], ac[2];
+    int restartInterval;
+    int hmax, vmax;
+    int mcuWidth, mcuHeight; // in pixels
+    int mcusX, mcusY;
+    int blocksPerMcu;
+    const uint8_t *scan; // first byte of the entropy coded data
+    const uint8_t *end;
+};
+
+struct JpegBitReader
+{
+    const uint8_t *p;
+    const uint8_t *end;
+    uint32_t acc;
+    int bits;
+    bool marker; // hit a marker, only zero bits follow
+};
+
+// Walks the MCUs of a scan in order, handling restart markers.
+struct JpegScan
+{
+    const JpegImage *img;
+    JpegBitReader br;
+    int mcu;
+    int restartsLeft;
+    int pred[JPEG_MAX_COMPONENTS];
+    uint8_t blockComp[JPEG_MAX_BLOCKS_PER_MCU]; // component of each block
+    uint8_t blockX[JPEG_MAX_BLOCKS_PER_MCU];    // block offset inside the MCU
+    uint8_t blockY[JPEG_MAX_BLOCKS_PER_MCU];
+};
+
+extern const uint8_t jpegZigzag[64];
+
+// Parse the headers up to the start of scan. Only baseline, 8 bit, single
+// scan images with at most 3 components are accepted.
+bool jpegParse(const uint8_t *buf, size_t len, JpegImage &img);
+
+void jpegScanBegin(JpegScan &scan, const JpegImage &img);
+
+/**
+ * Entropy decode the next MCU.
+ *
+ * @param scan Scan state
+ * @param dc Output, dequantized DC coefficient of every block of the MCU
+ * @param coef Output, quantized coefficients of every block in natural
+ *             order, or NULL to only decode the DC values
+ * @return false on a corrupt or truncated stream
+ */
+bool jpegScanMcu(JpegScan &scan, int *dc, int16_t (*coef)[64]);
+
+// Dequantize and inverse transform one block into 8x8 samples.
+void jpegIdct(const int16_t *coef, const uint16_t *qt, uint8_t *out);
+
+// Transform 8x8 samples and quantize them into coefficients in natural
+// order, the inverse of jpegIdct().
+void jpegFdct(const uint8_t *in, const uint16_t *qt, int16_t *coef);
+
+// A box in pixel coordinates, rows counted from the top of the image
+struct JpegBox
+{
+    int left, top, right, bottom;
+};
+
+/**
+ * Draw the outlines of boxes into a baseline JPEG. Only the blocks that an
+ * outline crosses are decoded, painted and transformed again, the other
+ * blocks keep their coefficients. The scan is then entropy coded again
+ * with the tables of the image, so the headers are copied unchanged.
+ *
+ * @param in JPEG image
+ * @param len Size of the image in bytes
+ * @param boxes Outlines to draw, 1 pixel wide
+ * @param count Number of boxes
+ * @param out Output buffer for the new image
+ * @param size Size of out, the painted blocks take up to a quarter more
+ * than len at high quality
+ * @param outLen Output parameter for the size of the new image
+ * @return false if the image is not supported or out is too small
+ */
+bool jpegDrawBoxes(const uint8_t *in, size_t len, const JpegBox *boxes, int count,
+                   uint8_t *out, size_t size, size_t &outLen);
+
+#endif
@@ -0,0 +1,296 @@
+#include <string.h>
+#include "jpeg.h"
+
+// Box outlines drawn into the coefficients of a JPEG, see jpegDrawBoxes().
+// Used for the stream, where the frames are JPEGs already and a decode to
+// pixels, a drawing and a new encode would cost more than the detection.
+
+// Green in YCbCr, per component
+static const uint8_t boxColor[JPEG_MAX_COMPONENTS] = {150, 44, 21};
+
+// Huffman code of every symbol of a table, length 0 if it has none
+struct JpegHuffCode
+{
+    uint16_t code[256];
+    uint8_t len[256];
+};
+
+struct JpegBitWriter
+{
+    uint8_t *p;
+    uint8_t *end;
+    uint32_t acc;
+    int bits;
+    bool overflow;
+};
+
+// Large state of the one frame being drawn, kept off the task stack
+static JpegImage drawImage;
+static JpegScan drawScan;
+static JpegHuffCode dcCodes[2], acCodes[2];
+
+static void buildHuffCode(const JpegHuffTable &t, JpegHuffCode &c)
+{
+    memset(&c, 0, sizeof(c));
+    for (int len = 1; len <= 16; len++)
+    {
+        if (t.maxcode[len] < 0)
+        {
+            continue;
+        }
+        for (int code = t.mincode[len]; code <= t.maxcode[len]; code++)
+        {
+            uint8_t sym = t.vals[t.valptr[len] + code - t.mincode[len]];
+            c.code[sym] = code;
+            c.len[sym] = len;
+        }
+    }
+}
+
+static void putByte(JpegBitWriter &bw, uint8_t byte)
+{
+    if (bw.p >= bw.end)
+    {
+        bw.overflow = true;
+        return;
+    }
+    *bw.p++ = byte;
+}
+
+static void putBits(JpegBitWriter &bw, uint32_t v, int n)
+{
+    bw.acc = (bw.acc << n) | (v & ((1u << n) - 1));
+    bw.bits += n;
+    while (bw.bits >= 8)
+    {
+        uint8_t byte = bw.acc >> (bw.bits - 8);
+        bw.bits -= 8;
+        putByte(bw, byte);
+        if (byte == 0xFF)
+        {
+            putByte(bw, 0x00); // Stuffed zero byte
+        }
+    }
+}
+
+// Pad the last byte with 1 bits, before a marker
+static void flushBits(JpegBitWriter &bw)
+{
+    if (bw.bits > 0)
+    {
+        putBits(bw, 0x7F, 8 - bw.bits);
+    }
+    bw.acc = 0;
+}
+
+static bool putSymbol(JpegBitWriter &bw, const JpegHuffCode &c, int sym)
+{
+    if (c.len[sym] == 0)
+    {
+        return false; // The table of the image has no code for it
+    }
+    putBits(bw, c.code[sym], c.len[sym]);
+    return true;
+}
+
+// Magnitude category of a coefficient and the bits that follow its symbol
+static inline int category(int v)
+{
+    int n = 0;
+    for (int a = v < 0 ? -v : v; a; a >>= 1)
+    {
+        n++;
+    }
+    return n;
+}
+
+static bool encodeBlock(JpegBitWriter &bw, const int16_t *block, int &pred,
+                        const JpegHuffCode &dc, const JpegHuffCode &ac)
+{
+    int diff = block[0] - pred;
+    pred = block[0];
+    int s = category(diff);
+    if (s > 11 || !putSymbol(bw, dc, s))
+    {
+        return false;
+    }
+    putBits(bw, diff < 0 ? diff - 1 : diff, s);
+
+    int run = 0;
+    for (int k = 1; k < 64; k++)
+    {
+        int v = block[jpegZigzag[k]];
+        if (v == 0)
+        {
+            run++;
+            continue;
+        }
+        for (; run > 15; run -= 16)
+        {
+            if (!putSymbol(bw, ac, 0xF0)) // 16 zeros
+            {
+                return false;
+            }
+        }
+        s = category(v);
+        if (s > 10 || !putSymbol(bw, ac, (run << 4) | s))
+        {
+            return false;
+        }
+        putBits(bw, v < 0 ? v - 1 : v, s);
+        run = 0;
+    }
+    return run == 0 || putSymbol(bw, ac, 0x00); // End of block
+}
+
+static bool onOutline(const JpegBox *boxes, int count, int x, int y)
+{
+    for (int i = 0; i < count; i++)
+    {
+        const JpegBox &b = boxes[i];
+        if (x < b.left || x > b.right || y < b.top || y > b.bottom)
+        {
+            continue;
+        }
+        if (x == b.left || x == b.right || y == b.top || y == b.bottom)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Paint the samples of one block that cover a pixel of an outline. A
+// subsampled chroma sample covers sx by sy pixels. False if the block has
+// no outline in it and is left alone.
+static bool paintBlock(const JpegBox *boxes, int count, int x0, int y0, int sx, int sy,
+                       uint8_t color, uint8_t *samples)
+{
+    bool painted = false;
+    for (int j = 0; j < 8; j++)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            int px = (x0 + i) * sx;
+            int py = (y0 + j) * sy;
+            bool hit = false;
+            for (int dy = 0; dy < sy && !hit; dy++)
+            {
+                for (int dx = 0; dx < sx && !hit; dx++)
+                {
+                    hit = onOutline(boxes, count, px + dx, py + dy);
+                }
+            }
+            if (hit)
+            {
+                samples[j * 8 + i] = color;
+                painted = true;
+            }
+        }
+    }
+    return painted;
+}
+
+// True if the pixel area of a block can contain a pixel of an outline
+static bool blockNearOutline(const JpegBox *boxes, int count, int x0, int y0, int x1, int y1)
+{
+    for (int i = 0; i < count; i++)
+    {
+        const JpegBox &b = boxes[i];
+        if (x1 < b.left || x0 > b.right || y1 < b.top || y0 > b.bottom)
+        {
+            continue;
+        }
+        bool inside = x0 > b.left && x1 < b.right && y0 > b.top && y1 < b.bottom;
+        if (!inside)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool jpegDrawBoxes(const uint8_t *in, size_t len, const JpegBox *boxes, int count,
+                   uint8_t *out, size_t size, size_t &outLen)
+{
+    JpegImage &img = drawImage;
+    if (!jpegParse(in, len, img))
+    {
+        return false;
+    }
+
+    // Headers up to the start of the scan stay the same
+    size_t headerLen = img.scan - in;
+    if (size < headerLen + 2)
+    {
+        return false;
+    }
+    memcpy(out, in, headerLen);
+
+    for (int t = 0; t < 2; t++)
+    {
+        buildHuffCode(img.dc[t], dcCodes[t]);
+        buildHuffCode(img.ac[t], acCodes[t]);
+    }
+
+    JpegBitWriter bw = {out + headerLen, out + size - 2, 0, 0, false};
+    JpegScan &scan = drawScan;
+    jpegScanBegin(scan, img);
+    int pred[JPEG_MAX_COMPONENTS] = {0};
+    int dc[JPEG_MAX_BLOCKS_PER_MCU];
+    int16_t coef[JPEG_MAX_BLOCKS_PER_MCU][64];
+    uint8_t samples[64];
+    int mcus = img.mcusX * img.mcusY;
+
+    for (int mcu = 0; mcu < mcus; mcu++)
+    {
+        if (img.restartInterval && mcu > 0 && mcu % img.restartInterval == 0)
+        {
+            flushBits(bw);
+            putByte(bw, 0xFF);
+            putByte(bw, 0xD0 + ((mcu / img.restartInterval - 1) & 7));
+            memset(pred, 0, sizeof(pred));
+        }
+        if (!jpegScanMcu(scan, dc, coef))
+        {
+            return false;
+        }
+
+        int mx = mcu % img.mcusX;
+        int my = mcu / img.mcusX;
+        for (int b = 0; b < img.blocksPerMcu; b++)
+        {
+            int c = scan.blockComp[b];
+            const JpegComponent &comp = img.comp[c];
+            int sx = img.hmax / comp.h; // Pixels per sample
+            int sy = img.vmax / comp.v;
+            int x0 = (mx * comp.h + scan.blockX[b]) * 8; // In samples
+            int y0 = (my * comp.v + scan.blockY[b]) * 8;
+
+            if (blockNearOutline(boxes, count, x0 * sx, y0 * sy, (x0 + 8) * sx - 1, (y0 + 8) * sy - 1))
+            {
+                const uint16_t *qt = img.qt[comp.tq];
+                jpegIdct(coef[b], qt, samples);
+                if (paintBlock(boxes, count, x0, y0, sx, sy, boxColor[img.ncomp == 1 ? 0 : c], samples))
+                {
+                    jpegFdct(samples, qt, coef[b]);
+                }
+            }
+            if (!encodeBlock(bw, coef[b], pred[c], dcCodes[comp.td], acCodes[comp.ta]))
+            {
+                return false;
+            }
+        }
+    }
+    flushBits(bw);
+    if (bw.overflow)
+    {
+        return false;
+    }
+
+    bw.end += 2; // Room kept for the end of image marker
+    putByte(bw, 0xFF);
+    putByte(bw, 0xD9);
+    outLen = bw.p - out;
+    return true;
+}
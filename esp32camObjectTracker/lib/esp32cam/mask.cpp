@@ -0,0 +1,182 @@
+#include <string.h>
+#include "detect.h"
+
+// Bit-packed binary masks. Bit (x & 31) of word (x >> 5) of a row holds
+// pixel x, so a shift by one moves every pixel of a word to its neighbour
+// and the morphology below handles 32 pixels per operation. Bits past the
+// width of a row are always kept zero.
+
+bool maskBegin(BitMask &mask, int width, int height)
+{
+    if (width <= 0 || height <= 0 || width > MASK_MAX_WIDTH || height > MASK_MAX_HEIGHT)
+    {
+        return false;
+    }
+    mask.width = width;
+    mask.height = height;
+    mask.stride = (width + 31) / 32;
+    return true;
+}
+
+static inline uint32_t tailMask(const BitMask &mask)
+{
+    int tail = mask.width & 31;
+    return tail ? (1u << tail) - 1 : 0xFFFFFFFF;
+}
+
+// 1x3 pass: every pixel combined with its left and right neighbour.
+// Pixels outside the mask count as 0.
+static void horizontalPass(const BitMask &src, BitMask &dst, bool erode)
+{
+    dst.width = src.width;
+    dst.height = src.height;
+    dst.stride = src.stride;
+
+    uint32_t tail = tailMask(src);
+    for (int y = 0; y < src.height; y++)
+    {
+        const uint32_t *in = src.bits + y * src.stride;
+        uint32_t *out = dst.bits + y * dst.stride;
+        uint32_t prev = 0;
+        for (int k = 0; k < src.stride; k++)
+        {
+            uint32_t w = in[k];
+            uint32_t next = k + 1 < src.stride ? in[k + 1] : 0;
+            uint32_t left = (w << 1) | (prev >> 31);  // Pixel x - 1
+            uint32_t right = (w >> 1) | (next << 31); // Pixel x + 1
+            out[k] = erode ? (w & left & right) : (w | left | right);
+            prev = w;
+        }
+        out[src.stride - 1] &= tail;
+    }
+}
+
+// 3x1 pass: every pixel combined with the pixel above and below
+static void verticalPass(const BitMask &src, BitMask &dst, bool erode)
+{
+    dst.width = src.width;
+    dst.height = src.height;
+    dst.stride = src.stride;
+
+    for (int y = 0; y < src.height; y++)
+    {
+        const uint32_t *in = src.bits + y * src.stride;
+        const uint32_t *above = y > 0 ? in - src.stride : NULL;
+        const uint32_t *below = y + 1 < src.height ? in + src.stride : NULL;
+        uint32_t *out = dst.bits + y * dst.stride;
+        for (int k = 0; k < src.stride; k++)
+        {
+            uint32_t a = above ? above[k] : 0;
+            uint32_t b = below ? below[k] : 0;
+            out[k] = erode ? (in[k] & a & b) : (in[k] | a | b);
+        }
+    }
+}
+
+void maskErode(BitMask &mask, BitMask &tmp)
+{
+    horizontalPass(mask, tmp, true);
+    verticalPass(tmp, mask, true);
+}
+
+void maskDilate(BitMask &mask, BitMask &tmp)
+{
+    horizontalPass(mask, tmp, false);
+    verticalPass(tmp, mask, false);
+}
+
+void maskOpen(BitMask &mask, BitMask &tmp)
+{
+    maskErode(mask, tmp);
+    maskDilate(mask, tmp);
+}
+
+bool maskBounds(const BitMask &mask, int &left, int &top, int &right, int &bottom)
+{
+    uint32_t columns[MASK_MAX_WIDTH / 32];
+    memset(columns, 0, mask.stride * sizeof(uint32_t));
+
+    top = -1;
+    bottom = -1;
+    for (int y = 0; y < mask.height; y++)
+    {
+        const uint32_t *row = mask.bits + y * mask.stride;
+        uint32_t any = 0;
+        for (int k = 0; k < mask.stride; k++)
+        {
+            columns[k] |= row[k];
+            any |= row[k];
+        }
+        if (any)
+        {
+            if (top < 0)
+            {
+                top = y;
+            }
+            bottom = y;
+        }
+    }
+    if (top < 0)
+    {
+        return false;
+    }
+
+    left = -1;
+    for (int k = 0; k < mask.stride; k++)
+    {
+        if (columns[k])
+        {
+            if (left < 0)
+            {
+                left = k * 32 + __builtin_ctz(columns[k]);
+            }
+            right = k * 32 + 31 - __builtin_clz(columns[k]);
+        }
+    }
+
+    // Flip the y axis to match detect()
+    top = mask.height - top - 1;
+    bottom = mask.height - bottom - 1;
+    return true;
+}
+
+// First pixel at or after x that is set (or clear), words * 32 if none
+static int nextPixel(const uint32_t *row, int words, int x, bool set)
+{
+    int k = x >> 5;
+    if (k >= words)
+    {
+        return words * 32;
+    }
+    uint32_t w = (set ? row[k] : ~row[k]) & (0xFFFFFFFF << (x & 31));
+    while (w == 0)
+    {
+        if (++k >= words)
+        {
+            return words * 32;
+        }
+        w = set ? row[k] : ~row[k];
+    }
+    return k * 32 + __builtin_ctz(w);
+}
+
+int maskBlobs(const BitMask &mask, BlobLabeler &lab, Blob *blobs, int maxBlobs, int minArea)
+{
+    blobBegin(lab, mask.width, mask.height);
+    for (int y = 0; y < mask.height; y++)
+    {
+        const uint32_t *row = mask.bits + y * mask.stride;
+        int x = nextPixel(row, mask.stride, 0, true);
+        while (x < mask.width)
+        {
+            int end = nextPixel(row, mask.stride, x, false);
+            if (end > mask.width)
+            {
+                end = mask.width;
+            }
+            blobRun(lab, y, x, end - 1);
+            x = nextPixel(row, mask.stride, end, true);
+        }
+    }
+    return blobEnd(lab, blobs, maxBlobs, minArea);
+}
@@ -405,15 +405,7 @@ const char *page = R"(
                         <div class="input-group" id="framesize-group">
                             <label for="framesize">Resolution</label>
                             <select id="framesize" class="default-action">
-                                <!-- 2MP -->
-                                <option value="13">UXGA(1600x1200)</option>
-                                <option value="12">SXGA(1280x1024)</option>
-                                <option value="11">HD(1280x720)</option>
-                                <option value="10">XGA(1024x768)</option>
-                                <option value="9">SVGA(800x600)</option>
-                                <option value="8">VGA(640x480)</option>
-                                <option value="7">HVGA(480x320)</option>
-                                <option value="6">CIF(400x296)</option>
+                                <!-- Up to BMP_POOL_FRAMESIZE of app_httpd.cpp -->
                                 <option value="5">QVGA(320x240)</option>
                                 <option value="4">240x240</option>
                                 <option value="3">HQVGA(240x176)</option>
@@ -595,6 +587,57 @@ const char *page = R"(
                           <input type="range" id="blue_level" min="0" max="255" value="0" class="default-action">
                           <div class="range-max">255</div>
                         </div>
+                        <div class="input-group" id="detect-mode-group">
+                            <label for="detect_mode">Detect mode</label>
+                            <select id="detect_mode" class="default-action">
+                                <option value="0" selected="selected">Full frame</option>
+                                <option value="1">JPEG DC</option>
+                                <option value="2">Blobs</option>
+                                <option value="3">Track</option>
+                                <option value="4">Pyramid</option>
+                            </select>
+                        </div>
+                        <div class="input-group" id="dc-refine-group">
+                            <label for="dc_refine">Refine DC edges</label>
+                            <div class="switch">
+                                <input id="dc_refine" type="checkbox" class="default-action" checked="checked">
+                                <label class="slider" for="dc_refine"></label>
+                            </div>
+                        </div>
+                        <div class="input-group" id="morph-open-group">
+                            <label for="morph_open">Remove specks</label>
+                            <div class="switch">
+                                <input id="morph_open" type="checkbox" class="default-action">
+                                <label class="slider" for="morph_open"></label>
+                            </div>
+                        </div>
+                        <div class="input-group" id="dual-core-group">
+                            <label for="dual_core">Use both cores</label>
+                            <div class="switch">
+                                <input id="dual_core" type="checkbox" class="default-action" checked="checked">
+                                <label class="slider" for="dual_core"></label>
+                            </div>
+                        </div>
+                        <div class="input-group" id="pipeline-group">
+                            <label for="pipeline">Pipeline frames</label>
+                            <div class="switch">
+                                <input id="pipeline" type="checkbox" class="default-action">
+                                <label class="slider" for="pipeline"></label>
+                            </div>
+                        </div>
+                        <div class="input-group" id="stream-boxes-group">
+                            <label for="stream_boxes">Boxes in stream</label>
+                            <div class="switch">
+                                <input id="stream_boxes" type="checkbox" class="default-action" checked="checked">
+                                <label class="slider" for="stream_boxes"></label>
+                            </div>
+                        </div>
+                        <div class="input-group" id="min-area-group">
+                          <label for="min_area">Min blob area</label>
+                          <div class="range-min">1</div>
+                          <input type="range" id="min_area" min="1" max="200" value="4" class="default-action">
+                          <div class="range-max">200</div>
+                        </div>
                         <div class="input-group" id="autorefresh-group">
                             <label for="refreshsw">Auto refresh</label>
                             <div class="switch">
@@ -705,6 +748,7 @@ const char *page = R"(
                         <img id="stream" src="" crossorigin >
                         <!-- <img id="filtered-stream" src="" crossorigin> -->
                     </div>
+                    <div id="detection">No object</div>
                 </figure>
             </div>
         </section>
@@ -715,7 +759,7 @@ let refreshIntervalId = null;
 // Function to refresh webcam image
 function refreshWebcamImage() {
   const img = document.getElementById('webcamImage');
-  const webcamUrl = '${baseHost}/bmp?_cb=${Date.now()}';
+  const webcamUrl = '${baseHost}/bmp?format=jpeg&_cb=${Date.now()}';
   
   // Clear any existing interval
   if (refreshIntervalId) {
@@ -1083,7 +1127,7 @@ document.addEventListener('DOMContentLoaded', function() {
   stillButton.onclick = () => {
     console.log('still button')
     stopStream()
-    view.src = `${baseHost}/bmp?_cb=${Date.now()}`
+    view.src = `${baseHost}/bmp?format=jpeg&_cb=${Date.now()}`
     show(viewContainer)
   }
 
@@ -1217,6 +1261,19 @@ document.addEventListener('DOMContentLoaded', function() {
     }
   }
   */
+
+  // Detection events, only sent when the box changes
+  const detection = document.getElementById('detection')
+  const showDetection = (event) => {
+    const result = JSON.parse(event.data)
+    detection.innerHTML = result.found
+      ? `Object ${result.left},${result.top} - ${result.right},${result.bottom} (frame ${result.frame})`
+      : 'No object'
+  }
+  const events = new EventSource(`${baseHost}/events`)
+  events.addEventListener('appear', showDetection)
+  events.addEventListener('move', showDetection)
+  events.addEventListener('disappear', showDetection)
     
 })
         </script>
@@ -0,0 +1,73 @@
+#ifndef SEQRING_H
+#define SEQRING_H
+
+#include <stdint.h>
+#include <atomic>
+
+// Ring of the last N records written by a single producer, read by any
+// number of consumers without locks. Every slot carries a sequence number
+// that tells which record it holds and is odd while the slot is written
+// (a seqlock per slot). A reader copies a slot and checks that the
+// sequence number did not change, so it never sees a torn record and never
+// holds up the writer. Records are numbered from 0 in the order they were
+// written.
+template <typename T, int N>
+struct SeqRing
+{
+    struct Slot
+    {
+        std::atomic<uint32_t> seq; // 2 * record + 2 when written, odd while writing
+        T value;
+    };
+    Slot slots[N];
+    std::atomic<uint32_t> count; // Records written
+};
+
+// Only one task may write
+template <typename T, int N>
+void seqRingWrite(SeqRing<T, N> &ring, const T &value)
+{
+    uint32_t record = ring.count.load(std::memory_order_relaxed);
+    typename SeqRing<T, N>::Slot &slot = ring.slots[record % N];
+    slot.seq.store(2 * record + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.value = value;
+    slot.seq.store(2 * record + 2, std::memory_order_release);
+    ring.count.store(record + 1, std::memory_order_release);
+}
+
+// Copy of a record, false if it was not written yet or already overwritten
+template <typename T, int N>
+bool seqRingRead(const SeqRing<T, N> &ring, uint32_t record, T &value)
+{
+    const typename SeqRing<T, N>::Slot &slot = ring.slots[record % N];
+    uint32_t seq = 2 * record + 2;
+    if (slot.seq.load(std::memory_order_acquire) != seq)
+    {
+        return false;
+    }
+    value = slot.value;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot.seq.load(std::memory_order_relaxed) == seq;
+}
+
+// Copy of the newest record, false if nothing was written yet
+template <typename T, int N>
+bool seqRingLatest(const SeqRing<T, N> &ring, T &value)
+{
+    for (;;)
+    {
+        uint32_t count = ring.count.load(std::memory_order_acquire);
+        if (count == 0)
+        {
+            return false;
+        }
+        if (seqRingRead(ring, count - 1, value))
+        {
+            return true;
+        }
+        // Overwritten while copying, the writer went around the ring
+    }
+}
+
+#endif
@@ -0,0 +1,274 @@
+#include <Arduino.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "detect.h"
+
+// Two-core detection. The frame is cut at the middle row into a top and a
+// bottom band. The calling task scans the top band while a worker task
+// pinned to the other core scans the bottom band, then the partial results
+// are merged. There is a worker on each core, so the bottom band always
+// goes to the core the caller is not running on.
+
+#define SPLIT_STACK_SIZE 4096
+#define SPLIT_PRIORITY 5 // Same as the vision task, VISION_PRIORITY in app_httpd.cpp
+
+// Scans rows [y0..y1] of a frame into the partial result of band 0 or 1
+typedef void (*BandJob)(void *ctx, int y0, int y1, int band);
+
+struct SplitWorker
+{
+    TaskHandle_t task;
+    SemaphoreHandle_t start; // Given by the caller when the job is set
+    SemaphoreHandle_t done;  // Given by the worker when its band is scanned
+    BandJob job;
+    void *ctx;
+    int y0, y1;
+};
+
+static SplitWorker workers[2]; // Indexed by core
+static SemaphoreHandle_t splitLock = NULL; // One split frame at a time
+static bool splitReady = false;
+
+// Labeler of the bottom band, the top band uses blobLabeler
+static BlobLabeler splitLabeler;
+
+static void splitTask(void *arg)
+{
+    SplitWorker *w = (SplitWorker *)arg;
+    for (;;)
+    {
+        xSemaphoreTake(w->start, portMAX_DELAY);
+        w->job(w->ctx, w->y0, w->y1, 1);
+        xSemaphoreGive(w->done);
+    }
+}
+
+/**
+ * Starts a worker task on each core. Can be called again after a failure.
+ *
+ * @return true if the bottom band of a frame will be scanned on the other
+ * core, false if the split detectors run on the calling task only
+ */
+bool splitBegin()
+{
+    if (splitReady)
+    {
+        return true;
+    }
+    if (portNUM_PROCESSORS < 2)
+    {
+        Serial.printf("Single core, split detection runs on one task\n");
+        return false;
+    }
+
+    if (splitLock == NULL && (splitLock = xSemaphoreCreateMutex()) == NULL)
+    {
+        Serial.printf("Split lock not created\n");
+        return false;
+    }
+    for (int core = 0; core < 2; core++)
+    {
+        SplitWorker &w = workers[core];
+        if (w.task != NULL)
+        {
+            continue;
+        }
+        if (w.start == NULL)
+        {
+            w.start = xSemaphoreCreateBinary();
+        }
+        if (w.done == NULL)
+        {
+            w.done = xSemaphoreCreateBinary();
+        }
+        if (w.start == NULL || w.done == NULL ||
+            xTaskCreatePinnedToCore(splitTask, "split", SPLIT_STACK_SIZE, &w, SPLIT_PRIORITY, &w.task, core) != pdPASS)
+        {
+            Serial.printf("Split worker for core %d not started\n", core);
+            w.task = NULL;
+            return false;
+        }
+    }
+    splitReady = true;
+    return true;
+}
+
+// The lock keeps the worker and the shared labelers to one frame at a time
+static void splitEnter()
+{
+    if (splitLock != NULL)
+    {
+        xSemaphoreTake(splitLock, portMAX_DELAY);
+    }
+}
+
+static void splitLeave()
+{
+    if (splitLock != NULL)
+    {
+        xSemaphoreGive(splitLock);
+    }
+}
+
+// Run a job on both bands of a frame, the bottom band on the other core
+static void runBands(BandJob job, void *ctx, int height)
+{
+    int split = height / 2;
+    if (splitReady && split > 0)
+    {
+        SplitWorker &w = workers[xPortGetCoreID() ^ 1];
+        w.job = job;
+        w.ctx = ctx;
+        w.y0 = split;
+        w.y1 = height - 1;
+        xSemaphoreGive(w.start);
+        job(ctx, 0, split - 1, 0);
+        xSemaphoreTake(w.done, portMAX_DELAY);
+        return;
+    }
+
+    // Single-core fallback with the same bands, so the merge is the same
+    job(ctx, 0, split - 1, 0);
+    job(ctx, split, height - 1, 1);
+}
+
+struct BoundsJob
+{
+    const ImageView *view;
+    const ColorLut *lut;
+    bool found[2];
+    int minX[2], minY[2], maxX[2], maxY[2];
+};
+
+static void boundsBand(void *ctx, int y0, int y1, int band)
+{
+    BoundsJob &job = *(BoundsJob *)ctx;
+    job.found[band] = detectRows(
+        *job.view, *job.lut, y0, y1,
+        job.minX[band], job.minY[band], job.maxX[band], job.maxY[band]);
+}
+
+/**
+ * Same as detectImage(), with the bottom half of the frame scanned on the
+ * other core.
+ *
+ * @param view Image to scan, see imageFromBMP() and imageFromFrame()
+ * @param lut Color classification table, see colorLutBuild()
+ * @param left Output parameter for the left coordinate of detected rectangle
+ * @param top Output parameter for the top coordinate of detected rectangle
+ * @param right Output parameter for the right coordinate of detected rectangle
+ * @param bottom Output parameter for the bottom coordinate of detected rectangle
+ * @return true if detection successful, false otherwise
+ */
+bool detectSplit(
+    const ImageView &view, const ColorLut &lut,
+    int &left, int &top, int &right, int &bottom)
+{
+    BoundsJob job;
+    job.view = &view;
+    job.lut = &lut;
+    splitEnter();
+    runBands(boundsBand, &job, view.height);
+    splitLeave();
+
+    int minX = view.width, minY = view.height, maxX = -1, maxY = -1;
+    for (int band = 0; band < 2; band++)
+    {
+        if (job.found[band])
+        {
+            minX = std::min(minX, job.minX[band]);
+            minY = std::min(minY, job.minY[band]);
+            maxX = std::max(maxX, job.maxX[band]);
+            maxY = std::max(maxY, job.maxY[band]);
+        }
+    }
+    if (maxX < 0)
+    {
+        return false; // No matching pixels found
+    }
+
+    // Flip the y axis
+    left = minX;
+    right = maxX;
+    top = view.height - minY - 1;
+    bottom = view.height - maxY - 1;
+    return true;
+}
+
+struct LabelJob
+{
+    const ImageView *view;
+    const ColorLut *lut;
+};
+
+static void labelBand(void *ctx, int y0, int y1, int band)
+{
+    LabelJob &job = *(LabelJob *)ctx;
+    BlobLabeler &lab = band ? splitLabeler : blobLabeler;
+    blobBegin(lab, job.view->width, job.view->height);
+    labelRows(*job.view, *job.lut, y0, y1, lab);
+}
+
+/**
+ * Same as detectBlobs(), each band is labeled on its own core and the
+ * blobs that cross the middle row are joined by blobMerge().
+ *
+ * @param view Image to scan, see imageFromBMP() and imageFromFrame()
+ * @param lut Color classification table, see colorLutBuild()
+ * @param blobs Output array, sorted on area with the largest blob first
+ * @param maxBlobs Size of the blobs array
+ * @param minArea Blobs with fewer pixels are left out
+ * @return Number of blobs written to blobs
+ */
+int detectBlobsSplit(
+    const ImageView &view, const ColorLut &lut,
+    Blob *blobs, int maxBlobs, int minArea)
+{
+    LabelJob job = {&view, &lut};
+    splitEnter();
+    runBands(labelBand, &job, view.height);
+    blobMerge(blobLabeler, splitLabeler);
+    int count = blobEnd(blobLabeler, blobs, maxBlobs, minArea);
+    splitLeave();
+    return count;
+}
+
+struct ClassJob
+{
+    const ImageView *view;
+    const ClassLut *lut;
+    BlobStats stats[2][COLOR_MAX_CLASSES];
+};
+
+static void classBand(void *ctx, int y0, int y1, int band)
+{
+    ClassJob &job = *(ClassJob *)ctx;
+    classStatsBegin(*job.view, job.stats[band]);
+    classRows(*job.view, *job.lut, y0, y1, job.stats[band]);
+}
+
+/**
+ * Same as detectClasses(), with the bottom half of the frame scanned on the
+ * other core.
+ *
+ * @param view Image to scan, see imageFromBMP() and imageFromFrame()
+ * @param lut Class table, see classLutBuild()
+ * @param results Output, one entry per class
+ * @return Bitmask of the classes that were found
+ */
+int detectClassesSplit(const ImageView &view, const ClassLut &lut, Blob *results)
+{
+    ClassJob job;
+    job.view = &view;
+    job.lut = &lut;
+    splitEnter();
+    runBands(classBand, &job, view.height);
+    splitLeave();
+
+    for (int c = 0; c < COLOR_MAX_CLASSES; c++)
+    {
+        blobStatsMerge(job.stats[0][c], job.stats[1][c]);
+    }
+    return classStatsEnd(view, job.stats[0], results);
+}
@@ -0,0 +1,95 @@
+#include <Arduino.h>
+#include "lwip/sockets.h"
+#include "telemetry.h"
+
+static int telemetry_socket = -1;
+static portMUX_TYPE telemetry_mux = portMUX_INITIALIZER_UNLOCKED;
+static struct sockaddr_in telemetry_target; // Under telemetry_mux, port 0 if not sending
+static uint32_t telemetry_sequence = 0;     // Vision task only
+static volatile uint32_t telemetry_sent = 0;
+static volatile uint32_t telemetry_errors = 0;
+
+/**
+ * Opens the UDP socket. Nothing is sent until a target is set.
+ *
+ * @return false if the socket could not be created
+ */
+bool telemetryBegin()
+{
+    memset(&telemetry_target, 0, sizeof(telemetry_target));
+    telemetry_target.sin_family = AF_INET;
+    telemetry_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (telemetry_socket < 0)
+    {
+        Serial.println("Telemetry socket not created");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Sets where the datagrams go.
+ *
+ * @param host IPv4 address in dotted notation
+ * @param port UDP port, 0 stops sending
+ * @return false if host is not an IPv4 address
+ */
+bool telemetrySetTarget(const char *host, int port)
+{
+    struct sockaddr_in target;
+    memset(&target, 0, sizeof(target));
+    target.sin_family = AF_INET;
+    target.sin_port = htons(port);
+    if (port != 0 && inet_aton(host, &target.sin_addr) == 0)
+    {
+        return false;
+    }
+    portENTER_CRITICAL(&telemetry_mux);
+    telemetry_target = target;
+    portEXIT_CRITICAL(&telemetry_mux);
+    return true;
+}
+
+int telemetryTarget(char *host)
+{
+    portENTER_CRITICAL(&telemetry_mux);
+    struct sockaddr_in target = telemetry_target;
+    portEXIT_CRITICAL(&telemetry_mux);
+    inet_ntoa_r(target.sin_addr, host, 16);
+    return ntohs(target.sin_port);
+}
+
+void telemetryPublish(const VisionResult &result)
+{
+    portENTER_CRITICAL(&telemetry_mux);
+    struct sockaddr_in target = telemetry_target;
+    portEXIT_CRITICAL(&telemetry_mux);
+    if (telemetry_socket < 0 || target.sin_port == 0)
+    {
+        return;
+    }
+
+    // Every result gets a number, also when it cannot be sent, so the
+    // receiver counts it as lost
+    uint8_t datagram[TELEMETRY_SIZE];
+    telemetryPack(telemetry_sequence++, result, datagram);
+    if (sendto(telemetry_socket, datagram, sizeof(datagram), MSG_DONTWAIT,
+               (struct sockaddr *)&target, sizeof(target)) == sizeof(datagram))
+    {
+        telemetry_sent++;
+    }
+    else
+    {
+        telemetry_errors++;
+    }
+}
+
+uint32_t telemetrySent()
+{
+    return telemetry_sent;
+}
+
+uint32_t telemetryErrors()
+{
+    return telemetry_errors;
+}
@@ -0,0 +1,63 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "vision.h"
+
+// UDP telemetry. The result of every frame is sent to one host:port as a
+// datagram of a fixed size, fire and forget:
+//
+//   0  uint32 magic      TELEMETRY_MAGIC, little-endian
+//   4  uint32 sequence   Datagram number, a gap means datagrams were lost
+//   8  record            visionPack(), zero padded to VISION_RECORD_MAX
+//
+// tools/telemetry_recv.cpp receives and checks them on a host computer.
+
+#define TELEMETRY_MAGIC 0x4D4C544F // "OTLM"
+#define TELEMETRY_HEADER 8
+#define TELEMETRY_SIZE (TELEMETRY_HEADER + VISION_RECORD_MAX)
+#define TELEMETRY_DEFAULT_PORT 5005
+
+// Writes the datagram of a result, TELEMETRY_SIZE bytes
+inline void telemetryPack(uint32_t sequence, const VisionResult &result, uint8_t *out)
+{
+    uint32_t words[2] = {TELEMETRY_MAGIC, sequence};
+    for (int i = 0; i < 8; i++)
+    {
+        out[i] = (words[i / 4] >> (8 * (i % 4))) & 0xFF;
+    }
+    size_t len = visionPack(result, out + TELEMETRY_HEADER);
+    memset(out + TELEMETRY_HEADER + len, 0, VISION_RECORD_MAX - len);
+}
+
+// False if the datagram is not a telemetry datagram
+inline bool telemetryUnpack(const uint8_t *in, size_t len, uint32_t &sequence, VisionResult &result)
+{
+    if (len != TELEMETRY_SIZE)
+    {
+        return false;
+    }
+    uint32_t magic = in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+    sequence = in[4] | (in[5] << 8) | (in[6] << 16) | ((uint32_t)in[7] << 24);
+    return magic == TELEMETRY_MAGIC && visionUnpack(in + TELEMETRY_HEADER, VISION_RECORD_MAX, result);
+}
+
+// Publisher on the ESP32, see telemetry.cpp
+
+bool telemetryBegin();
+
+// Send to host (an IPv4 address) and port, port 0 stops sending
+bool telemetrySetTarget(const char *host, int port);
+
+// Current target, port 0 if not sending. host holds 16 bytes.
+int telemetryTarget(char *host);
+
+// Called by the vision task for every result, never blocks
+void telemetryPublish(const VisionResult &result);
+
+uint32_t telemetrySent();
+uint32_t telemetryErrors(); // Datagrams that the network stack refused
+
+#endif
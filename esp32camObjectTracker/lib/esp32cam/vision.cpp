@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include "vision.h"
+
+// Encodings of a VisionResult for the clients that receive a result per
+// frame instead of polling /status
+
+static uint8_t *put16(uint8_t *p, int v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    return p + 2;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v)
+{
+    p = put16(p, v & 0xFFFF);
+    return put16(p, v >> 16);
+}
+
+/**
+ * Packs a result into the binary record described in vision.h.
+ *
+ * @param result Result to pack
+ * @param out Output buffer of VISION_RECORD_MAX bytes
+ * @return Length of the record
+ */
+size_t visionPack(const VisionResult &result, uint8_t *out)
+{
+    uint8_t *p = out;
+    p = put32(p, result.frame);
+    p = put32(p, (uint64_t)result.timestamp & 0xFFFFFFFF);
+    p = put32(p, (uint64_t)result.timestamp >> 32);
+    p = put32(p, result.detectUs);
+    *p++ = result.found;
+    *p++ = result.blobCount;
+    p = put16(p, result.found ? result.left : 0);
+    p = put16(p, result.found ? result.top : 0);
+    p = put16(p, result.found ? result.right : 0);
+    p = put16(p, result.found ? result.bottom : 0);
+    for (int i = 0; i < result.blobCount; i++)
+    {
+        const Blob &b = result.blobs[i];
+        p = put16(p, b.left);
+        p = put16(p, b.top);
+        p = put16(p, b.right);
+        p = put16(p, b.bottom);
+        p = put16(p, b.cx);
+        p = put16(p, b.cy);
+        p = put32(p, b.area);
+    }
+    return p - out;
+}
+
+static int16_t get16(const uint8_t *&p)
+{
+    int16_t v = p[0] | (p[1] << 8);
+    p += 2;
+    return v;
+}
+
+static uint32_t get32(const uint8_t *&p)
+{
+    uint32_t v = (uint16_t)get16(p);
+    return v | ((uint32_t)(uint16_t)get16(p) << 16);
+}
+
+/**
+ * Unpacks a binary record, for the host tools that receive records.
+ *
+ * @param in Record
+ * @param len Bytes available at in, may include padding after the record
+ * @param result Output
+ * @return false if len is too short for the record
+ */
+bool visionUnpack(const uint8_t *in, size_t len, VisionResult &result)
+{
+    if (len < VISION_RECORD_HEADER)
+    {
+        return false;
+    }
+    const uint8_t *p = in;
+    result.frame = get32(p);
+    uint64_t low = get32(p);
+    result.timestamp = (int64_t)(low | ((uint64_t)get32(p) << 32));
+    result.detectUs = get32(p);
+    result.captureUs = result.convertUs = result.latencyUs = 0; // Not in the record
+    result.classesFound = 0;
+    result.trackScanned = result.trackPixels = 0;
+    result.found = *p++;
+    result.blobCount = *p++;
+    result.left = get16(p);
+    result.top = get16(p);
+    result.right = get16(p);
+    result.bottom = get16(p);
+    if (result.blobCount > BLOB_MAX_BLOBS ||
+        len < VISION_RECORD_HEADER + (size_t)result.blobCount * VISION_RECORD_BLOB)
+    {
+        return false;
+    }
+    for (int i = 0; i < result.blobCount; i++)
+    {
+        Blob &b = result.blobs[i];
+        b.left = get16(p);
+        b.top = get16(p);
+        b.right = get16(p);
+        b.bottom = get16(p);
+        b.cx = get16(p);
+        b.cy = get16(p);
+        b.area = get32(p);
+    }
+    return true;
+}
+
+/**
+ * Writes a result as a JSON object with the fields of the binary record.
+ *
+ * @param result Result to write
+ * @param out Output buffer of VISION_JSON_MAX bytes
+ * @return Length of the text, without the terminating 0
+ */
+size_t visionJson(const VisionResult &result, char *out)
+{
+    char *p = out;
+    p += sprintf(p, "{\"frame\":%u,\"timestamp\":%lld,\"detect_us\":%u,\"found\":%d",
+                 (unsigned)result.frame, (long long)result.timestamp, (unsigned)result.detectUs, result.found);
+    if (result.found)
+    {
+        p += sprintf(p, ",\"left\":%d,\"top\":%d,\"right\":%d,\"bottom\":%d",
+                     result.left, result.top, result.right, result.bottom);
+    }
+    p += sprintf(p, ",\"blobs\":[");
+    for (int i = 0; i < result.blobCount; i++)
+    {
+        const Blob &b = result.blobs[i];
+        p += sprintf(p, "%s{\"area\":%d,\"left\":%d,\"top\":%d,\"right\":%d,\"bottom\":%d,\"cx\":%d,\"cy\":%d}",
+                     i ? "," : "", b.area, b.left, b.top, b.right, b.bottom, b.cx, b.cy);
+    }
+    p += sprintf(p, "]}");
+    return p - out;
+}
@@ -0,0 +1,66 @@
+#ifndef VISION_H
+#define VISION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "detect.h"
+
+// Detection result of one camera frame, published by the vision task in
+// app_httpd.cpp. Readers such as /status only look at these copies, never
+// at the state of the vision task.
+struct VisionResult
+{
+    uint32_t frame;     // Frame number, 0 before the first frame
+    int64_t timestamp;  // Capture time in microseconds
+    uint32_t captureUs; // Time waiting for the camera
+    uint32_t convertUs; // Time spent converting to BMP
+    uint32_t detectUs;  // Time spent in the detection
+    uint32_t latencyUs; // From the capture to the publication of the result
+    bool found;
+    int left, top, right, bottom; // Same coordinate convention as detect()
+    int blobCount;                // DETECT_BLOBS only
+    Blob blobs[BLOB_MAX_BLOBS];
+    int classesFound;                // Bitmask of the color classes found, see detectClasses()
+    Blob classes[COLOR_MAX_CLASSES]; // Area 0 for the classes that are off or not found
+    int trackScanned;                // DETECT_TRACK only: pixels scanned for this frame
+    int trackPixels;                 // and the pixels of a full frame
+};
+
+// Start the task that captures and detects every camera frame, with the
+// settings, buffers and queues the handlers use. Call before
+// startCameraServer().
+bool startVisionTask();
+
+// Copies of the published results. They take no lock and never delay the
+// vision task, a result is never seen half written.
+
+// Latest result, false before the first frame
+bool visionLatest(VisionResult &result);
+
+// Result of a given frame, false if it is not one of the last 8 frames
+bool visionResult(uint32_t frame, VisionResult &result);
+
+// Compact binary record of a result, all fields little-endian:
+//
+//   0  uint32 frame        12 uint32 detectUs      18 int16 left, top,
+//   4  int64  timestamp    16 uint8  found            right, bottom
+//                          17 uint8  blobCount
+//
+// followed by blobCount blobs of 16 bytes: int16 left, top, right, bottom,
+// cx, cy and uint32 area.
+#define VISION_RECORD_HEADER 26
+#define VISION_RECORD_BLOB 16
+#define VISION_RECORD_MAX (VISION_RECORD_HEADER + BLOB_MAX_BLOBS * VISION_RECORD_BLOB)
+
+// Writes the record of a result to out, which holds VISION_RECORD_MAX
+// bytes, and returns its length
+size_t visionPack(const VisionResult &result, uint8_t *out);
+
+// Reads a record written by visionPack(), false if it is truncated
+bool visionUnpack(const uint8_t *in, size_t len, VisionResult &result);
+
+// Same fields as JSON, out holds VISION_JSON_MAX bytes
+#define VISION_JSON_MAX 1024
+size_t visionJson(const VisionResult &result, char *out);
+
+#endif
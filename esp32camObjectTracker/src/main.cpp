@@ -1,12 +1,9 @@
 #include <Arduino.h>
 #include <WiFi.h>
 #include "credentials.h"
+#include "vision.h"
 
 extern void esp32cam_setup();
-extern bool detect(
-    uint8_t *buf, int buf_len,
-    int red_level, int green_level, int blue_level,
-    int &left, int &top, int &right, int &bottom);
 
 void setup()
 {
@@ -28,23 +25,20 @@ void setup()
     esp32cam_setup();
 }
 
-static uint8_t *buf;
-static int buf_len;
-static int red_level = 170;  // above red level
-static int green_level = 60; // below green level
-static int blue_level = 80;  // below blue level
 // output variables
 int left, top, right, bottom;
 
 void loop()
 {
-    // Let camera take picture and look for a red object 
-    // by using the red_level, green_level and blue_level
-    if (detect(
-            buf, buf_len,
-            red_level, green_level, blue_level,
-            left, top, right, bottom)
-    ) {
+    // The vision task looks for the red object in every camera frame,
+    // using the levels set on the web page. Show its latest result.
+    VisionResult result;
+    if (visionLatest(result) && result.found)
+    {
+        left = result.left;
+        top = result.top;
+        right = result.right;
+        bottom = result.bottom;
         Serial.printf("Object: (%d,%d)-(%d,%d)\r\n", left, top, right, bottom);
     }
 
@@ -0,0 +1,599 @@
+// Load generator for the web server of the ESP32-CAM, or of the firmware
+// on the host (host/main.cpp). Runs clients of /stream, /bmp, /status and
+// /control at the same time and reports the latency percentiles of every
+// endpoint, and the frame rate and the gaps between frames of the streams.
+//
+// Build from the esp32camObjectTracker directory:
+//
+//   g++ -O2 -std=gnu++11 -pthread -o load_gen tools/load_gen.cpp
+//
+// Against the host firmware (web server on 8080, stream on 8081):
+//
+//   ./load_gen --port 8080 --stream 2 --bmp 1 --status 2 --control 1
+//
+// Every request client sends its next request interval-ms after the answer
+// to the last one, on the same connection unless --new-conn is given. A
+// stream client reads frames until the end of the run.
+//
+// Options:
+//   --host <ip>          Address of the camera (127.0.0.1)
+//   --port <n>           Port of the web server, the stream is on n+1 (80)
+//   --seconds <n>        Length of the run (10)
+//   --stream <n>         Clients of /stream (2)
+//   --bmp <n>            Clients of /bmp (1)
+//   --status <n>         Clients of /status (2)
+//   --control <n>        Clients of /control (1)
+//   --bmp-query <q>      Query of /bmp, e.g. format=jpeg (none)
+//   --control-query <q>  Query of /control (var=red_level&val=170)
+//   --interval-ms <n>    Pause between the requests of a client (100)
+//   --timeout-ms <n>     Receive timeout of a request or frame (5000)
+//   --new-conn 1         A connection per request instead of keep-alive
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+static int64_t nowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct Options
+{
+    const char *host;
+    int port;
+    int seconds;
+    int clients[4]; // Of every Endpoint
+    std::string bmp_query;
+    std::string control_query;
+    int interval_ms;
+    int timeout_ms;
+    bool new_conn;
+};
+
+enum Endpoint
+{
+    STREAM,
+    BMP,
+    STATUS,
+    CONTROL
+};
+
+static const char *ENDPOINT_PATHS[] = {"/stream", "/bmp", "/status", "/control"};
+
+// Ways a request can fail
+enum Failure
+{
+    OK,
+    FAIL_CONNECT, // Refused or no answer to the connect
+    FAIL_TIMEOUT, // No answer within timeout-ms
+    FAIL_CLOSED,  // Connection closed or reset before the whole answer
+    FAIL_STATUS,  // Answer other than 200
+    FAILURES
+};
+
+// Results of one client, merged per endpoint at the end
+struct ClientStats
+{
+    Endpoint endpoint;
+    std::vector<int64_t> latencies; // Requests, or gaps between frames
+    uint64_t failures[FAILURES];
+    uint64_t bytes;
+    int64_t first_frame; // Stream: connect to the end of the first frame
+    std::vector<int> statuses;
+};
+
+// Buffered reads on a socket with a receive timeout
+struct Conn
+{
+    int fd;
+    std::string buf;
+    Failure failure; // Of the last failed read
+
+    Conn() : fd(-1), failure(OK) {}
+    ~Conn()
+    {
+        close();
+    }
+
+    bool open(const Options &o, int port)
+    {
+        close();
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        inet_aton(o.host, &addr.sin_addr);
+        struct timeval timeout = {o.timeout_ms / 1000, (o.timeout_ms % 1000) * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        fd = -1;
+        buf.clear();
+    }
+
+    bool fill()
+    {
+        char tmp[16384];
+        ssize_t n = recv(fd, tmp, sizeof(tmp), 0);
+        if (n <= 0)
+        {
+            failure = n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? FAIL_TIMEOUT : FAIL_CLOSED;
+            return false;
+        }
+        buf.append(tmp, n);
+        return true;
+    }
+
+    bool readLine(std::string &line)
+    {
+        size_t eol;
+        while ((eol = buf.find("\r\n")) == std::string::npos)
+        {
+            if (!fill())
+            {
+                return false;
+            }
+        }
+        line = buf.substr(0, eol);
+        buf.erase(0, eol + 2);
+        return true;
+    }
+
+    // Appends n bytes to out, or drops them if out is NULL
+    bool read(size_t n, std::string *out)
+    {
+        while (buf.size() < n)
+        {
+            if (out != NULL)
+            {
+                out->append(buf);
+            }
+            n -= buf.size();
+            buf.clear();
+            if (!fill())
+            {
+                return false;
+            }
+        }
+        if (out != NULL)
+        {
+            out->append(buf, 0, n);
+        }
+        buf.erase(0, n);
+        return true;
+    }
+};
+
+// Response headers, the body is read by the caller
+struct Head
+{
+    int status;
+    long content_length; // -1 without
+    bool chunked;
+};
+
+static Failure sendRequest(Conn &c, const Options &o, const std::string &path)
+{
+    std::string request = "GET " + path + " HTTP/1.1\r\nHost: " + o.host + "\r\n\r\n";
+    return send(c.fd, request.data(), request.size(), MSG_NOSIGNAL) == (ssize_t)request.size() ? OK : FAIL_CLOSED;
+}
+
+static Failure readHead(Conn &c, Head &head)
+{
+    std::string line;
+    if (!c.readLine(line))
+    {
+        return c.failure;
+    }
+    head.status = line.size() > 12 ? atoi(line.c_str() + 9) : 0;
+    head.content_length = -1;
+    head.chunked = false;
+    while (c.readLine(line))
+    {
+        if (line.empty())
+        {
+            return OK;
+        }
+        if (!strncasecmp(line.c_str(), "Content-Length:", 15))
+        {
+            head.content_length = atol(line.c_str() + 15);
+        }
+        else if (!strncasecmp(line.c_str(), "Transfer-Encoding:", 18) && strstr(line.c_str(), "chunked"))
+        {
+            head.chunked = true;
+        }
+    }
+    return c.failure;
+}
+
+// Reads the body of a response with a length or chunked, returns its size
+static Failure readBody(Conn &c, const Head &head, size_t &bytes)
+{
+    if (!head.chunked)
+    {
+        bytes = head.content_length > 0 ? head.content_length : 0;
+        return c.read(bytes, NULL) ? OK : c.failure;
+    }
+    bytes = 0;
+    for (;;)
+    {
+        std::string line;
+        if (!c.readLine(line))
+        {
+            return c.failure;
+        }
+        size_t len = strtoul(line.c_str(), NULL, 16);
+        if (!c.read(len, NULL) || !c.readLine(line))
+        {
+            return c.failure;
+        }
+        bytes += len;
+        if (len == 0)
+        {
+            return OK;
+        }
+    }
+}
+
+static void requestClient(const Options &o, Endpoint endpoint, int64_t end, ClientStats &stats)
+{
+    std::string path = ENDPOINT_PATHS[endpoint];
+    std::string query = endpoint == BMP ? o.bmp_query : endpoint == CONTROL ? o.control_query : "";
+    if (!query.empty())
+    {
+        path += "?" + query;
+    }
+
+    Conn c;
+    while (nowUs() < end)
+    {
+        int64_t start = nowUs();
+        Failure f = OK;
+        if (c.fd < 0 && !c.open(o, o.port))
+        {
+            f = FAIL_CONNECT;
+        }
+        Head head;
+        size_t bytes = 0;
+        if (f == OK)
+        {
+            f = sendRequest(c, o, path);
+        }
+        if (f == OK)
+        {
+            f = readHead(c, head);
+        }
+        if (f == OK)
+        {
+            f = readBody(c, head, bytes);
+        }
+        if (f == OK && head.status != 200)
+        {
+            f = FAIL_STATUS;
+            stats.statuses.push_back(head.status);
+        }
+        if (f == OK || f == FAIL_STATUS)
+        {
+            stats.latencies.push_back(nowUs() - start);
+            stats.bytes += bytes;
+        }
+        stats.failures[f]++;
+        if (f != OK && f != FAIL_STATUS)
+        {
+            c.close();
+        }
+        if (o.new_conn)
+        {
+            c.close();
+        }
+        usleep(o.interval_ms * 1000);
+    }
+}
+
+// Reads the multipart stream until the end of the run, a frame is a part
+// with a Content-Length. Reconnects when the stream fails.
+static void streamClient(const Options &o, int64_t end, ClientStats &stats)
+{
+    stats.first_frame = -1;
+    while (nowUs() < end)
+    {
+        Conn c;
+        int64_t start = nowUs();
+        if (!c.open(o, o.port + 1))
+        {
+            stats.failures[FAIL_CONNECT]++;
+            usleep(o.interval_ms * 1000);
+            continue;
+        }
+        Head head;
+        Failure f = sendRequest(c, o, "/stream");
+        if (f == OK)
+        {
+            f = readHead(c, head);
+        }
+        if (f == OK && head.status != 200)
+        {
+            stats.statuses.push_back(head.status);
+            f = FAIL_STATUS;
+        }
+
+        // Undo the chunked encoding into body and take the parts from it
+        std::string body;
+        int64_t last = -1;
+        while (f == OK && nowUs() < end)
+        {
+            std::string line;
+            if (!c.readLine(line))
+            {
+                f = c.failure;
+                break;
+            }
+            size_t len = strtoul(line.c_str(), NULL, 16);
+            if (len == 0 || !c.read(len, &body) || !c.readLine(line))
+            {
+                f = len == 0 ? FAIL_CLOSED : c.failure;
+                break;
+            }
+            for (;;)
+            {
+                size_t header_end = body.find("\r\n\r\n");
+                size_t field = body.find("Content-Length: ");
+                if (header_end == std::string::npos || field == std::string::npos || field > header_end)
+                {
+                    break;
+                }
+                size_t frame_len = strtoul(body.c_str() + field + 16, NULL, 10);
+                if (body.size() < header_end + 4 + frame_len)
+                {
+                    break;
+                }
+                body.erase(0, header_end + 4 + frame_len);
+                int64_t now = nowUs();
+                if (last >= 0)
+                {
+                    stats.latencies.push_back(now - last);
+                }
+                else if (stats.first_frame < 0)
+                {
+                    stats.first_frame = now - start;
+                }
+                last = now;
+                stats.failures[OK]++;
+                stats.bytes += frame_len;
+            }
+        }
+        if (f != OK)
+        {
+            stats.failures[f]++;
+            usleep(o.interval_ms * 1000);
+        }
+    }
+}
+
+static int64_t percentile(std::vector<int64_t> &values, int p)
+{
+    if (values.empty())
+    {
+        return 0;
+    }
+    size_t i = std::min(values.size() - 1, values.size() * p / 100);
+    std::nth_element(values.begin(), values.begin() + i, values.end());
+    return values[i];
+}
+
+static void usage()
+{
+    fprintf(stderr, "load_gen [options]\n"
+                    "  --host <ip>          Address of the camera (127.0.0.1)\n"
+                    "  --port <n>           Port of the web server, the stream is on n+1 (80)\n"
+                    "  --seconds <n>        Length of the run (10)\n"
+                    "  --stream <n>         Clients of /stream (2)\n"
+                    "  --bmp <n>            Clients of /bmp (1)\n"
+                    "  --status <n>         Clients of /status (2)\n"
+                    "  --control <n>        Clients of /control (1)\n"
+                    "  --bmp-query <q>      Query of /bmp, e.g. format=jpeg (none)\n"
+                    "  --control-query <q>  Query of /control (var=red_level&val=170)\n"
+                    "  --interval-ms <n>    Pause between the requests of a client (100)\n"
+                    "  --timeout-ms <n>     Receive timeout of a request or frame (5000)\n"
+                    "  --new-conn 1         A connection per request instead of keep-alive\n");
+}
+
+int main(int argc, char **argv)
+{
+    Options o;
+    o.host = "127.0.0.1";
+    o.port = 80;
+    o.seconds = 10;
+    o.clients[STREAM] = 2;
+    o.clients[BMP] = 1;
+    o.clients[STATUS] = 2;
+    o.clients[CONTROL] = 1;
+    o.control_query = "var=red_level&val=170";
+    o.interval_ms = 100;
+    o.timeout_ms = 5000;
+    o.new_conn = false;
+
+    for (int i = 1; i < argc; i += 2)
+    {
+        const char *name = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (value == NULL)
+        {
+            usage();
+            return 1;
+        }
+        if (!strcmp(name, "--host"))
+        {
+            o.host = value;
+        }
+        else if (!strcmp(name, "--port"))
+        {
+            o.port = atoi(value);
+        }
+        else if (!strcmp(name, "--seconds"))
+        {
+            o.seconds = std::max(1, atoi(value));
+        }
+        else if (!strcmp(name, "--stream"))
+        {
+            o.clients[STREAM] = std::max(0, atoi(value));
+        }
+        else if (!strcmp(name, "--bmp"))
+        {
+            o.clients[BMP] = std::max(0, atoi(value));
+        }
+        else if (!strcmp(name, "--status"))
+        {
+            o.clients[STATUS] = std::max(0, atoi(value));
+        }
+        else if (!strcmp(name, "--control"))
+        {
+            o.clients[CONTROL] = std::max(0, atoi(value));
+        }
+        else if (!strcmp(name, "--bmp-query"))
+        {
+            o.bmp_query = value;
+        }
+        else if (!strcmp(name, "--control-query"))
+        {
+            o.control_query = value;
+        }
+        else if (!strcmp(name, "--interval-ms"))
+        {
+            o.interval_ms = std::max(0, atoi(value));
+        }
+        else if (!strcmp(name, "--timeout-ms"))
+        {
+            o.timeout_ms = std::max(1, atoi(value));
+        }
+        else if (!strcmp(name, "--new-conn"))
+        {
+            o.new_conn = atoi(value) != 0;
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<ClientStats> stats;
+    for (int e = STREAM; e <= CONTROL; e++)
+    {
+        for (int i = 0; i < o.clients[e]; i++)
+        {
+            ClientStats s = {};
+            s.endpoint = (Endpoint)e;
+            stats.push_back(s);
+        }
+    }
+    int64_t start = nowUs();
+    int64_t end = start + (int64_t)o.seconds * 1000000;
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < stats.size(); i++)
+    {
+        if (stats[i].endpoint == STREAM)
+        {
+            threads.push_back(std::thread(streamClient, std::cref(o), end, std::ref(stats[i])));
+        }
+        else
+        {
+            threads.push_back(std::thread(requestClient, std::cref(o), stats[i].endpoint, end, std::ref(stats[i])));
+        }
+    }
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+    double elapsed = (nowUs() - start) / 1e6;
+
+    // Requests: latency from sending (or connecting) to the end of the
+    // answer. Streams: frames and the gaps between them.
+    printf("%-9s %7s %8s %7s %8s %9s %9s %9s %9s %7s %7s %7s %7s\n", "endpoint", "clients", "answers", "per s",
+           "kB/s", "p50 ms", "p90 ms", "p99 ms", "max ms", "connect", "timeout", "closed", "status");
+    for (int e = STREAM; e <= CONTROL; e++)
+    {
+        std::vector<int64_t> latencies;
+        uint64_t failures[FAILURES] = {};
+        uint64_t bytes = 0;
+        std::vector<int64_t> first_frames;
+        std::vector<int> statuses;
+        for (size_t i = 0; i < stats.size(); i++)
+        {
+            ClientStats &s = stats[i];
+            if (s.endpoint != e)
+            {
+                continue;
+            }
+            latencies.insert(latencies.end(), s.latencies.begin(), s.latencies.end());
+            for (int f = 0; f < FAILURES; f++)
+            {
+                failures[f] += s.failures[f];
+            }
+            bytes += s.bytes;
+            if (e == STREAM && s.first_frame >= 0)
+            {
+                first_frames.push_back(s.first_frame);
+            }
+            statuses.insert(statuses.end(), s.statuses.begin(), s.statuses.end());
+        }
+        if (o.clients[e] == 0)
+        {
+            continue;
+        }
+        uint64_t answers = e == STREAM ? failures[OK] : latencies.size();
+        int64_t latency_max = latencies.empty() ? 0 : *std::max_element(latencies.begin(), latencies.end());
+        printf("%-9s %7d %8llu %7.1f %8.1f %9.1f %9.1f %9.1f %9.1f %7llu %7llu %7llu %7llu\n", ENDPOINT_PATHS[e],
+               o.clients[e], (unsigned long long)answers, answers / elapsed, bytes / 1024.0 / elapsed,
+               percentile(latencies, 50) / 1000.0, percentile(latencies, 90) / 1000.0,
+               percentile(latencies, 99) / 1000.0, latency_max / 1000.0, (unsigned long long)failures[FAIL_CONNECT],
+               (unsigned long long)failures[FAIL_TIMEOUT], (unsigned long long)failures[FAIL_CLOSED],
+               (unsigned long long)failures[FAIL_STATUS]);
+        if (!first_frames.empty())
+        {
+            printf("%-9s first frame after p50 %.1f ms, max %.1f ms\n", "", percentile(first_frames, 50) / 1000.0,
+                   *std::max_element(first_frames.begin(), first_frames.end()) / 1000.0);
+        }
+        if (!statuses.empty())
+        {
+            std::sort(statuses.begin(), statuses.end());
+            printf("%-9s status", "");
+            for (size_t i = 0; i < statuses.size(); i = std::upper_bound(statuses.begin(), statuses.end(), statuses[i]) - statuses.begin())
+            {
+                printf(" %d x%d", statuses[i], (int)std::count(statuses.begin(), statuses.end(), statuses[i]));
+            }
+            printf("\n");
+        }
+    }
+    printf("Stream rows count frames, their percentiles are the gaps between frames.\n");
+    return 0;
+}
@@ -0,0 +1,201 @@
+// Receiver for the UDP telemetry of the ESP32-CAM (telemetry.h). Prints
+// the datagram rate, the datagrams lost or out of order and the arrival
+// jitter once per second, with the latest box.
+//
+// Build from the esp32camObjectTracker directory:
+//
+//   g++ -O2 -std=gnu++11 -Ilib/esp32cam -o telemetry_recv
+//       tools/telemetry_recv.cpp lib/esp32cam/vision.cpp
+//
+// Receive on the default port 5005 after /telemetry?host=<this host>:
+//
+//   ./telemetry_recv [port]
+//
+// Without a camera, send synthetic results to a receiver, dropping a share
+// of them to check the loss count:
+//
+//   ./telemetry_recv --send 127.0.0.1 5005 [rate] [count] [drop percent]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "telemetry.h"
+
+static int64_t nowUs()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// Counters of the datagrams received since the start or the last report
+struct Stats
+{
+    uint64_t received;
+    uint64_t lost;      // Gaps in the sequence numbers
+    uint64_t reordered; // Older than a datagram received before
+};
+
+static int receive(int port)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("bind");
+        return 1;
+    }
+    struct timeval timeout = {0, 100000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    printf("Listening on UDP port %d\n", port);
+
+    Stats total = {}, interval = {};
+    bool first = true;
+    uint32_t next = 0; // Sequence number expected next
+    double jitter = 0; // RFC 3550 interarrival jitter in microseconds
+    int64_t lastTransit = 0;
+    int64_t lastReport = nowUs();
+    VisionResult result = {};
+
+    for (;;)
+    {
+        uint8_t buf[TELEMETRY_SIZE + 1];
+        ssize_t len = recv(fd, buf, sizeof(buf), 0);
+        int64_t arrival = nowUs();
+        uint32_t sequence;
+        if (len > 0 && telemetryUnpack(buf, len, sequence, result))
+        {
+            interval.received++;
+            if (first || sequence == next)
+            {
+                next = sequence + 1;
+            }
+            else if ((int32_t)(sequence - next) > 0)
+            {
+                interval.lost += sequence - next;
+                next = sequence + 1;
+            }
+            else
+            {
+                interval.reordered++;
+                if (interval.lost > 0)
+                {
+                    interval.lost--; // Counted as lost when the gap was seen
+                }
+            }
+
+            // Transit time with the sensor clock as the send time, only its
+            // changes matter
+            int64_t transit = arrival - result.timestamp;
+            if (!first)
+            {
+                jitter += (fabs((double)(transit - lastTransit)) - jitter) / 16;
+            }
+            lastTransit = transit;
+            first = false;
+        }
+        else if (len > 0)
+        {
+            fprintf(stderr, "Ignored a datagram of %d bytes\n", (int)len);
+        }
+
+        if (arrival - lastReport >= 1000000)
+        {
+            total.received += interval.received;
+            total.lost += interval.lost;
+            total.reordered += interval.reordered;
+            double seconds = (arrival - lastReport) / 1e6;
+            uint64_t expected = total.received + total.lost;
+            printf("%6.1f/s  lost %llu (%.2f%% total)  reordered %llu  jitter %.2f ms  frame %u",
+                   interval.received / seconds, (unsigned long long)interval.lost,
+                   expected ? 100.0 * total.lost / expected : 0.0,
+                   (unsigned long long)interval.reordered, jitter / 1000, result.frame);
+            if (result.found)
+            {
+                printf("  box %d,%d %d,%d", result.left, result.top, result.right, result.bottom);
+            }
+            printf("  blobs %d\n", result.blobCount);
+            fflush(stdout);
+            interval = Stats();
+            lastReport = arrival;
+        }
+    }
+}
+
+static int sendSynthetic(const char *host, int port, int rate, int count, int drop)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (fd < 0 || inet_aton(host, &addr.sin_addr) == 0)
+    {
+        fprintf(stderr, "Bad host %s\n", host);
+        return 1;
+    }
+
+    int dropped = 0;
+    int64_t start = nowUs();
+    for (int i = 0; i < count; i++)
+    {
+        // An object moving over a QQVGA frame
+        VisionResult result = {};
+        result.frame = i + 1;
+        result.timestamp = nowUs();
+        result.found = true;
+        result.left = (i * 2) % 140;
+        result.right = result.left + 19;
+        result.top = 70;
+        result.bottom = 51;
+        result.blobCount = 1;
+        Blob &b = result.blobs[0];
+        b.left = result.left;
+        b.right = result.right;
+        b.top = result.top;
+        b.bottom = result.bottom;
+        b.area = 400;
+        b.cx = result.left + 10;
+        b.cy = 60;
+
+        uint8_t datagram[TELEMETRY_SIZE];
+        telemetryPack(i, result, datagram);
+        if (rand() % 100 < drop)
+        {
+            dropped++;
+        }
+        else
+        {
+            sendto(fd, datagram, sizeof(datagram), 0, (struct sockaddr *)&addr, sizeof(addr));
+        }
+
+        int64_t due = start + (int64_t)(i + 1) * 1000000 / rate;
+        int64_t wait = due - nowUs();
+        if (wait > 0)
+        {
+            usleep(wait);
+        }
+    }
+    printf("Sent %d datagrams, dropped %d\n", count - dropped, dropped);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc >= 4 && !strcmp(argv[1], "--send"))
+    {
+        int rate = argc > 4 ? atoi(argv[4]) : 25;
+        int count = argc > 5 ? atoi(argv[5]) : rate * 10;
+        int drop = argc > 6 ? atoi(argv[6]) : 0;
+        return sendSynthetic(argv[2], atoi(argv[3]), rate > 0 ? rate : 25, count, drop);
+    }
+    return receive(argc > 1 ? atoi(argv[1]) : TELEMETRY_DEFAULT_PORT);
+}